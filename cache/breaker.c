@@ -0,0 +1,171 @@
+/* This engine processes requests for coreference graphs populated
+ * by Twine's "spindle" post-processing module.
+ *
+ * Author: Mo McRoberts <mo.mcroberts@bbc.co.uk>
+ *
+ * Copyright (c) 2014-2017 BBC
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include "p_patchwork.h"
+
+#include <time.h>
+
+/* A circuit breaker tracks the outcomes of recent requests to a back-end.
+ *
+ * While closed, requests are passed through; once enough of the recent
+ * requests have failed (or were too slow), the circuit opens and requests
+ * are refused immediately so that callers can fall back to something else.
+ *
+ * After the cool-down period has elapsed, a single probe request is
+ * permitted (the circuit is half-open): if it succeeds, the circuit closes
+ * again, otherwise it re-opens for another cool-down period.
+ */
+
+static void patchwork_breaker_reset_(struct patchwork_breaker_struct *breaker);
+static long patchwork_breaker_now_(void);
+
+int
+patchwork_breaker_init(struct patchwork_breaker_struct *breaker, const char *name, int threshold, long slow, long cooldown)
+{
+	memset(breaker, 0, sizeof(struct patchwork_breaker_struct));
+	pthread_mutex_init(&(breaker->lock), NULL);
+	breaker->name = name;
+	breaker->state = PB_CLOSED;
+	breaker->threshold = threshold;
+	breaker->slow = slow;
+	breaker->cooldown = cooldown;
+	return 0;
+}
+
+/* Returns non-zero if a request should be attempted */
+int
+patchwork_breaker_allow(struct patchwork_breaker_struct *breaker)
+{
+	int r;
+
+	if(breaker->threshold <= 0)
+	{
+		return 1;
+	}
+	pthread_mutex_lock(&(breaker->lock));
+	switch(breaker->state)
+	{
+	case PB_CLOSED:
+		r = 1;
+		break;
+	case PB_OPEN:
+		if(patchwork_breaker_now_() - breaker->opened >= breaker->cooldown)
+		{
+			/* Let this request through as a probe */
+			quilt_logf(LOG_NOTICE, QUILT_PLUGIN_NAME ": %s: circuit is half-open; probing back-end\n", breaker->name);
+			breaker->state = PB_HALF_OPEN;
+			r = 1;
+		}
+		else
+		{
+			r = 0;
+		}
+		break;
+	default:
+		/* A probe is already in flight */
+		r = 0;
+	}
+	pthread_mutex_unlock(&(breaker->lock));
+	return r;
+}
+
+/* Record the outcome of a request which was permitted by
+ * patchwork_breaker_allow()
+ */
+int
+patchwork_breaker_record(struct patchwork_breaker_struct *breaker, int failed, long ms)
+{
+	if(breaker->threshold <= 0)
+	{
+		return 0;
+	}
+	if(!failed && breaker->slow > 0 && ms > breaker->slow)
+	{
+		failed = 1;
+	}
+	pthread_mutex_lock(&(breaker->lock));
+	if(breaker->state == PB_HALF_OPEN)
+	{
+		if(failed)
+		{
+			quilt_logf(LOG_WARNING, QUILT_PLUGIN_NAME ": %s: probe failed; circuit re-opened for %lds\n", breaker->name, breaker->cooldown);
+			breaker->state = PB_OPEN;
+			breaker->opened = patchwork_breaker_now_();
+		}
+		else
+		{
+			quilt_logf(LOG_NOTICE, QUILT_PLUGIN_NAME ": %s: probe succeeded; circuit closed\n", breaker->name);
+			breaker->state = PB_CLOSED;
+			patchwork_breaker_reset_(breaker);
+		}
+		pthread_mutex_unlock(&(breaker->lock));
+		return 0;
+	}
+	if(breaker->state == PB_OPEN)
+	{
+		/* A request which started before the circuit opened */
+		pthread_mutex_unlock(&(breaker->lock));
+		return 0;
+	}
+	if(breaker->count == PATCHWORK_BREAKER_WINDOW)
+	{
+		breaker->failures -= breaker->window[breaker->next];
+	}
+	else
+	{
+		breaker->count++;
+	}
+	breaker->window[breaker->next] = (failed ? 1 : 0);
+	breaker->failures += breaker->window[breaker->next];
+	breaker->next = (breaker->next + 1) % PATCHWORK_BREAKER_WINDOW;
+	if(breaker->count >= PATCHWORK_BREAKER_MINIMUM &&
+	   breaker->failures * 100 >= breaker->count * (size_t) breaker->threshold)
+	{
+		quilt_logf(LOG_WARNING, QUILT_PLUGIN_NAME ": %s: %lu of the last %lu requests failed; circuit opened for %lds\n", breaker->name, (unsigned long) breaker->failures, (unsigned long) breaker->count, breaker->cooldown);
+		breaker->state = PB_OPEN;
+		breaker->opened = patchwork_breaker_now_();
+		patchwork_breaker_reset_(breaker);
+	}
+	pthread_mutex_unlock(&(breaker->lock));
+	return 0;
+}
+
+static void
+patchwork_breaker_reset_(struct patchwork_breaker_struct *breaker)
+{
+	memset(breaker->window, 0, sizeof(breaker->window));
+	breaker->next = 0;
+	breaker->count = 0;
+	breaker->failures = 0;
+}
+
+/* Return a monotonic timestamp in seconds */
+static long
+patchwork_breaker_now_(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (long) ts.tv_sec;
+}
@@ -0,0 +1,560 @@
+/* This engine processes requests for coreference graphs populated
+ * by Twine's "spindle" post-processing module.
+ *
+ * Author: Mo McRoberts <mo.mcroberts@bbc.co.uk>
+ *
+ * Copyright (c) 2014-2017 BBC
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+/* Required for statx() and AT_EMPTY_PATH */
+#define _GNU_SOURCE                    1
+
+#include "p_patchwork.h"
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#ifdef WITH_LIBURING
+# include <liburing.h>
+#endif
+
+/* Bulk retrieval of items from the file cache.
+ *
+ * Where io_uring is available, the items are processed in batches of up
+ * to PATCHWORK_BULK_DEPTH: the opens for a whole batch are submitted
+ * together, then the size queries, then the reads (resubmitting any
+ * short reads), then the closes, so that the device sees many requests
+ * in flight rather than one at a time. Packed items are served straight
+ * from their mapping, and sidecar metadata is read synchronously.
+ *
+ * Otherwise, each item is fetched in turn with patchwork_file_fetch(). If
+ * submitting to or waiting on the ring fails, its state can't be relied
+ * upon, so it is torn down and the remaining items (including those of the
+ * batch in progress) are fetched in the same way.
+ *
+ * If the memory:warm configuration option names a file listing item IDs
+ * (one per line), a background thread uses this to load those items into
+ * the in-memory cache at start-up.
+ */
+
+static void *patchwork_bulk_warm_thread_(void *arg);
+static size_t patchwork_bulk_warm_batch_(char **ids, size_t n);
+
+#ifdef WITH_LIBURING
+struct bulk_item_struct
+{
+	const char *id;
+	struct patchwork_object_struct *obj;
+	int *status;
+	char *path;
+	int fd;
+	int pending;
+	/* Non-zero while an operation for the item has been submitted but
+	 * not yet completed */
+	int inflight;
+	size_t size;
+	size_t done;
+	struct statx stx;
+};
+
+typedef int (*bulk_prep_fn)(struct io_uring_sqe *sqe, struct bulk_item_struct *item);
+typedef void (*bulk_complete_fn)(struct bulk_item_struct *item, int res);
+
+static int patchwork_bulk_batch_(struct io_uring *ring, struct bulk_item_struct *items, size_t n);
+static void patchwork_bulk_abandon_(struct bulk_item_struct *items, size_t n);
+static int patchwork_bulk_run_(struct io_uring *ring, struct bulk_item_struct *items, size_t n, bulk_prep_fn prep, bulk_complete_fn complete);
+static int patchwork_bulk_prep_open_(struct io_uring_sqe *sqe, struct bulk_item_struct *item);
+static void patchwork_bulk_complete_open_(struct bulk_item_struct *item, int res);
+static int patchwork_bulk_prep_statx_(struct io_uring_sqe *sqe, struct bulk_item_struct *item);
+static void patchwork_bulk_complete_statx_(struct bulk_item_struct *item, int res);
+static int patchwork_bulk_prep_read_(struct io_uring_sqe *sqe, struct bulk_item_struct *item);
+static void patchwork_bulk_complete_read_(struct bulk_item_struct *item, int res);
+static int patchwork_bulk_prep_close_(struct io_uring_sqe *sqe, struct bulk_item_struct *item);
+static void patchwork_bulk_complete_close_(struct bulk_item_struct *item, int res);
+#endif
+
+/* Fetch the raw objects for a set of items from the on-disk cache,
+ * setting status[n] to the result for each (as patchwork_file_fetch()
+ * would return it)
+ */
+int
+patchwork_file_fetch_many(const char *const *ids, size_t n, struct patchwork_object_struct *objs, int *status)
+{
+	size_t c, start;
+#ifdef WITH_LIBURING
+	struct bulk_item_struct *items;
+	struct io_uring ring;
+	size_t batch;
+	int r;
+#endif
+
+	for(c = 0; c < n; c++)
+	{
+		memset(&(objs[c]), 0, sizeof(struct patchwork_object_struct));
+		status[c] = 404;
+	}
+	start = 0;
+#ifdef WITH_LIBURING
+	r = io_uring_queue_init(PATCHWORK_BULK_DEPTH, &ring, 0);
+	if(r < 0)
+	{
+		quilt_logf(LOG_NOTICE, QUILT_PLUGIN_NAME ": file: io_uring is not available (%s); reading items individually\n", strerror(-r));
+	}
+	else
+	{
+		items = (struct bulk_item_struct *) calloc(PATCHWORK_BULK_DEPTH, sizeof(struct bulk_item_struct));
+		if(!items)
+		{
+			quilt_logf(LOG_CRIT, QUILT_PLUGIN_NAME ": failed to allocate memory for bulk read\n");
+			io_uring_queue_exit(&ring);
+			return -1;
+		}
+		for(c = 0; c < n; c += batch)
+		{
+			batch = (n - c < PATCHWORK_BULK_DEPTH ? n - c : PATCHWORK_BULK_DEPTH);
+			memset(items, 0, sizeof(struct bulk_item_struct) * batch);
+			for(r = 0; (size_t) r < batch; r++)
+			{
+				items[r].id = ids[c + r];
+				items[r].obj = &(objs[c + r]);
+				items[r].status = &(status[c + r]);
+			}
+			if(patchwork_bulk_batch_(&ring, items, batch))
+			{
+				break;
+			}
+		}
+		io_uring_queue_exit(&ring);
+		if(c < n)
+		{
+			quilt_logf(LOG_ERR, QUILT_PLUGIN_NAME ": file: bulk I/O failed; reading the remaining items individually\n");
+			patchwork_bulk_abandon_(items, batch);
+			start = c;
+		}
+		else
+		{
+			start = n;
+		}
+		free(items);
+	}
+#endif
+	for(c = start; c < n; c++)
+	{
+		status[c] = patchwork_file_fetch(ids[c], &(objs[c]));
+	}
+	return 0;
+}
+
+/* Start warming the in-memory cache from the file cache, if configured */
+int
+patchwork_bulk_warm(void)
+{
+	pthread_attr_t attr;
+	pthread_t thread;
+	char *t;
+	int r;
+
+	if(!patchwork->cache.memory || !(t = quilt_config_geta("memory:warm", NULL)))
+	{
+		return 0;
+	}
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	r = pthread_create(&thread, &attr, patchwork_bulk_warm_thread_, t);
+	pthread_attr_destroy(&attr);
+	if(r)
+	{
+		quilt_logf(LOG_CRIT, QUILT_PLUGIN_NAME ": failed to start in-memory cache warming thread: %s\n", strerror(r));
+		free(t);
+		return -1;
+	}
+	return 0;
+}
+
+static void *
+patchwork_bulk_warm_thread_(void *arg)
+{
+	char *listpath, *ids[PATCHWORK_BULK_DEPTH];
+	char line[128];
+	size_t n, l, total;
+	FILE *f;
+
+	listpath = (char *) arg;
+	f = fopen(listpath, "r");
+	if(!f)
+	{
+		quilt_logf(LOG_ERR, QUILT_PLUGIN_NAME ": failed to open %s: %s\n", listpath, strerror(errno));
+		free(listpath);
+		return NULL;
+	}
+	n = 0;
+	total = 0;
+	while(fgets(line, sizeof(line), f))
+	{
+		l = strlen(line);
+		while(l && isspace(line[l - 1]))
+		{
+			l--;
+		}
+		line[l] = 0;
+		if(l != 32)
+		{
+			continue;
+		}
+		ids[n] = strdup(line);
+		if(!ids[n])
+		{
+			break;
+		}
+		n++;
+		if(n == PATCHWORK_BULK_DEPTH)
+		{
+			total += patchwork_bulk_warm_batch_(ids, n);
+			n = 0;
+		}
+	}
+	total += patchwork_bulk_warm_batch_(ids, n);
+	fclose(f);
+	quilt_logf(LOG_INFO, QUILT_PLUGIN_NAME ": in-memory cache: loaded %lu items listed in %s\n", (unsigned long) total, listpath);
+	free(listpath);
+	return NULL;
+}
+
+/* Fetch a batch of items and offer them to the in-memory cache, returning
+ * the number found
+ */
+static size_t
+patchwork_bulk_warm_batch_(char **ids, size_t n)
+{
+	struct patchwork_object_struct objs[PATCHWORK_BULK_DEPTH];
+	int status[PATCHWORK_BULK_DEPTH];
+	size_t c, found;
+
+	found = 0;
+	if(n && !patchwork_file_fetch_many((const char *const *) ids, n, objs, status))
+	{
+		for(c = 0; c < n; c++)
+		{
+			if(status[c] != 200)
+			{
+				continue;
+			}
+			/* Graphs synthesised from the database aren't held in memory */
+			if(!objs[c].expires)
+			{
+				patchwork_memory_store(ids[c], &(objs[c]));
+			}
+			patchwork_object_free(&(objs[c]));
+			found++;
+		}
+	}
+	for(c = 0; c < n; c++)
+	{
+		free(ids[c]);
+	}
+	return found;
+}
+
+#ifdef WITH_LIBURING
+/* Fetch a batch of items, returning -1 if the ring failed, in which case
+ * the items must be cleaned up with patchwork_bulk_abandon() once the ring
+ * has been torn down
+ */
+static int
+patchwork_bulk_batch_(struct io_uring *ring, struct bulk_item_struct *items, size_t n)
+{
+	size_t c;
+	int r;
+
+	for(c = 0; c < n; c++)
+	{
+		items[c].fd = -1;
+		if(strlen(items[c].id) != 32)
+		{
+			continue;
+		}
+#ifdef WITH_ZSTD
+		items[c].obj->encoding = PE_ZSTD;
+		items[c].path = patchwork_file_path(items[c].id, ".zst");
+#else
+		items[c].path = patchwork_file_path(items[c].id, NULL);
+#endif
+		if(!items[c].path)
+		{
+			*(items[c].status) = 500;
+			continue;
+		}
+		items[c].pending = 1;
+	}
+	r = patchwork_bulk_run_(ring, items, n, patchwork_bulk_prep_open_, patchwork_bulk_complete_open_);
+#ifdef WITH_ZSTD
+	/* Open the uncompressed copies of items which have no compressed one */
+	for(c = 0; r >= 0 && c < n; c++)
+	{
+		if(items[c].path && items[c].fd == -1 && *(items[c].status) == 404)
+		{
+			free(items[c].path);
+			items[c].obj->encoding = PE_IDENTITY;
+			items[c].path = patchwork_file_path(items[c].id, NULL);
+			items[c].pending = (items[c].path ? 1 : 0);
+		}
+	}
+	if(r >= 0)
+	{
+		r = patchwork_bulk_run_(ring, items, n, patchwork_bulk_prep_open_, patchwork_bulk_complete_open_);
+	}
+#endif
+	if(r >= 0)
+	{
+		for(c = 0; c < n; c++)
+		{
+			items[c].pending = (items[c].fd != -1);
+		}
+		r = patchwork_bulk_run_(ring, items, n, patchwork_bulk_prep_statx_, patchwork_bulk_complete_statx_);
+	}
+	if(r >= 0)
+	{
+		for(c = 0; c < n; c++)
+		{
+			items[c].pending = (items[c].obj->buf && items[c].done < items[c].size);
+		}
+		/* Resubmit short reads until every item is complete */
+		while((r = patchwork_bulk_run_(ring, items, n, patchwork_bulk_prep_read_, patchwork_bulk_complete_read_)) > 0);
+	}
+	if(r >= 0)
+	{
+		for(c = 0; c < n; c++)
+		{
+			items[c].pending = (items[c].fd != -1);
+		}
+		r = patchwork_bulk_run_(ring, items, n, patchwork_bulk_prep_close_, patchwork_bulk_complete_close_);
+	}
+	if(r < 0)
+	{
+		return -1;
+	}
+	for(c = 0; c < n; c++)
+	{
+		if(items[c].path && items[c].obj->buf)
+		{
+			if(*(items[c].status) == 500)
+			{
+				patchwork_object_free(items[c].obj);
+			}
+			else
+			{
+				items[c].obj->len = items[c].done;
+				items[c].obj->buf[items[c].done] = 0;
+				*(items[c].status) = patchwork_file_finish(items[c].id, items[c].obj);
+			}
+		}
+		free(items[c].path);
+		items[c].path = NULL;
+		/* Items with no individual file may be in the packfiles */
+		if(*(items[c].status) == 404 && !items[c].obj->buf && !patchwork_pack_lookup(items[c].id, items[c].obj))
+		{
+			*(items[c].status) = 200;
+		}
+	}
+	return 0;
+}
+
+/* Release whatever a failed batch has acquired, so that its items can be
+ * fetched individually. Anything an operation was still in flight for is
+ * left alone (and so leaked): the kernel may yet write to the buffer, or
+ * close the descriptor, which could by then have been reused.
+ */
+static void
+patchwork_bulk_abandon_(struct bulk_item_struct *items, size_t n)
+{
+	size_t c;
+
+	for(c = 0; c < n; c++)
+	{
+		if(!items[c].inflight)
+		{
+			if(items[c].fd != -1)
+			{
+				close(items[c].fd);
+			}
+			patchwork_object_free(items[c].obj);
+		}
+		memset(items[c].obj, 0, sizeof(struct patchwork_object_struct));
+		*(items[c].status) = 404;
+		free(items[c].path);
+		items[c].path = NULL;
+	}
+}
+
+/* Submit one operation for each pending item and wait for them all to
+ * complete, returning the number submitted, or -1 if submission or
+ * waiting failed (leaving the ring in an unknown state)
+ */
+static int
+patchwork_bulk_run_(struct io_uring *ring, struct bulk_item_struct *items, size_t n, bulk_prep_fn prep, bulk_complete_fn complete)
+{
+	struct io_uring_sqe *sqe;
+	struct io_uring_cqe *cqe;
+	struct bulk_item_struct *item;
+	int submitted, c, r, e;
+	size_t i;
+
+	submitted = 0;
+	for(i = 0; i < n; i++)
+	{
+		if(!items[i].pending)
+		{
+			continue;
+		}
+		sqe = io_uring_get_sqe(ring);
+		if(!sqe)
+		{
+			break;
+		}
+		prep(sqe, &(items[i]));
+		io_uring_sqe_set_data(sqe, &(items[i]));
+		items[i].inflight = 1;
+		submitted++;
+	}
+	if(!submitted)
+	{
+		return 0;
+	}
+	r = io_uring_submit(ring);
+	if(r < 0)
+	{
+		quilt_logf(LOG_ERR, QUILT_PLUGIN_NAME ": file: failed to submit bulk I/O: %s\n", strerror(-r));
+		return -1;
+	}
+	for(c = 0; c < r; c++)
+	{
+		while((e = io_uring_wait_cqe(ring, &cqe)) == -EINTR);
+		if(e < 0)
+		{
+			quilt_logf(LOG_ERR, QUILT_PLUGIN_NAME ": file: failed to wait for bulk I/O: %s\n", strerror(-e));
+			return -1;
+		}
+		item = (struct bulk_item_struct *) io_uring_cqe_get_data(cqe);
+		item->inflight = 0;
+		complete(item, cqe->res);
+		io_uring_cqe_seen(ring, cqe);
+	}
+	if(r < submitted)
+	{
+		quilt_logf(LOG_ERR, QUILT_PLUGIN_NAME ": file: only %d of %d bulk I/O operations were submitted\n", r, submitted);
+		return -1;
+	}
+	return submitted;
+}
+
+static int
+patchwork_bulk_prep_open_(struct io_uring_sqe *sqe, struct bulk_item_struct *item)
+{
+	io_uring_prep_openat(sqe, AT_FDCWD, item->path, O_RDONLY|O_CLOEXEC, 0);
+	return 0;
+}
+
+static void
+patchwork_bulk_complete_open_(struct bulk_item_struct *item, int res)
+{
+	item->pending = 0;
+	if(res >= 0)
+	{
+		item->fd = res;
+	}
+	else if(res != -ENOENT)
+	{
+		quilt_logf(LOG_CRIT, QUILT_PLUGIN_NAME ": failed to open cache file for reading: %s: %s\n", item->path, strerror(-res));
+		*(item->status) = 500;
+	}
+}
+
+static int
+patchwork_bulk_prep_statx_(struct io_uring_sqe *sqe, struct bulk_item_struct *item)
+{
+	io_uring_prep_statx(sqe, item->fd, "", AT_EMPTY_PATH, STATX_SIZE, &(item->stx));
+	return 0;
+}
+
+static void
+patchwork_bulk_complete_statx_(struct bulk_item_struct *item, int res)
+{
+	item->pending = 0;
+	if(res < 0)
+	{
+		quilt_logf(LOG_CRIT, QUILT_PLUGIN_NAME ": failed to obtain information about '%s': %s\n", item->path, strerror(-res));
+		*(item->status) = 500;
+		return;
+	}
+	item->size = (size_t) item->stx.stx_size;
+	item->obj->buf = (char *) malloc(item->size + 1);
+	if(!item->obj->buf)
+	{
+		quilt_logf(LOG_CRIT, QUILT_PLUGIN_NAME ": failed to allocate %lu bytes for '%s'\n", (unsigned long) item->size + 1, item->path);
+		*(item->status) = 500;
+	}
+}
+
+static int
+patchwork_bulk_prep_read_(struct io_uring_sqe *sqe, struct bulk_item_struct *item)
+{
+	io_uring_prep_read(sqe, item->fd, item->obj->buf + item->done, item->size - item->done, item->done);
+	return 0;
+}
+
+static void
+patchwork_bulk_complete_read_(struct bulk_item_struct *item, int res)
+{
+	if(res == -EINTR || res == -EAGAIN)
+	{
+		return;
+	}
+	if(res < 0)
+	{
+		quilt_logf(LOG_CRIT, QUILT_PLUGIN_NAME ": error reading from '%s': %s\n", item->path, strerror(-res));
+		*(item->status) = 500;
+		item->pending = 0;
+		return;
+	}
+	item->done += res;
+	/* Stop at end-of-file, in case the file was truncated since it was
+	 * examined
+	 */
+	if(!res || item->done >= item->size)
+	{
+		item->pending = 0;
+	}
+}
+
+static int
+patchwork_bulk_prep_close_(struct io_uring_sqe *sqe, struct bulk_item_struct *item)
+{
+	io_uring_prep_close(sqe, item->fd);
+	return 0;
+}
+
+static void
+patchwork_bulk_complete_close_(struct bulk_item_struct *item, int res)
+{
+	(void) res;
+
+	item->pending = 0;
+	item->fd = -1;
+}
+#endif /*WITH_LIBURING*/
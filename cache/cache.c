@@ -24,88 +24,323 @@
 
 #include "p_patchwork.h"
 
-static int patchwork_cache_init_s3_(const char *bucket);
+static int patchwork_cache_cb_(const char *key, const char *value, void *data);
+static int patchwork_cache_init_uri_(const char *uri);
+static int patchwork_cache_init_s3_(const char *bucket, const char *endpoint);
+static int patchwork_cache_init_s3_options_(void);
+static int patchwork_cache_init_ring_(void);
+static int patchwork_cache_ringcmp_(const void *a, const void *b);
 static int patchwork_cache_init_file_(const char *path);
 
 int
 patchwork_cache_init(void)
 {
-	URI *base, *uri;
-	URI_INFO *info;
 	char *t;
 	int r;
-	
-	if((t = quilt_config_geta(QUILT_PLUGIN_NAME ":cache", NULL)))
-	{
-		base = uri_create_cwd();
-		uri = uri_create_str(t, base);
-		info = uri_info(uri);
-		uri_destroy(uri);
-		uri_destroy(base);
-		if(!strcmp(info->scheme, "s3"))
+
+	/* There may be several 'cache' entries: each s3:// URI adds a bucket
+	 * to the set across which items are sharded
+	 */
+	r = 0;
+	quilt_config_get_all(NULL, NULL, patchwork_cache_cb_, &r);
+	if(r)
+	{
+		return r;
+	}
+	if(!patchwork->cache.nshards && !patchwork->cache.path &&
+	   (t = quilt_config_geta(QUILT_PLUGIN_NAME ":bucket", NULL)))
+	{
+		quilt_logf(LOG_WARNING, QUILT_PLUGIN_NAME ": the 'bucket' configuration option is deprecated; you should specify an S3 bucket URI as the value of the 'cache' option instead\n");
+		r = patchwork_cache_init_s3_(t, NULL);
+		free(t);
+		if(r)
 		{
-			r = patchwork_cache_init_s3_(info->host);
+			return r;
 		}
-		else if(!strcmp(info->scheme, "file"))
+	}
+	if(patchwork_zstd_init())
+	{
+		return -1;
+	}
+	if(patchwork_memory_init())
+	{
+		return -1;
+	}
+	if(patchwork->cache.nshards)
+	{
+		if(patchwork_cache_init_s3_options_() ||
+		   patchwork_cache_init_ring_())
 		{
-			r = patchwork_cache_init_file_(info->path);
+			return -1;
 		}
-		else
+	}
+	if(patchwork->cache.path)
+	{
+		patchwork->cache.db_ttl = quilt_config_get_int(QUILT_PLUGIN_NAME ":db_cache_ttl", DEFAULT_PATCHWORK_DB_CACHE_TTL);
+	}
+	/* Parsed statements are only cached for a standalone file cache */
+	if(patchwork->cache.path && !patchwork->cache.nshards)
+	{
+		if(patchwork_parsed_init())
 		{
-			quilt_logf(LOG_CRIT, QUILT_PLUGIN_NAME ": cache scheme '%s' is not supported in URI <%s>\n", info->scheme, t);
-			r = -1;
+			return -1;
 		}
-		uri_info_destroy(info);
-		free(t);
-		
 	}
-	else if((t = quilt_config_geta(QUILT_PLUGIN_NAME ":bucket", NULL)))
+	/* A file cache configured alongside S3 is a local tier in front of it */
+	if(patchwork->cache.nshards && patchwork->cache.path)
 	{
-		quilt_logf(LOG_WARNING, QUILT_PLUGIN_NAME ": the 'bucket' configuration option is deprecated; you should specify an S3 bucket URI as the value of the 'cache' option instead\n");
-		r = patchwork_cache_init_s3_(t);
-		free(t);
+		if(patchwork_local_init())
+		{
+			return -1;
+		}
+	}
+	if(patchwork->cache.path)
+	{
+		if(patchwork_bulk_warm())
+		{
+			return -1;
+		}
+	}
+	return 0;
+}
+
+/* A simple 64-bit FNV-1a hash */
+unsigned long long
+patchwork_hash(const char *str, size_t len)
+{
+	unsigned long long h;
+	size_t c;
+
+	h = 14695981039346656037ULL;
+	for(c = 0; c < len; c++)
+	{
+		h ^= (unsigned char) str[c];
+		h *= 1099511628211ULL;
+	}
+	/* Finalise, so that similar inputs are spread across the ring */
+	h ^= h >> 33;
+	h *= 0xff51afd7ed558ccdULL;
+	h ^= h >> 33;
+	return h;
+}
+
+/* quilt_config_get_all() callback */
+static int
+patchwork_cache_cb_(const char *key, const char *value, void *data)
+{
+	int *r;
+
+	r = (int *) data;
+	if(*r || !key || !value || strcmp(key, QUILT_PLUGIN_NAME ":cache"))
+	{
+		return 0;
+	}
+	*r = patchwork_cache_init_uri_(value);
+	return 0;
+}
+
+static int
+patchwork_cache_init_uri_(const char *t)
+{
+	URI *base, *uri;
+	URI_INFO *info;
+	char *endpoint, *p;
+	int r;
+
+	base = uri_create_cwd();
+	uri = uri_create_str(t, base);
+	info = uri_info(uri);
+	uri_destroy(uri);
+	uri_destroy(base);
+	if(!strcmp(info->scheme, "s3"))
+	{
+		/* s3://bucket?endpoint=host[:port] allows each bucket to be
+		 * served by a different endpoint
+		 */
+		endpoint = NULL;
+		if(info->query && (p = strstr(info->query, "endpoint=")) &&
+		   (p == info->query || p[-1] == '&'))
+		{
+			endpoint = strdup(p + 9);
+			if(endpoint && (p = strchr(endpoint, '&')))
+			{
+				*p = 0;
+			}
+		}
+		r = patchwork_cache_init_s3_(info->host, endpoint);
+		free(endpoint);
+	}
+	else if(!strcmp(info->scheme, "file"))
+	{
+		if(patchwork->cache.path)
+		{
+			quilt_logf(LOG_CRIT, QUILT_PLUGIN_NAME ": only one file cache may be configured (found <%s>)\n", t);
+			r = -1;
+		}
+		else
+		{
+			r = patchwork_cache_init_file_(info->path);
+		}
 	}
 	else
 	{
-		r = 0;
+		quilt_logf(LOG_CRIT, QUILT_PLUGIN_NAME ": cache scheme '%s' is not supported in URI <%s>\n", info->scheme, t);
+		r = -1;
 	}
+	uri_info_destroy(info);
 	return r;
 }
 
 static int
-patchwork_cache_init_s3_(const char *bucket)
+patchwork_cache_init_s3_(const char *bucket, const char *endpoint)
 {
+	struct patchwork_s3_shard_struct *p, *shard;
 	char *t;
-	
-	patchwork->cache.bucket = aws_s3_create(bucket);
-	if(!patchwork->cache.bucket)
+
+	p = (struct patchwork_s3_shard_struct *) realloc(patchwork->cache.shards, sizeof(struct patchwork_s3_shard_struct) * (patchwork->cache.nshards + 1));
+	if(!p)
+	{
+		quilt_logf(LOG_CRIT, QUILT_PLUGIN_NAME ": failed to allocate memory for S3 bucket list\n");
+		return -1;
+	}
+	patchwork->cache.shards = p;
+	shard = &(p[patchwork->cache.nshards]);
+	memset(shard, 0, sizeof(struct patchwork_s3_shard_struct));
+	/* The name identifies the bucket in logs, the circuit breaker and the
+	 * hash ring, so it must include the endpoint if one is given for this
+	 * bucket alone (the same bucket may be present on several nodes)
+	 */
+	shard->name = (char *) malloc(strlen(bucket) + (endpoint ? strlen(endpoint) + 4 : 0) + 6);
+	if(!shard->name)
+	{
+		quilt_logf(LOG_CRIT, QUILT_PLUGIN_NAME ": failed to allocate memory for S3 bucket name\n");
+		return -1;
+	}
+	if(endpoint)
+	{
+		sprintf(shard->name, "S3 <%s> at %s", bucket, endpoint);
+	}
+	else
+	{
+		sprintf(shard->name, "S3 <%s>", bucket);
+	}
+	shard->bucket = aws_s3_create(bucket);
+	if(!shard->bucket)
 	{
 		quilt_logf(LOG_CRIT, QUILT_PLUGIN_NAME ": failed to initialise S3 bucket '%s'\n", bucket);
+		free(shard->name);
 		return -1;
 	}
-	if((t = quilt_config_geta("s3:endpoint", NULL)))
+	if(endpoint)
+	{
+		aws_s3_set_endpoint(shard->bucket, endpoint);
+	}
+	else if((t = quilt_config_geta("s3:endpoint", NULL)))
 	{
-		aws_s3_set_endpoint(patchwork->cache.bucket, t);
+		aws_s3_set_endpoint(shard->bucket, t);
 		free(t);
 	}
 	if((t = quilt_config_geta("s3:access", NULL)))
 	{
-		aws_s3_set_access(patchwork->cache.bucket, t);
+		aws_s3_set_access(shard->bucket, t);
 		free(t);
 	}
 	if((t = quilt_config_geta("s3:secret", NULL)))
 	{
-		aws_s3_set_secret(patchwork->cache.bucket, t);
+		aws_s3_set_secret(shard->bucket, t);
 		free(t);
 	}
+	patchwork->cache.nshards++;
+	quilt_logf(LOG_INFO, QUILT_PLUGIN_NAME ": added %s to the item cache\n", shard->name);
+	return 0;
+}
+
+/* Options common to all S3 buckets */
+static int
+patchwork_cache_init_s3_options_(void)
+{
+	size_t c;
 
 	// As its in terms of kbs
 	patchwork->cache.s3_fetch_limit = 1024 * quilt_config_get_int("s3:fetch_limit", DEFAULT_PATCHWORK_FETCH_LIMIT);
 
 	patchwork->cache.s3_verbose = quilt_config_get_bool("s3:verbose", 0);
+
+	/* Timeouts, retries and hedging; see cache/s3.c */
+	patchwork->cache.s3_timeout = quilt_config_get_int("s3:timeout", DEFAULT_PATCHWORK_S3_TIMEOUT);
+	patchwork->cache.s3_retries = quilt_config_get_int("s3:retries", DEFAULT_PATCHWORK_S3_RETRIES);
+	patchwork->cache.s3_backoff = quilt_config_get_int("s3:retry_backoff", DEFAULT_PATCHWORK_S3_BACKOFF);
+	patchwork->cache.s3_hedge = quilt_config_get_int("s3:hedge_percentile", DEFAULT_PATCHWORK_S3_HEDGE);
+	patchwork->cache.s3_hedge_min = quilt_config_get_int("s3:hedge_min", DEFAULT_PATCHWORK_S3_HEDGE_MIN);
+	if(patchwork->cache.s3_hedge < 0 || patchwork->cache.s3_hedge > 100)
+	{
+		quilt_logf(LOG_WARNING, QUILT_PLUGIN_NAME ": S3: hedge percentile %d is out of range; hedging disabled\n", patchwork->cache.s3_hedge);
+		patchwork->cache.s3_hedge = 0;
+	}
+	/* Each bucket has its own circuit breaker */
+	for(c = 0; c < patchwork->cache.nshards; c++)
+	{
+		patchwork_breaker_init(&(patchwork->cache.shards[c].breaker), patchwork->cache.shards[c].name,
+			quilt_config_get_int("s3:breaker_threshold", DEFAULT_PATCHWORK_BREAKER_THRESHOLD),
+			quilt_config_get_int("s3:breaker_slow", DEFAULT_PATCHWORK_BREAKER_SLOW),
+			quilt_config_get_int("s3:breaker_cooldown", DEFAULT_PATCHWORK_BREAKER_COOLDOWN));
+	}
+	/* If enabled, items are also fetched from the next bucket along the
+	 * ring when their primary bucket is unavailable
+	 */
+	patchwork->cache.s3_replica = quilt_config_get_bool("s3:replica", 0);
+	if(patchwork->cache.s3_replica && patchwork->cache.nshards < 2)
+	{
+		patchwork->cache.s3_replica = 0;
+	}
 	return 0;
 }
 
+/* Build the consistent-hash ring which maps item identifiers to buckets */
+static int
+patchwork_cache_init_ring_(void)
+{
+	size_t c, v, n;
+	char *buf;
+
+	n = patchwork->cache.nshards * PATCHWORK_S3_VNODES;
+	patchwork->cache.ring = (struct patchwork_ring_struct *) calloc(n, sizeof(struct patchwork_ring_struct));
+	if(!patchwork->cache.ring)
+	{
+		quilt_logf(LOG_CRIT, QUILT_PLUGIN_NAME ": failed to allocate memory for S3 hash ring\n");
+		return -1;
+	}
+	for(c = 0; c < patchwork->cache.nshards; c++)
+	{
+		buf = (char *) malloc(strlen(patchwork->cache.shards[c].name) + 24);
+		if(!buf)
+		{
+			quilt_logf(LOG_CRIT, QUILT_PLUGIN_NAME ": failed to allocate memory for S3 hash ring\n");
+			return -1;
+		}
+		for(v = 0; v < PATCHWORK_S3_VNODES; v++)
+		{
+			sprintf(buf, "%s#%lu", patchwork->cache.shards[c].name, (unsigned long) v);
+			patchwork->cache.ring[c * PATCHWORK_S3_VNODES + v].point = patchwork_hash(buf, strlen(buf));
+			patchwork->cache.ring[c * PATCHWORK_S3_VNODES + v].shard = c;
+		}
+		free(buf);
+	}
+	qsort(patchwork->cache.ring, n, sizeof(struct patchwork_ring_struct), patchwork_cache_ringcmp_);
+	patchwork->cache.nring = n;
+	return 0;
+}
+
+static int
+patchwork_cache_ringcmp_(const void *a, const void *b)
+{
+	const struct patchwork_ring_struct *ra, *rb;
+
+	ra = (const struct patchwork_ring_struct *) a;
+	rb = (const struct patchwork_ring_struct *) b;
+	return (ra->point > rb->point) - (ra->point < rb->point);
+}
+
 static int
 patchwork_cache_init_file_(const char *path)
 {
@@ -134,6 +369,6 @@ patchwork_cache_init_file_(const char *path)
 			*t = 0;
 		}
 	}
-	return 0;
+	return patchwork_pack_open(patchwork->cache.path);
 }
 
@@ -24,80 +24,589 @@
 
 #include "p_patchwork.h"
 
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
-/* Fetch an item by retrieving triples or quads from the on-disk cache */
+static int patchwork_file_load_(int fd, const char *path, struct patchwork_object_struct *obj);
+static int patchwork_file_read_(int fd, const char *path, size_t offset, size_t len, char **buf, size_t *nread);
+static int patchwork_file_write_(const char *path, const char *buf, size_t len);
+static int patchwork_file_expired_(const char *id, struct patchwork_object_struct *obj);
+
+/* Fetch an item by retrieving triples or quads from the on-disk cache,
+ * or if it has been parsed recently, copying the statements that were
+ * parsed from it
+ */
 int
 patchwork_item_file(QUILTREQ *request, const char *id)
 {
-	char pathbuf[36];
-	char *p;
-	char *buf, *buffer;
-	FILE *f;
-	ssize_t r;
-	size_t bufsize, buflen;
+	struct patchwork_object_struct obj;
+	struct patchwork_parsed_key_struct key;
+	struct patchwork_parsed_capture_struct capture;
+	const char *facet;
+	int r;
+
+	facet = patchwork_item_facet(request);
+	if(facet)
+	{
+		/* Only the segment holding a sub-resource is read, and neither
+		 * it nor its statements are cached in memory
+		 */
+		memset(&obj, 0, sizeof(struct patchwork_object_struct));
+		r = patchwork_file_fetch_segment(id, facet, &obj);
+		if(r == 200)
+		{
+			r = patchwork_object_parse(request, &obj);
+		}
+		patchwork_object_free(&obj);
+		return r;
+	}
+	/* The complete set of statements parsed from an item is cached, and
+	 * passed through a sink for each request, so that fields= and
+	 * language filtering are applied to them as they would be if the
+	 * item were parsed again
+	 */
+	r = patchwork_parsed_item(request, id, &key);
+	if(r == 200)
+	{
+		return r;
+	}
+	memset(&obj, 0, sizeof(struct patchwork_object_struct));
+	r = patchwork_file_fetch(id, &obj);
+	if(r != 200)
+	{
+		patchwork_object_free(&obj);
+		return r;
+	}
+	/* Items whose parsed statements will be cached gain nothing from
+	 * also being held in the in-memory cache
+	 */
+	if(!obj.expires && !key.valid)
+	{
+		patchwork_memory_store(id, &obj);
+	}
+	memset(&capture, 0, sizeof(struct patchwork_parsed_capture_struct));
+	r = patchwork_object_parse_capture(request, &obj, (key.valid && !obj.expires ? &capture : NULL));
+	if(r != 200)
+	{
+		quilt_logf(LOG_ERR, QUILT_PLUGIN_NAME ": file: failed to parse item %s as '%s'\n", id, (obj.mime ? obj.mime : MIME_NQUADS));
+	}
+	else if(!obj.expires)
+	{
+		patchwork_parsed_store(id, &key, &capture);
+	}
+	patchwork_parsed_capture_free(&capture);
+	patchwork_object_free(&obj);
+	return r;
+}
+
+/* Retrieve the raw object for an item from the on-disk cache.
+ *
+ * The item is read from an individual file, along with its sidecar
+ * metadata (if any); if there is none, it is served from the packfiles
+ * (if present). Individual files are written after the packfiles were
+ * built, so they are never older than a packed copy.
+ *
+ * If Zstandard support is available, a compressed copy of the item named
+ * <id>.zst is preferred to an uncompressed one named <id>.
+ */
+int
+patchwork_file_fetch(const char *id, struct patchwork_object_struct *obj)
+{
+	char *buf;
+	int fd, r;
 	
 	if(strlen(id) != 32)
 	{
 		return 404;
 	}
-	pathbuf[0] = '/';
-	strcpy(pathbuf + 1, id);
-	
-	buf = (char *) calloc(1, strlen(patchwork->cache.path) + strlen(pathbuf) + 16);
+	buf = patchwork_file_path(id, NULL);
 	if(!buf)
 	{
 		return 500;
 	}
-	strcpy(buf, patchwork->cache.path);
-	strcat(buf, pathbuf);
-	f = fopen(buf, "rb");
-	if(!f)
+	fd = -1;
+#ifdef WITH_ZSTD
+	strcat(buf, ".zst");
+	fd = open(buf, O_RDONLY);
+	if(fd != -1)
 	{
-		quilt_logf(LOG_CRIT, QUILT_PLUGIN_NAME ": failed to open cache file for reading: %s: %s\n", buf, strerror(errno));
-		free(buf);
-		return 404;
+		obj->encoding = PE_ZSTD;
+	}
+	else
+	{
+		*(strrchr(buf, '.')) = 0;
 	}
-	r = 0;
-	buffer = NULL;
-	bufsize = 0;
-	buflen = 0;
-	while(!feof(f))
+#endif
+	if(fd == -1)
 	{
-		if(bufsize - buflen < 1024)
+		fd = open(buf, O_RDONLY);
+	}
+	if(fd == -1)
+	{
+		if(errno == ENOENT)
 		{
-			p = (char *) realloc(buffer, bufsize + 1024);
-			if(!p)
+			obj->encoding = PE_IDENTITY;
+			if(!patchwork_pack_lookup(id, obj))
 			{
-				quilt_logf(LOG_CRIT, QUILT_PLUGIN_NAME ": failed to reallocate buffer from %u bytes to %u bytes\n", (unsigned) bufsize, (unsigned) bufsize + 1024);
-				free(buffer);
 				free(buf);
-				fclose(f);
-				return 500;
+				return 200;
 			}
-			buffer = p;
-			bufsize += 1024;
+			quilt_logf(LOG_DEBUG, QUILT_PLUGIN_NAME ": file: %s is not cached\n", id);
 		}
-		r = fread(&(buffer[buflen]), 1, 1023, f);
-		if(r < 0)
+		else
 		{
-			quilt_logf(LOG_CRIT, QUILT_PLUGIN_NAME ": error reading from '%s': %s\n", buf, strerror(errno));
-			free(buffer);
-			free(buf);
-			fclose(f);
-			return 500;
+			quilt_logf(LOG_CRIT, QUILT_PLUGIN_NAME ": failed to open cache file for reading: %s: %s\n", buf, strerror(errno));
 		}
-		buflen += r;
-		buffer[buflen] = 0;
+		free(buf);
+		return 404;
 	}
-	fclose(f);
-	if(quilt_model_parse(request->model, MIME_NQUADS, buffer, buflen))
+	r = patchwork_file_load_(fd, buf, obj);
+	close(fd);
+	if(r)
 	{
-		quilt_logf(LOG_ERR, QUILT_PLUGIN_NAME ": file: failed to parse buffer from %s as '%s'\n", buf, MIME_NQUADS);
 		free(buf);
-		free(buffer);
 		return 500;
 	}
-	free(buffer);
 	free(buf);
+	return patchwork_file_finish(id, obj);
+}
+
+/* Retrieve only the segment of a segmented object in the on-disk cache
+ * holding the graph for a sub-resource of an item, reading its index and
+ * then the segment itself at the offset given there.
+ *
+ * Packed items and compressed objects can't be read in part, and so are
+ * retrieved in full (patchwork_object_parse() will load just the segment
+ * that's needed).
+ */
+int
+patchwork_file_fetch_segment(const char *id, const char *facet, struct patchwork_object_struct *obj)
+{
+	char *path, *buf;
+	size_t offset, len, nread, want;
+	int fd, r;
+
+	if(strlen(id) != 32)
+	{
+		return 404;
+	}
+	path = patchwork_file_path(id, NULL);
+	if(!path)
+	{
+		return 500;
+	}
+	fd = open(path, O_RDONLY);
+	if(fd == -1)
+	{
+		/* The item may be compressed or packed */
+		free(path);
+		return patchwork_file_fetch(id, obj);
+	}
+	buf = NULL;
+	want = PATCHWORK_SEGMENTS_PROBE;
+	for(;;)
+	{
+		free(buf);
+		if(patchwork_file_read_(fd, path, 0, want, &buf, &nread))
+		{
+			close(fd);
+			free(path);
+			return 500;
+		}
+		if(!patchwork_segments_detect(buf, nread))
+		{
+			quilt_logf(LOG_DEBUG, QUILT_PLUGIN_NAME ": file: %s is not segmented, so has no sub-resource '%s'\n", id, facet);
+			r = 404;
+			break;
+		}
+		r = patchwork_segments_find(buf, nread, facet, &offset, &len);
+		/* If the index is larger than the initial read, read it again
+		 * (unless the file was shorter than what was asked for) */
+		if(r != 206 || nread < want || len <= want)
+		{
+			break;
+		}
+		want = len;
+	}
+	free(buf);
+	if(r == 206)
+	{
+		quilt_logf(LOG_ERR, QUILT_PLUGIN_NAME ": file: index of %s is truncated\n", id);
+		r = 500;
+	}
+	if(r != 200)
+	{
+		close(fd);
+		free(path);
+		return r;
+	}
+	r = patchwork_file_read_(fd, path, offset, len, &(obj->buf), &(obj->len));
+	close(fd);
+	free(path);
+	if(r)
+	{
+		return 500;
+	}
+	if(obj->len < len)
+	{
+		quilt_logf(LOG_ERR, QUILT_PLUGIN_NAME ": file: segment '%s' of %s is truncated\n", facet, id);
+		return 500;
+	}
+	r = patchwork_file_finish(id, obj);
+	if(r != 200)
+	{
+		return r;
+	}
+	free(obj->mime);
+	obj->mime = strdup(MIME_PATCHWORK_QUADS);
+	obj->encoding = PE_IDENTITY;
+	obj->segment = 1;
+	return 200;
+}
+
+/* Complete the retrieval of an item whose contents have been loaded into
+ * obj by reading its sidecar metadata (if any), returning 404 if it turns
+ * out to have expired
+ */
+int
+patchwork_file_finish(const char *id, struct patchwork_object_struct *obj)
+{
+	char *path;
+
+	path = patchwork_file_path(id, NULL);
+	if(!path)
+	{
+		patchwork_object_free(obj);
+		return 500;
+	}
+	patchwork_object_meta_read(path, obj);
+	free(path);
+	if(obj->expires && patchwork_file_expired_(id, obj))
+	{
+		patchwork_object_free(obj);
+		return 404;
+	}
 	return 200;
 }
+
+/* Determine whether an item is present in the on-disk cache, retrieving
+ * its metadata but not its contents
+ */
+int
+patchwork_file_head(const char *id, struct patchwork_object_struct *obj)
+{
+	struct stat sbuf;
+	char *buf;
+	int r;
+
+	if(strlen(id) != 32)
+	{
+		return 404;
+	}
+	buf = patchwork_file_path(id, ".zst");
+	if(!buf)
+	{
+		return 500;
+	}
+	r = -1;
+#ifdef WITH_ZSTD
+	r = stat(buf, &sbuf);
+#endif
+	if(r)
+	{
+		*(strrchr(buf, '.')) = 0;
+		r = stat(buf, &sbuf);
+	}
+	if(r)
+	{
+		if(errno != ENOENT)
+		{
+			quilt_logf(LOG_CRIT, QUILT_PLUGIN_NAME ": failed to obtain information about '%s': %s\n", buf, strerror(errno));
+			free(buf);
+			return 500;
+		}
+		free(buf);
+		return (patchwork_pack_lookup(id, obj) ? 404 : 200);
+	}
+	free(buf);
+	return patchwork_file_finish(id, obj);
+}
+
+/* Atomically store an object in the on-disk cache, replacing any
+ * existing copy, followed by its sidecar metadata
+ */
+int
+patchwork_file_store(const char *id, const struct patchwork_object_struct *obj)
+{
+	char *buf, *stale;
+
+	if(strlen(id) != 32)
+	{
+		return -1;
+	}
+	buf = patchwork_file_path(id, (obj->encoding == PE_ZSTD ? ".zst" : NULL));
+	stale = patchwork_file_path(id, (obj->encoding == PE_ZSTD ? NULL : ".zst"));
+	if(!buf || !stale)
+	{
+		free(buf);
+		free(stale);
+		return -1;
+	}
+	if(patchwork_file_write_(buf, obj->buf, obj->len))
+	{
+		free(buf);
+		free(stale);
+		return -1;
+	}
+	/* Remove any copy with the other encoding, which would otherwise be
+	 * preferred to (or shadowed by) this one
+	 */
+	unlink(stale);
+	if(obj->encoding == PE_ZSTD)
+	{
+		*(strrchr(buf, '.')) = 0;
+	}
+	/* The metadata is written after the object, so that a reader never
+	 * sees new validators alongside an old object
+	 */
+	patchwork_object_meta_write(buf, obj);
+	free(buf);
+	free(stale);
+	return 0;
+}
+
+/* Store a graph synthesised from the database as N-Quads, to be served
+ * for the next db_cache_ttl seconds
+ */
+int
+patchwork_file_store_graph(const char *id, librdf_model *model, const char *indexed)
+{
+	struct patchwork_object_struct obj;
+	int r;
+
+	memset(&obj, 0, sizeof(struct patchwork_object_struct));
+	if(patchwork_object_serialise(model, &obj))
+	{
+		return -1;
+	}
+	obj.expires = time(NULL) + patchwork->cache.db_ttl;
+	if(indexed && strlen(indexed) < sizeof(obj.indexed))
+	{
+		strcpy(obj.indexed, indexed);
+	}
+	r = patchwork_file_store(id, &obj);
+	patchwork_object_free(&obj);
+	if(!r)
+	{
+		quilt_logf(LOG_DEBUG, QUILT_PLUGIN_NAME ": file: cached graph for %s synthesised from the database\n", id);
+	}
+	return r;
+}
+
+/* Return the (newly-allocated) path of an item in the on-disk cache */
+char *
+patchwork_file_path(const char *id, const char *suffix)
+{
+	char *p;
+
+	p = (char *) malloc(strlen(patchwork->cache.path) + strlen(id) + (suffix ? strlen(suffix) : 0) + 8);
+	if(!p)
+	{
+		quilt_logf(LOG_CRIT, QUILT_PLUGIN_NAME ": failed to allocate memory for cache file path\n");
+		return NULL;
+	}
+	strcpy(p, patchwork->cache.path);
+	strcat(p, id);
+	if(suffix)
+	{
+		strcat(p, suffix);
+	}
+	return p;
+}
+
+/* Load the contents of an open cache file into obj: the file is mapped
+ * read-only where possible, so that the parser reads directly from the
+ * page cache; otherwise it is read with a single pread() into a buffer
+ * sized from fstat()
+ */
+static int
+patchwork_file_load_(int fd, const char *path, struct patchwork_object_struct *obj)
+{
+	struct stat sbuf;
+	ssize_t r;
+	size_t len;
+	void *p;
+
+	if(fstat(fd, &sbuf))
+	{
+		quilt_logf(LOG_CRIT, QUILT_PLUGIN_NAME ": failed to obtain information about '%s': %s\n", path, strerror(errno));
+		return -1;
+	}
+	len = (size_t) sbuf.st_size;
+	if(len)
+	{
+		p = mmap(NULL, len, PROT_READ, MAP_PRIVATE, fd, 0);
+		if(p != MAP_FAILED)
+		{
+			madvise(p, len, MADV_SEQUENTIAL);
+			obj->buf = (char *) p;
+			obj->len = len;
+			obj->mapped = len;
+			return 0;
+		}
+		quilt_logf(LOG_DEBUG, QUILT_PLUGIN_NAME ": failed to map '%s' (%s); reading instead\n", path, strerror(errno));
+	}
+	obj->buf = (char *) malloc(len + 1);
+	if(!obj->buf)
+	{
+		quilt_logf(LOG_CRIT, QUILT_PLUGIN_NAME ": failed to allocate %lu bytes for '%s'\n", (unsigned long) len + 1, path);
+		return -1;
+	}
+	obj->len = 0;
+	while(obj->len < len)
+	{
+		r = pread(fd, &(obj->buf[obj->len]), len - obj->len, (off_t) obj->len);
+		if(r < 0 && errno == EINTR)
+		{
+			continue;
+		}
+		if(r < 0)
+		{
+			quilt_logf(LOG_CRIT, QUILT_PLUGIN_NAME ": error reading from '%s': %s\n", path, strerror(errno));
+			free(obj->buf);
+			obj->buf = NULL;
+			return -1;
+		}
+		if(!r)
+		{
+			/* The file was truncated since it was examined */
+			break;
+		}
+		obj->len += r;
+	}
+	obj->buf[obj->len] = 0;
+	return 0;
+}
+
+/* Read up to len bytes at offset from an open cache file into a
+ * newly-allocated (and NUL-terminated) buffer
+ */
+static int
+patchwork_file_read_(int fd, const char *path, size_t offset, size_t len, char **buf, size_t *nread)
+{
+	ssize_t r;
+
+	*nread = 0;
+	*buf = (char *) malloc(len + 1);
+	if(!*buf)
+	{
+		quilt_logf(LOG_CRIT, QUILT_PLUGIN_NAME ": failed to allocate %lu bytes for '%s'\n", (unsigned long) len + 1, path);
+		return -1;
+	}
+	while(*nread < len)
+	{
+		r = pread(fd, *buf + *nread, len - *nread, (off_t) (offset + *nread));
+		if(r < 0 && errno == EINTR)
+		{
+			continue;
+		}
+		if(r < 0)
+		{
+			quilt_logf(LOG_CRIT, QUILT_PLUGIN_NAME ": error reading from '%s': %s\n", path, strerror(errno));
+			free(*buf);
+			*buf = NULL;
+			return -1;
+		}
+		if(!r)
+		{
+			break;
+		}
+		*nread += r;
+	}
+	(*buf)[*nread] = 0;
+	return 0;
+}
+
+/* Determine whether a graph synthesised from the database has expired:
+ * if it has, but index.modified hasn't changed since it was generated, it
+ * is renewed rather than being generated again
+ */
+static int
+patchwork_file_expired_(const char *id, struct patchwork_object_struct *obj)
+{
+	char modified[PATCHWORK_DATE_MAX];
+	char *path;
+
+	if(time(NULL) < obj->expires)
+	{
+		return 0;
+	}
+	if(!patchwork->db || patchwork_item_db_modified(id, modified, sizeof(modified)) ||
+	   strcmp(modified, obj->indexed))
+	{
+		quilt_logf(LOG_DEBUG, QUILT_PLUGIN_NAME ": file: cached graph for %s has expired\n", id);
+		return 1;
+	}
+	obj->expires = time(NULL) + patchwork->cache.db_ttl;
+	path = patchwork_file_path(id, NULL);
+	if(path)
+	{
+		patchwork_object_meta_write(path, obj);
+		free(path);
+	}
+	return 0;
+}
+
+/* Write a file under a temporary name and rename it into place */
+static int
+patchwork_file_write_(const char *path, const char *buf, size_t len)
+{
+	char *tmppath;
+	ssize_t r;
+	size_t n;
+	int fd;
+
+	tmppath = (char *) malloc(strlen(path) + 8);
+	if(!tmppath)
+	{
+		quilt_logf(LOG_CRIT, QUILT_PLUGIN_NAME ": failed to allocate memory for temporary path\n");
+		return -1;
+	}
+	sprintf(tmppath, "%s.XXXXXX", path);
+	fd = mkstemp(tmppath);
+	if(fd == -1)
+	{
+		quilt_logf(LOG_ERR, QUILT_PLUGIN_NAME ": failed to create %s: %s\n", tmppath, strerror(errno));
+		free(tmppath);
+		return -1;
+	}
+	fchmod(fd, 0644);
+	for(n = 0; n < len; n += r)
+	{
+		r = write(fd, buf + n, len - n);
+		if(r < 0 && errno == EINTR)
+		{
+			r = 0;
+			continue;
+		}
+		if(r < 0)
+		{
+			quilt_logf(LOG_ERR, QUILT_PLUGIN_NAME ": failed to write %s: %s\n", tmppath, strerror(errno));
+			close(fd);
+			unlink(tmppath);
+			free(tmppath);
+			return -1;
+		}
+	}
+	if(close(fd) || rename(tmppath, path))
+	{
+		quilt_logf(LOG_ERR, QUILT_PLUGIN_NAME ": failed to store %s: %s\n", path, strerror(errno));
+		unlink(tmppath);
+		free(tmppath);
+		return -1;
+	}
+	free(tmppath);
+	return 0;
+}
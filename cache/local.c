@@ -0,0 +1,420 @@
+/* This engine processes requests for coreference graphs populated
+ * by Twine's "spindle" post-processing module.
+ *
+ * Author: Mo McRoberts <mo.mcroberts@bbc.co.uk>
+ *
+ * Copyright (c) 2014-2017 BBC
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include "p_patchwork.h"
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+/* When both a file cache and one or more S3 buckets are configured, the
+ * file cache acts as a local tier in front of S3: items are served from
+ * local disk where possible, and objects fetched from S3 are written back
+ * so that repeat requests for popular items never leave the host.
+ *
+ * Once a local copy is older than local:ttl seconds, it is revalidated
+ * with a conditional request; if S3 responds 304, the copy is renewed
+ * without being downloaded again, and if S3 is unavailable, the stale copy
+ * is served regardless.
+ *
+ * A background thread keeps the total size of the local tier below
+ * local:size_limit MiB by evicting the least-recently-used items. Each
+ * hit updates the access time of the item's file explicitly, so that
+ * this works even on file systems mounted with noatime.
+ */
+
+struct local_entry_struct
+{
+	char name[40];
+	time_t atime;
+	off_t size;
+};
+
+static int patchwork_local_stale_(const char *id);
+static void patchwork_local_touch_(const char *id, const struct patchwork_object_struct *obj);
+static void patchwork_local_renew_(const char *id, const struct patchwork_object_struct *obj);
+static void patchwork_local_remove_(const char *id);
+static void *patchwork_local_thread_(void *arg);
+static void patchwork_local_sweep_(void);
+static int patchwork_local_entrycmp_(const void *a, const void *b);
+
+int
+patchwork_local_init(void)
+{
+	pthread_attr_t attr;
+	pthread_t thread;
+	int r;
+
+	patchwork->cache.local = 1;
+	patchwork->cache.local_ttl = quilt_config_get_int("local:ttl", DEFAULT_PATCHWORK_LOCAL_TTL);
+	patchwork->cache.local_size = (unsigned long long) quilt_config_get_int("local:size_limit", DEFAULT_PATCHWORK_LOCAL_SIZE) * 1024 * 1024;
+	patchwork->cache.local_sweep = quilt_config_get_int("local:sweep_interval", DEFAULT_PATCHWORK_LOCAL_SWEEP);
+	quilt_logf(LOG_INFO, QUILT_PLUGIN_NAME ": using %s as a local cache in front of S3\n", patchwork->cache.path);
+	if(!patchwork->cache.local_size || patchwork->cache.local_sweep <= 0)
+	{
+		return 0;
+	}
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	r = pthread_create(&thread, &attr, patchwork_local_thread_, NULL);
+	pthread_attr_destroy(&attr);
+	if(r)
+	{
+		quilt_logf(LOG_CRIT, QUILT_PLUGIN_NAME ": failed to start local cache eviction thread: %s\n", strerror(r));
+		return -1;
+	}
+	return 0;
+}
+
+/* Fetch an item from the local tier, falling back to S3 */
+int
+patchwork_item_local(QUILTREQ *request, const char *id)
+{
+	struct patchwork_object_struct obj;
+	const char *facet;
+	int r, local;
+
+	memset(&obj, 0, sizeof(struct patchwork_object_struct));
+	facet = patchwork_item_facet(request);
+	if(facet)
+	{
+		/* A sub-resource is read from a fresh local copy if there is one,
+		 * or otherwise from S3, without the local copy being updated
+		 */
+		r = 404;
+		if(!patchwork_local_stale_(id))
+		{
+			r = patchwork_file_fetch_segment(id, facet, &obj);
+		}
+		if(r != 200)
+		{
+			patchwork_object_free(&obj);
+			r = patchwork_s3_fetch_segment(id, facet, &obj);
+		}
+		if(r == 200)
+		{
+			r = patchwork_object_parse(request, &obj);
+		}
+		patchwork_object_free(&obj);
+		return r;
+	}
+	local = (patchwork_file_fetch(id, &obj) == 200);
+	/* Packed items and graphs synthesised from the database aren't
+	 * revalidated against S3
+	 */
+	if(local && (obj.borrowed || obj.expires || !patchwork_local_stale_(id)))
+	{
+		patchwork_local_touch_(id, &obj);
+		if(!obj.expires)
+		{
+			patchwork_memory_store(id, &obj);
+		}
+		r = patchwork_object_parse(request, &obj);
+		patchwork_object_free(&obj);
+		return r;
+	}
+	/* If obj holds a stale copy, this request is conditional */
+	r = patchwork_s3_fetch(id, &obj);
+	switch(r)
+	{
+	case 200:
+		if(!obj.mime)
+		{
+			quilt_logf(LOG_ERR, QUILT_PLUGIN_NAME ": S3: server did not send a Content-Type\n");
+			patchwork_object_free(&obj);
+			return 500;
+		}
+		patchwork_file_store(id, &obj);
+		break;
+	case 304:
+		quilt_logf(LOG_DEBUG, QUILT_PLUGIN_NAME ": local: %s has not been modified; renewing local copy\n", id);
+		patchwork_local_renew_(id, &obj);
+		break;
+	case 404:
+		if(local)
+		{
+			quilt_logf(LOG_DEBUG, QUILT_PLUGIN_NAME ": local: %s no longer exists; removing local copy\n", id);
+			patchwork_local_remove_(id);
+		}
+		patchwork_object_free(&obj);
+		return 404;
+	default:
+		if(!local)
+		{
+			patchwork_object_free(&obj);
+			return r;
+		}
+		quilt_logf(LOG_WARNING, QUILT_PLUGIN_NAME ": local: failed to revalidate %s (status %d); serving stale copy\n", id, r);
+	}
+	patchwork_memory_store(id, &obj);
+	r = patchwork_object_parse(request, &obj);
+	patchwork_object_free(&obj);
+	return r;
+}
+
+/* Determine whether an item exists, retrieving its metadata but not its
+ * contents: a local copy which is fresh is used as-is, otherwise S3 is
+ * asked (and the local copy used if S3 is unavailable)
+ */
+int
+patchwork_local_head(const char *id, struct patchwork_object_struct *obj)
+{
+	struct patchwork_object_struct remote;
+	int r, rs;
+
+	r = patchwork_file_head(id, obj);
+	if(r == 200 && (obj->borrowed || obj->expires || !patchwork_local_stale_(id)))
+	{
+		return 200;
+	}
+	memset(&remote, 0, sizeof(struct patchwork_object_struct));
+	rs = patchwork_s3_head(id, &remote);
+	switch(rs)
+	{
+	case 200:
+		patchwork_object_free(obj);
+		*obj = remote;
+		return 200;
+	case 404:
+		patchwork_object_free(obj);
+		return 404;
+	}
+	patchwork_object_free(&remote);
+	/* If there's no local copy to fall back to, S3's failure stands,
+	 * rather than the item appearing not to exist
+	 */
+	return (r == 200 ? r : rs);
+}
+
+/* Returns non-zero if the local copy of an item is due for revalidation */
+static int
+patchwork_local_stale_(const char *id)
+{
+	struct stat sbuf;
+	char *path;
+	int r;
+
+	if(patchwork->cache.local_ttl <= 0)
+	{
+		return 0;
+	}
+	path = patchwork_file_path(id, ".meta");
+	if(!path)
+	{
+		return 0;
+	}
+	/* The sidecar is rewritten whenever the copy is stored or renewed; a
+	 * copy without one has no validators and so is never revalidated
+	 */
+	r = (!stat(path, &sbuf) && time(NULL) - sbuf.st_mtime >= patchwork->cache.local_ttl);
+	free(path);
+	return r;
+}
+
+/* Record a hit on the local copy of an item by updating its access time */
+static void
+patchwork_local_touch_(const char *id, const struct patchwork_object_struct *obj)
+{
+	struct timespec times[2];
+	char *path;
+
+	if(obj->borrowed)
+	{
+		/* Packed items aren't subject to eviction */
+		return;
+	}
+	path = patchwork_file_path(id, (obj->encoding == PE_ZSTD ? ".zst" : NULL));
+	if(!path)
+	{
+		return;
+	}
+	times[0].tv_sec = 0;
+	times[0].tv_nsec = UTIME_NOW;
+	times[1].tv_sec = 0;
+	times[1].tv_nsec = UTIME_OMIT;
+	utimensat(AT_FDCWD, path, times, 0);
+	free(path);
+}
+
+/* Renew the local copy of an item following a 304 response */
+static void
+patchwork_local_renew_(const char *id, const struct patchwork_object_struct *obj)
+{
+	char *path;
+
+	patchwork_local_touch_(id, obj);
+	path = patchwork_file_path(id, NULL);
+	if(path)
+	{
+		patchwork_object_meta_write(path, obj);
+		free(path);
+	}
+}
+
+/* Remove the local copy of an item, and its sidecar */
+static void
+patchwork_local_remove_(const char *id)
+{
+	static const char *suffixes[] = { "", ".zst", ".meta", NULL };
+	char *path;
+	size_t c;
+
+	for(c = 0; suffixes[c]; c++)
+	{
+		path = patchwork_file_path(id, suffixes[c]);
+		if(path)
+		{
+			unlink(path);
+			free(path);
+		}
+	}
+}
+
+static void *
+patchwork_local_thread_(void *arg)
+{
+	(void) arg;
+
+	for(;;)
+	{
+		sleep((unsigned int) patchwork->cache.local_sweep);
+		patchwork_local_sweep_();
+	}
+	return NULL;
+}
+
+/* Scan the local tier and, if it has grown beyond its size limit, evict
+ * the least-recently-used items until it is back below 90% of the limit
+ */
+static void
+patchwork_local_sweep_(void)
+{
+	struct local_entry_struct *entries, *p;
+	struct dirent *de;
+	struct stat sbuf;
+	unsigned long long total, target;
+	size_t count, size, c, evicted;
+	char *path, *t;
+	DIR *d;
+
+	d = opendir(patchwork->cache.path);
+	if(!d)
+	{
+		quilt_logf(LOG_ERR, QUILT_PLUGIN_NAME ": local: failed to open %s: %s\n", patchwork->cache.path, strerror(errno));
+		return;
+	}
+	path = (char *) malloc(strlen(patchwork->cache.path) + 64);
+	if(!path)
+	{
+		closedir(d);
+		return;
+	}
+	entries = NULL;
+	count = 0;
+	size = 0;
+	total = 0;
+	while((de = readdir(d)))
+	{
+		if(strlen(de->d_name) >= sizeof(entries->name) || de->d_name[0] == '.')
+		{
+			continue;
+		}
+		sprintf(path, "%s%s", patchwork->cache.path, de->d_name);
+		if(stat(path, &sbuf) || !S_ISREG(sbuf.st_mode))
+		{
+			continue;
+		}
+		/* Only items (<id> or <id>.zst) are candidates for eviction,
+		 * and only they and their sidecars count towards the limit:
+		 * packfiles and temporary files are left alone
+		 */
+		t = strchr(de->d_name, '.');
+		if((t ? (size_t) (t - de->d_name) : strlen(de->d_name)) != 32)
+		{
+			continue;
+		}
+		if(t && !strcmp(t, ".meta"))
+		{
+			total += (unsigned long long) sbuf.st_size;
+			continue;
+		}
+		if(t && strcmp(t, ".zst"))
+		{
+			continue;
+		}
+		total += (unsigned long long) sbuf.st_size;
+		if(count == size)
+		{
+			p = (struct local_entry_struct *) realloc(entries, sizeof(struct local_entry_struct) * (size + 1024));
+			if(!p)
+			{
+				quilt_logf(LOG_CRIT, QUILT_PLUGIN_NAME ": local: failed to allocate memory for eviction list\n");
+				break;
+			}
+			entries = p;
+			size += 1024;
+		}
+		strcpy(entries[count].name, de->d_name);
+		entries[count].atime = sbuf.st_atime;
+		entries[count].size = sbuf.st_size;
+		count++;
+	}
+	closedir(d);
+	if(total > patchwork->cache.local_size)
+	{
+		target = patchwork->cache.local_size / 10 * 9;
+		qsort(entries, count, sizeof(struct local_entry_struct), patchwork_local_entrycmp_);
+		evicted = 0;
+		for(c = 0; c < count && total > target; c++)
+		{
+			sprintf(path, "%s%s", patchwork->cache.path, entries[c].name);
+			if(unlink(path))
+			{
+				continue;
+			}
+			total -= (unsigned long long) entries[c].size;
+			t = strchr(path, 0) - (strcmp(strchr(entries[c].name, 0) - 4, ".zst") ? 0 : 4);
+			strcpy(t, ".meta");
+			if(!stat(path, &sbuf) && !unlink(path))
+			{
+				total -= (unsigned long long) sbuf.st_size;
+			}
+			evicted++;
+		}
+		quilt_logf(LOG_INFO, QUILT_PLUGIN_NAME ": local: evicted %lu items; %llu MiB now in use\n", (unsigned long) evicted, total / (1024 * 1024));
+	}
+	free(entries);
+	free(path);
+}
+
+static int
+patchwork_local_entrycmp_(const void *a, const void *b)
+{
+	const struct local_entry_struct *ea, *eb;
+
+	ea = (const struct local_entry_struct *) a;
+	eb = (const struct local_entry_struct *) b;
+	return (ea->atime > eb->atime) - (ea->atime < eb->atime);
+}
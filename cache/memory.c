@@ -0,0 +1,441 @@
+/* This engine processes requests for coreference graphs populated
+ * by Twine's "spindle" post-processing module.
+ *
+ * Author: Mo McRoberts <mo.mcroberts@bbc.co.uk>
+ *
+ * Copyright (c) 2014-2017 BBC
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include "p_patchwork.h"
+
+#include <unistd.h>
+
+/* An in-process cache of raw item objects (as retrieved from S3, the
+ * file cache or, serialised as N-Quads, from SPARQL), consulted before
+ * any of the cache back-ends.
+ *
+ * The cache is divided into a power-of-two number of shards, each with
+ * its own lock, hash table, LRU list and share of the size limit
+ * (memory:size_limit MiB), so that concurrent requests rarely contend.
+ *
+ * Admission is frequency-aware (TinyLFU): each shard keeps a count-min
+ * sketch of how often each item has been requested recently, and a new
+ * object is only cached at the expense of existing ones if it has been
+ * requested more often than the items that would be evicted to make room
+ * for it. The counters are halved periodically so that the sketch tracks
+ * recent popularity. This prevents a crawler's one-off requests from
+ * flushing popular items.
+ *
+ * Entries are discarded after memory:ttl seconds, so that changes made to
+ * the back-ends are picked up.
+ *
+ * Entries are reference-counted, so that an object can be parsed without
+ * holding the shard lock and without copying it.
+ */
+
+#define MEMORY_SKETCH_DEPTH            4
+#define MEMORY_COUNTER_MAX             15
+/* Assumed average object size, used to size each shard's sketch and
+ * hash table */
+#define MEMORY_OBJECT_SIZE             4096
+
+struct memory_entry_struct
+{
+	struct memory_entry_struct *chain;
+	struct memory_entry_struct *prev;
+	struct memory_entry_struct *next;
+	unsigned long long hash;
+	PATCHWORKID key;
+	char *buf;
+	size_t len;
+	char *mime;
+	PATCHWORKENCODING encoding;
+	size_t cost;
+	time_t expires;
+	int refs;
+	int evicted;
+};
+
+struct memory_shard_struct
+{
+	pthread_mutex_t lock;
+	/* Hash table */
+	struct memory_entry_struct **buckets;
+	/* LRU list, most-recently-used first */
+	struct memory_entry_struct *head;
+	struct memory_entry_struct *tail;
+	size_t used;
+	size_t capacity;
+	/* Count-min sketch of recent request frequencies */
+	unsigned char *sketch;
+	size_t additions;
+	size_t mask;
+};
+
+struct patchwork_memory_struct
+{
+	struct memory_shard_struct *shards;
+	size_t nshards;
+	long ttl;
+};
+
+static struct memory_shard_struct *patchwork_memory_shard_(const PATCHWORKID *key, unsigned long long *hash);
+static struct memory_entry_struct *patchwork_memory_find_(struct memory_shard_struct *shard, const PATCHWORKID *key, unsigned long long hash);
+static void patchwork_memory_touch_(struct memory_shard_struct *shard, struct memory_entry_struct *entry);
+static void patchwork_memory_evict_(struct memory_shard_struct *shard, struct memory_entry_struct *entry);
+static void patchwork_memory_free_(struct memory_entry_struct *entry);
+static unsigned int patchwork_memory_frequency_(struct memory_shard_struct *shard, unsigned long long hash);
+static void patchwork_memory_increment_(struct memory_shard_struct *shard, unsigned long long hash);
+
+int
+patchwork_memory_init(void)
+{
+	struct patchwork_memory_struct *memory;
+	struct memory_shard_struct *shard;
+	size_t limit, slots, c;
+	long cpus;
+
+	limit = (size_t) quilt_config_get_int("memory:size_limit", DEFAULT_PATCHWORK_MEMORY_SIZE) * 1024 * 1024;
+	if(!limit)
+	{
+		return 0;
+	}
+	memory = (struct patchwork_memory_struct *) calloc(1, sizeof(struct patchwork_memory_struct));
+	if(!memory)
+	{
+		quilt_logf(LOG_CRIT, QUILT_PLUGIN_NAME ": failed to allocate memory for in-memory cache\n");
+		return -1;
+	}
+	/* Two shards per CPU, rounded up to a power of two */
+	cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	if(cpus < 1)
+	{
+		cpus = 1;
+	}
+	for(memory->nshards = 1; memory->nshards < (size_t) cpus * 2 && memory->nshards < PATCHWORK_MEMORY_SHARDS_MAX; memory->nshards <<= 1);
+	memory->shards = (struct memory_shard_struct *) calloc(memory->nshards, sizeof(struct memory_shard_struct));
+	if(!memory->shards)
+	{
+		quilt_logf(LOG_CRIT, QUILT_PLUGIN_NAME ": failed to allocate memory for in-memory cache shards\n");
+		free(memory);
+		return -1;
+	}
+	for(slots = 1024; slots < limit / memory->nshards / MEMORY_OBJECT_SIZE; slots <<= 1);
+	for(c = 0; c < memory->nshards; c++)
+	{
+		shard = &(memory->shards[c]);
+		pthread_mutex_init(&(shard->lock), NULL);
+		shard->capacity = limit / memory->nshards;
+		shard->mask = slots - 1;
+		shard->buckets = (struct memory_entry_struct **) calloc(slots, sizeof(struct memory_entry_struct *));
+		shard->sketch = (unsigned char *) calloc(slots, MEMORY_SKETCH_DEPTH);
+		if(!shard->buckets || !shard->sketch)
+		{
+			quilt_logf(LOG_CRIT, QUILT_PLUGIN_NAME ": failed to allocate memory for in-memory cache shard\n");
+			return -1;
+		}
+	}
+	memory->ttl = quilt_config_get_int("memory:ttl", DEFAULT_PATCHWORK_MEMORY_TTL);
+	patchwork->cache.memory = memory;
+	quilt_logf(LOG_INFO, QUILT_PLUGIN_NAME ": in-memory cache: %lu MiB in %lu shards\n", (unsigned long) (limit / (1024 * 1024)), (unsigned long) memory->nshards);
+	return 0;
+}
+
+/* Serve an item from the in-memory cache, returning 404 if it isn't
+ * present
+ */
+int
+patchwork_memory_item(QUILTREQ *request, const char *id)
+{
+	struct patchwork_object_struct obj;
+	struct memory_shard_struct *shard;
+	struct memory_entry_struct *entry;
+	unsigned long long hash;
+	PATCHWORKID key;
+	int r;
+
+	if(!patchwork->cache.memory || patchwork_id_parse(&key, id))
+	{
+		return 404;
+	}
+	shard = patchwork_memory_shard_(&key, &hash);
+	pthread_mutex_lock(&(shard->lock));
+	patchwork_memory_increment_(shard, hash);
+	entry = patchwork_memory_find_(shard, &key, hash);
+	if(entry && entry->expires && time(NULL) >= entry->expires)
+	{
+		patchwork_memory_evict_(shard, entry);
+		entry = NULL;
+	}
+	if(!entry)
+	{
+		pthread_mutex_unlock(&(shard->lock));
+		return 404;
+	}
+	patchwork_memory_touch_(shard, entry);
+	entry->refs++;
+	pthread_mutex_unlock(&(shard->lock));
+
+	quilt_logf(LOG_DEBUG, QUILT_PLUGIN_NAME ": in-memory cache: hit for %s\n", id);
+	memset(&obj, 0, sizeof(struct patchwork_object_struct));
+	obj.buf = entry->buf;
+	obj.len = entry->len;
+	obj.mime = entry->mime;
+	obj.encoding = entry->encoding;
+	obj.borrowed = 1;
+	r = patchwork_object_parse(request, &obj);
+
+	pthread_mutex_lock(&(shard->lock));
+	entry->refs--;
+	if(!entry->refs && entry->evicted)
+	{
+		patchwork_memory_free_(entry);
+	}
+	pthread_mutex_unlock(&(shard->lock));
+	return r;
+}
+
+/* Offer a copy of an object to the in-memory cache, which will store it
+ * if there's room, or if it has been requested more often recently than
+ * the items which would have to be evicted to make room for it
+ */
+int
+patchwork_memory_store(const char *id, const struct patchwork_object_struct *obj)
+{
+	struct memory_shard_struct *shard;
+	struct memory_entry_struct *entry;
+	unsigned long long hash;
+	unsigned int freq;
+	size_t cost, slot;
+	PATCHWORKID key;
+
+	if(!patchwork->cache.memory || patchwork_id_parse(&key, id))
+	{
+		return 0;
+	}
+	shard = patchwork_memory_shard_(&key, &hash);
+	cost = sizeof(struct memory_entry_struct) + obj->len + (obj->mime ? strlen(obj->mime) + 1 : 0);
+	/* Don't allow a single object to displace a large part of a shard */
+	if(cost > shard->capacity / 8)
+	{
+		return 0;
+	}
+	pthread_mutex_lock(&(shard->lock));
+	if(patchwork_memory_find_(shard, &key, hash))
+	{
+		pthread_mutex_unlock(&(shard->lock));
+		return 0;
+	}
+	freq = patchwork_memory_frequency_(shard, hash);
+	while(shard->used + cost > shard->capacity)
+	{
+		if(freq <= patchwork_memory_frequency_(shard, shard->tail->hash))
+		{
+			/* The candidate is less popular than the victim */
+			pthread_mutex_unlock(&(shard->lock));
+			return 0;
+		}
+		patchwork_memory_evict_(shard, shard->tail);
+	}
+	entry = (struct memory_entry_struct *) calloc(1, sizeof(struct memory_entry_struct));
+	if(entry)
+	{
+		entry->buf = (char *) malloc(obj->len + 1);
+		entry->mime = (obj->mime ? strdup(obj->mime) : NULL);
+	}
+	if(!entry || !entry->buf || (obj->mime && !entry->mime))
+	{
+		quilt_logf(LOG_ERR, QUILT_PLUGIN_NAME ": in-memory cache: failed to allocate memory for %s\n", id);
+		if(entry)
+		{
+			patchwork_memory_free_(entry);
+		}
+		pthread_mutex_unlock(&(shard->lock));
+		return -1;
+	}
+	memcpy(entry->buf, obj->buf, obj->len);
+	entry->buf[obj->len] = 0;
+	entry->len = obj->len;
+	entry->encoding = obj->encoding;
+	entry->hash = hash;
+	entry->cost = cost;
+	if(patchwork->cache.memory->ttl > 0)
+	{
+		entry->expires = time(NULL) + patchwork->cache.memory->ttl;
+	}
+	entry->key = key;
+	slot = (size_t) (hash >> 16) & shard->mask;
+	entry->chain = shard->buckets[slot];
+	shard->buckets[slot] = entry;
+	entry->next = shard->head;
+	if(shard->head)
+	{
+		shard->head->prev = entry;
+	}
+	shard->head = entry;
+	if(!shard->tail)
+	{
+		shard->tail = entry;
+	}
+	shard->used += cost;
+	pthread_mutex_unlock(&(shard->lock));
+	return 0;
+}
+
+static struct memory_shard_struct *
+patchwork_memory_shard_(const PATCHWORKID *key, unsigned long long *hash)
+{
+	*hash = patchwork_id_hash(key);
+	return &(patchwork->cache.memory->shards[*hash & (patchwork->cache.memory->nshards - 1)]);
+}
+
+static struct memory_entry_struct *
+patchwork_memory_find_(struct memory_shard_struct *shard, const PATCHWORKID *key, unsigned long long hash)
+{
+	struct memory_entry_struct *entry;
+
+	for(entry = shard->buckets[(size_t) (hash >> 16) & shard->mask]; entry; entry = entry->chain)
+	{
+		if(entry->key.lo == key->lo && entry->key.hi == key->hi)
+		{
+			return entry;
+		}
+	}
+	return NULL;
+}
+
+/* Move an entry to the head of the LRU list */
+static void
+patchwork_memory_touch_(struct memory_shard_struct *shard, struct memory_entry_struct *entry)
+{
+	if(shard->head == entry)
+	{
+		return;
+	}
+	entry->prev->next = entry->next;
+	if(entry->next)
+	{
+		entry->next->prev = entry->prev;
+	}
+	else
+	{
+		shard->tail = entry->prev;
+	}
+	entry->prev = NULL;
+	entry->next = shard->head;
+	shard->head->prev = entry;
+	shard->head = entry;
+}
+
+/* Remove an entry from the shard, freeing it once it is no longer in use */
+static void
+patchwork_memory_evict_(struct memory_shard_struct *shard, struct memory_entry_struct *entry)
+{
+	struct memory_entry_struct **p;
+
+	for(p = &(shard->buckets[(size_t) (entry->hash >> 16) & shard->mask]); *p != entry; p = &((*p)->chain));
+	*p = entry->chain;
+	if(entry->prev)
+	{
+		entry->prev->next = entry->next;
+	}
+	else
+	{
+		shard->head = entry->next;
+	}
+	if(entry->next)
+	{
+		entry->next->prev = entry->prev;
+	}
+	else
+	{
+		shard->tail = entry->prev;
+	}
+	shard->used -= entry->cost;
+	if(entry->refs)
+	{
+		entry->evicted = 1;
+	}
+	else
+	{
+		patchwork_memory_free_(entry);
+	}
+}
+
+static void
+patchwork_memory_free_(struct memory_entry_struct *entry)
+{
+	free(entry->buf);
+	free(entry->mime);
+	free(entry);
+}
+
+/* Estimate how many times an item has been requested recently */
+static unsigned int
+patchwork_memory_frequency_(struct memory_shard_struct *shard, unsigned long long hash)
+{
+	unsigned long long h1, h2;
+	unsigned int freq, c;
+	unsigned char v;
+
+	/* The low bits of the hash select the shard, so aren't used here */
+	h1 = hash >> 8;
+	h2 = (hash >> 32) | 1;
+	freq = MEMORY_COUNTER_MAX;
+	for(c = 0; c < MEMORY_SKETCH_DEPTH; c++)
+	{
+		v = shard->sketch[c * (shard->mask + 1) + ((h1 + c * h2) & shard->mask)];
+		if(v < freq)
+		{
+			freq = v;
+		}
+	}
+	return freq;
+}
+
+/* Record a request for an item, periodically halving all of the counters
+ * so that the sketch reflects recent requests
+ */
+static void
+patchwork_memory_increment_(struct memory_shard_struct *shard, unsigned long long hash)
+{
+	unsigned long long h1, h2;
+	unsigned char *v;
+	size_t c;
+
+	h1 = hash >> 8;
+	h2 = (hash >> 32) | 1;
+	for(c = 0; c < MEMORY_SKETCH_DEPTH; c++)
+	{
+		v = &(shard->sketch[c * (shard->mask + 1) + ((h1 + c * h2) & shard->mask)]);
+		if(*v < MEMORY_COUNTER_MAX)
+		{
+			(*v)++;
+		}
+	}
+	shard->additions++;
+	if(shard->additions >= (shard->mask + 1) * 10)
+	{
+		for(c = 0; c < (shard->mask + 1) * MEMORY_SKETCH_DEPTH; c++)
+		{
+			shard->sketch[c] >>= 1;
+		}
+		shard->additions /= 2;
+	}
+}
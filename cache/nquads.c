@@ -0,0 +1,627 @@
+/* This engine processes requests for coreference graphs populated
+ * by Twine's "spindle" post-processing module.
+ *
+ * Author: Mo McRoberts <mo.mcroberts@bbc.co.uk>
+ *
+ * Copyright (c) 2014-2017 BBC
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include "p_patchwork.h"
+
+/* A reader for the line-oriented N-Quads written by Spindle (and by
+ * patchwork_object_serialise()), used in place of the generic parser for
+ * cached items, and a writer used to cache SPARQL results as they arrive.
+ *
+ * Line and term boundaries are located with memchr(), which the C library
+ * vectorises, and values are only unescaped if they contain a backslash.
+ * Because statements are generally grouped by subject and graph, the raw
+ * text of the most recent term in each position is remembered along with
+ * its node, so that a repeated term costs a comparison and a reference
+ * rather than a new node.
+ */
+
+#define NQUADS_SUBJECT                 0
+#define NQUADS_PREDICATE               1
+#define NQUADS_OBJECT                  2
+#define NQUADS_GRAPH                   3
+
+#define NQUADS_ESCAPE_IRI              1
+#define NQUADS_ESCAPE_LITERAL          2
+
+struct nquads_memo_struct
+{
+	const char *raw;
+	size_t len;
+	librdf_node *node;
+};
+
+struct nquads_state_struct
+{
+	librdf_world *world;
+	struct patchwork_worker_struct *worker;
+	char *scratch;
+	size_t scratchsize;
+	struct nquads_memo_struct memo[4];
+	/* The most recently-used datatype */
+	const char *dtraw;
+	size_t dtlen;
+	librdf_uri *dt;
+};
+
+static int patchwork_nquads_line_(struct nquads_state_struct *state, struct patchwork_sink_struct *sink, const char *p, const char *eol);
+static librdf_node *patchwork_nquads_term_(struct nquads_state_struct *state, const char **pos, const char *eol, int slot);
+static librdf_node *patchwork_nquads_literal_(struct nquads_state_struct *state, const char **pos, const char *eol);
+static int patchwork_nquads_unescape_(const char *src, size_t len, char *dest, size_t *destlen);
+static size_t patchwork_nquads_utf8_(unsigned long c, char *dest);
+static const char *patchwork_nquads_skip_(const char *p, const char *eol);
+static int patchwork_nquads_node_(struct patchwork_object_struct *obj, size_t *size, librdf_node *node);
+static int patchwork_nquads_append_(struct patchwork_object_struct *obj, size_t *size, const char *s, size_t len, int escape);
+
+/* Pass the statements in an N-Quads (or N-Triples) buffer to a sink */
+int
+patchwork_nquads_parse(struct patchwork_sink_struct *sink, const char *buf, size_t len)
+{
+	struct nquads_state_struct state;
+	const char *p, *end, *eol;
+	unsigned long line;
+	int r, c;
+
+	memset(&state, 0, sizeof(struct nquads_state_struct));
+	state.world = quilt_librdf_world();
+	/* The scratch buffer is retained by the thread between items */
+	state.worker = patchwork_worker();
+	if(!state.worker)
+	{
+		return -1;
+	}
+	state.scratch = state.worker->scratch;
+	state.scratchsize = state.worker->scratchsize;
+	r = 0;
+	end = buf + len;
+	for(p = buf, line = 1; p < end; p = eol + 1, line++)
+	{
+		eol = (const char *) memchr(p, '\n', end - p);
+		if(!eol)
+		{
+			eol = end;
+		}
+		if(patchwork_nquads_line_(&state, sink, p, eol))
+		{
+			quilt_logf(LOG_ERR, QUILT_PLUGIN_NAME ": N-Quads: syntax error at line %lu\n", line);
+			r = -1;
+			break;
+		}
+	}
+	for(c = 0; c < 4; c++)
+	{
+		if(state.memo[c].node)
+		{
+			librdf_free_node(state.memo[c].node);
+		}
+	}
+	if(state.dt)
+	{
+		librdf_free_uri(state.dt);
+	}
+	patchwork_worker_release(state.worker);
+	return r;
+}
+
+/* Parse a single line, which may be empty or a comment */
+static int
+patchwork_nquads_line_(struct nquads_state_struct *state, struct patchwork_sink_struct *sink, const char *p, const char *eol)
+{
+	librdf_node *subject, *predicate, *object, *graph;
+	librdf_statement *st;
+	char *scratch;
+
+	if(eol > p && eol[-1] == '\r')
+	{
+		eol--;
+	}
+	p = patchwork_nquads_skip_(p, eol);
+	if(p == eol || *p == '#')
+	{
+		return 0;
+	}
+	/* Unescaping never lengthens a value, so twice the length of the line
+	 * is enough for a literal and its datatype
+	 */
+	if(state->scratchsize < (size_t) (eol - p) * 2 + 2)
+	{
+		scratch = patchwork_worker_scratch(state->worker, (eol - p) * 2 + 2);
+		if(!scratch)
+		{
+			return -1;
+		}
+		state->scratch = scratch;
+		state->scratchsize = state->worker->scratchsize;
+	}
+	subject = patchwork_nquads_term_(state, &p, eol, NQUADS_SUBJECT);
+	predicate = (subject ? patchwork_nquads_term_(state, &p, eol, NQUADS_PREDICATE) : NULL);
+	object = (predicate ? patchwork_nquads_term_(state, &p, eol, NQUADS_OBJECT) : NULL);
+	graph = NULL;
+	if(object && p < eol && (*p == '<' || *p == '_'))
+	{
+		graph = patchwork_nquads_term_(state, &p, eol, NQUADS_GRAPH);
+		if(!graph)
+		{
+			librdf_free_node(object);
+			object = NULL;
+		}
+	}
+	if(!object || p == eol || *p != '.' ||
+	   ((p = patchwork_nquads_skip_(p + 1, eol)) < eol && *p != '#'))
+	{
+		if(subject)
+		{
+			librdf_free_node(subject);
+		}
+		if(predicate)
+		{
+			librdf_free_node(predicate);
+		}
+		if(object)
+		{
+			librdf_free_node(object);
+		}
+		if(graph)
+		{
+			librdf_free_node(graph);
+		}
+		return -1;
+	}
+	/* The statement takes ownership of its nodes */
+	st = librdf_new_statement_from_nodes(state->world, subject, predicate, object);
+	if(!st)
+	{
+		quilt_logf(LOG_CRIT, QUILT_PLUGIN_NAME ": N-Quads: failed to create statement\n");
+		if(graph)
+		{
+			librdf_free_node(graph);
+		}
+		return -1;
+	}
+	patchwork_item_sink_add(sink, st, graph);
+	librdf_free_statement(st);
+	if(graph)
+	{
+		librdf_free_node(graph);
+	}
+	return 0;
+}
+
+/* Parse the term at *pos, advancing *pos past it (and any whitespace which
+ * follows), and returning a new node
+ */
+static librdf_node *
+patchwork_nquads_term_(struct nquads_state_struct *state, const char **pos, const char *eol, int slot)
+{
+	struct nquads_memo_struct *memo;
+	const char *p, *end;
+	librdf_node *node;
+	size_t len;
+
+	p = *pos;
+	if(p == eol)
+	{
+		return NULL;
+	}
+	if(*p == '"')
+	{
+		if(slot != NQUADS_OBJECT)
+		{
+			return NULL;
+		}
+		return patchwork_nquads_literal_(state, pos, eol);
+	}
+	if(*p == '<')
+	{
+		end = (const char *) memchr(p + 1, '>', eol - p - 1);
+		if(!end)
+		{
+			return NULL;
+		}
+		end++;
+	}
+	else if(*p == '_' && eol - p > 2 && p[1] == ':' && slot != NQUADS_PREDICATE)
+	{
+		for(end = p + 2; end < eol && *end != ' ' && *end != '\t'; end++);
+		/* A label can't end with a full stop, so one must be the end of
+		 * the statement
+		 */
+		if(end[-1] == '.')
+		{
+			end--;
+		}
+		if(end == p + 2)
+		{
+			return NULL;
+		}
+	}
+	else
+	{
+		return NULL;
+	}
+	*pos = patchwork_nquads_skip_(end, eol);
+	memo = &(state->memo[slot]);
+	if(memo->node && memo->len == (size_t) (end - p) && !memcmp(memo->raw, p, end - p))
+	{
+		return librdf_new_node_from_node(memo->node);
+	}
+	if(*p == '_')
+	{
+		node = librdf_new_node_from_counted_blank_identifier(state->world, (const unsigned char *) p + 2, end - p - 2);
+	}
+	else if(memchr(p + 1, '\\', end - p - 2))
+	{
+		if(patchwork_nquads_unescape_(p + 1, end - p - 2, state->scratch, &len))
+		{
+			return NULL;
+		}
+		node = librdf_new_node_from_counted_uri_string(state->world, (const unsigned char *) state->scratch, len);
+	}
+	else
+	{
+		node = librdf_new_node_from_counted_uri_string(state->world, (const unsigned char *) p + 1, end - p - 2);
+	}
+	if(!node)
+	{
+		return NULL;
+	}
+	if(memo->node)
+	{
+		librdf_free_node(memo->node);
+	}
+	memo->raw = p;
+	memo->len = end - p;
+	memo->node = librdf_new_node_from_node(node);
+	return node;
+}
+
+/* Parse a literal, with its optional language tag or datatype */
+static librdf_node *
+patchwork_nquads_literal_(struct nquads_state_struct *state, const char **pos, const char *eol)
+{
+	const char *p, *value, *end, *lang, *dt;
+	size_t vlen, langlen, dtlen;
+	char *dtbuf;
+	librdf_uri *uri;
+
+	p = *pos + 1;
+	/* Find the closing quote, which is the first not preceded by an odd
+	 * number of backslashes
+	 */
+	for(end = p; ; end++)
+	{
+		end = (const char *) memchr(end, '"', eol - end);
+		if(!end)
+		{
+			return NULL;
+		}
+		for(value = end; value > p && value[-1] == '\\'; value--);
+		if(!((end - value) & 1))
+		{
+			break;
+		}
+	}
+	value = p;
+	vlen = end - p;
+	if(memchr(value, '\\', vlen))
+	{
+		if(patchwork_nquads_unescape_(value, vlen, state->scratch, &vlen))
+		{
+			return NULL;
+		}
+		value = state->scratch;
+	}
+	p = end + 1;
+	lang = NULL;
+	langlen = 0;
+	uri = NULL;
+	if(p < eol && *p == '@')
+	{
+		lang = ++p;
+		for(; p < eol && (isalnum((unsigned char) *p) || *p == '-'); p++);
+		langlen = p - lang;
+		if(!langlen)
+		{
+			return NULL;
+		}
+	}
+	else if(eol - p > 3 && p[0] == '^' && p[1] == '^' && p[2] == '<')
+	{
+		dt = p + 3;
+		end = (const char *) memchr(dt, '>', eol - dt);
+		if(!end)
+		{
+			return NULL;
+		}
+		dtlen = end - dt;
+		p = end + 1;
+		if(!state->dt || state->dtlen != dtlen || memcmp(state->dtraw, dt, dtlen))
+		{
+			if(memchr(dt, '\\', dtlen))
+			{
+				/* The literal's value may occupy the first half of the
+				 * scratch buffer
+				 */
+				dtbuf = state->scratch + state->scratchsize / 2;
+				if(patchwork_nquads_unescape_(dt, dtlen, dtbuf, &dtlen))
+				{
+					return NULL;
+				}
+				uri = librdf_new_uri2(state->world, (const unsigned char *) dtbuf, dtlen);
+				dtlen = end - dt;
+			}
+			else
+			{
+				uri = librdf_new_uri2(state->world, (const unsigned char *) dt, dtlen);
+			}
+			if(!uri)
+			{
+				return NULL;
+			}
+			if(state->dt)
+			{
+				librdf_free_uri(state->dt);
+			}
+			state->dt = uri;
+			state->dtraw = dt;
+			state->dtlen = dtlen;
+		}
+		uri = state->dt;
+	}
+	*pos = patchwork_nquads_skip_(p, eol);
+	return librdf_new_node_from_typed_counted_literal(state->world, (const unsigned char *) value, vlen, lang, langlen, uri);
+}
+
+/* Decode the escape sequences (\t, \", \uXXXX, etc.) in a value */
+static int
+patchwork_nquads_unescape_(const char *src, size_t len, char *dest, size_t *destlen)
+{
+	const char *end, *bs;
+	unsigned long c;
+	size_t n, i;
+	char *p;
+
+	end = src + len;
+	p = dest;
+	while(src < end)
+	{
+		bs = (const char *) memchr(src, '\\', end - src);
+		if(!bs)
+		{
+			bs = end;
+		}
+		memmove(p, src, bs - src);
+		p += bs - src;
+		if(bs == end)
+		{
+			break;
+		}
+		if(bs + 1 == end)
+		{
+			return -1;
+		}
+		src = bs + 2;
+		switch(bs[1])
+		{
+		case 't':
+			*p++ = '\t';
+			continue;
+		case 'b':
+			*p++ = '\b';
+			continue;
+		case 'n':
+			*p++ = '\n';
+			continue;
+		case 'r':
+			*p++ = '\r';
+			continue;
+		case 'f':
+			*p++ = '\f';
+			continue;
+		case '"':
+		case '\'':
+		case '\\':
+			*p++ = bs[1];
+			continue;
+		case 'u':
+			n = 4;
+			break;
+		case 'U':
+			n = 8;
+			break;
+		default:
+			return -1;
+		}
+		if((size_t) (end - src) < n)
+		{
+			return -1;
+		}
+		for(c = 0, i = 0; i < n; i++, src++)
+		{
+			if(!isxdigit((unsigned char) *src))
+			{
+				return -1;
+			}
+			c = (c << 4) | (unsigned long) (isdigit((unsigned char) *src) ? *src - '0' : (tolower((unsigned char) *src) - 'a' + 10));
+		}
+		if(c > 0x10ffff)
+		{
+			return -1;
+		}
+		p += patchwork_nquads_utf8_(c, p);
+	}
+	*destlen = p - dest;
+	return 0;
+}
+
+/* Encode a code point as UTF-8, returning the number of bytes written */
+static size_t
+patchwork_nquads_utf8_(unsigned long c, char *dest)
+{
+	if(c < 0x80)
+	{
+		dest[0] = (char) c;
+		return 1;
+	}
+	if(c < 0x800)
+	{
+		dest[0] = (char) (0xc0 | (c >> 6));
+		dest[1] = (char) (0x80 | (c & 0x3f));
+		return 2;
+	}
+	if(c < 0x10000)
+	{
+		dest[0] = (char) (0xe0 | (c >> 12));
+		dest[1] = (char) (0x80 | ((c >> 6) & 0x3f));
+		dest[2] = (char) (0x80 | (c & 0x3f));
+		return 3;
+	}
+	dest[0] = (char) (0xf0 | (c >> 18));
+	dest[1] = (char) (0x80 | ((c >> 12) & 0x3f));
+	dest[2] = (char) (0x80 | ((c >> 6) & 0x3f));
+	dest[3] = (char) (0x80 | (c & 0x3f));
+	return 4;
+}
+
+static const char *
+patchwork_nquads_skip_(const char *p, const char *eol)
+{
+	while(p < eol && (*p == ' ' || *p == '\t'))
+	{
+		p++;
+	}
+	return p;
+}
+
+/* Append a statement to an object as a line of N-Quads, so that a graph
+ * can be serialised as it is received (size is the allocated size of
+ * obj->buf, which is kept NUL-terminated)
+ */
+int
+patchwork_nquads_write(struct patchwork_object_struct *obj, size_t *size, librdf_statement *st, librdf_node *context)
+{
+	if(patchwork_nquads_node_(obj, size, librdf_statement_get_subject(st)) ||
+	   patchwork_nquads_node_(obj, size, librdf_statement_get_predicate(st)) ||
+	   patchwork_nquads_node_(obj, size, librdf_statement_get_object(st)) ||
+	   (context && patchwork_nquads_node_(obj, size, context)) ||
+	   patchwork_nquads_append_(obj, size, ".\n", 2, 0))
+	{
+		return -1;
+	}
+	return 0;
+}
+
+/* Append a term, followed by a space */
+static int
+patchwork_nquads_node_(struct patchwork_object_struct *obj, size_t *size, librdf_node *node)
+{
+	const char *s;
+	librdf_uri *dt;
+
+	if(librdf_node_is_resource(node))
+	{
+		s = (const char *) librdf_uri_as_string(librdf_node_get_uri(node));
+		return (patchwork_nquads_append_(obj, size, "<", 1, 0) ||
+				patchwork_nquads_append_(obj, size, s, strlen(s), NQUADS_ESCAPE_IRI) ||
+				patchwork_nquads_append_(obj, size, "> ", 2, 0));
+	}
+	if(librdf_node_is_blank(node))
+	{
+		s = (const char *) librdf_node_get_blank_identifier(node);
+		return (patchwork_nquads_append_(obj, size, "_:", 2, 0) ||
+				patchwork_nquads_append_(obj, size, s, strlen(s), 0) ||
+				patchwork_nquads_append_(obj, size, " ", 1, 0));
+	}
+	s = (const char *) librdf_node_get_literal_value(node);
+	if(patchwork_nquads_append_(obj, size, "\"", 1, 0) ||
+	   patchwork_nquads_append_(obj, size, s, strlen(s), NQUADS_ESCAPE_LITERAL) ||
+	   patchwork_nquads_append_(obj, size, "\"", 1, 0))
+	{
+		return -1;
+	}
+	if((s = librdf_node_get_literal_value_language(node)))
+	{
+		if(patchwork_nquads_append_(obj, size, "@", 1, 0) ||
+		   patchwork_nquads_append_(obj, size, s, strlen(s), 0))
+		{
+			return -1;
+		}
+	}
+	else if((dt = librdf_node_get_literal_value_datatype_uri(node)))
+	{
+		s = (const char *) librdf_uri_as_string(dt);
+		if(patchwork_nquads_append_(obj, size, "^^<", 3, 0) ||
+		   patchwork_nquads_append_(obj, size, s, strlen(s), NQUADS_ESCAPE_IRI) ||
+		   patchwork_nquads_append_(obj, size, ">", 1, 0))
+		{
+			return -1;
+		}
+	}
+	return patchwork_nquads_append_(obj, size, " ", 1, 0);
+}
+
+/* Append text to an object, escaping it as an IRI or a literal if required
+ */
+static int
+patchwork_nquads_append_(struct patchwork_object_struct *obj, size_t *size, const char *s, size_t len, int escape)
+{
+	unsigned char c;
+	size_t n;
+	char *p;
+
+	/* Escaping can expand each byte to at most six */
+	n = obj->len + (escape ? len * 6 : len) + 1;
+	if(n > *size)
+	{
+		n = (n > *size * 2 ? n : *size * 2);
+		p = (char *) realloc(obj->buf, n);
+		if(!p)
+		{
+			quilt_logf(LOG_CRIT, QUILT_PLUGIN_NAME ": failed to allocate memory for serialised graph\n");
+			return -1;
+		}
+		obj->buf = p;
+		*size = n;
+	}
+	p = obj->buf + obj->len;
+	for(; len; s++, len--)
+	{
+		c = (unsigned char) *s;
+		if(escape == NQUADS_ESCAPE_LITERAL && (c == '"' || c == '\\' || c == '\n' || c == '\r'))
+		{
+			*p++ = '\\';
+			*p++ = (c == '\n' ? 'n' : (c == '\r' ? 'r' : (char) c));
+		}
+		else if(escape == NQUADS_ESCAPE_IRI && (c <= 0x20 || strchr("<>\"{}|^`\\", c)))
+		{
+			p += sprintf(p, "\\u%04X", c);
+		}
+		else
+		{
+			*p++ = (char) c;
+		}
+	}
+	*p = 0;
+	obj->len = p - obj->buf;
+	return 0;
+}
@@ -0,0 +1,415 @@
+/* This engine processes requests for coreference graphs populated
+ * by Twine's "spindle" post-processing module.
+ *
+ * Author: Mo McRoberts <mo.mcroberts@bbc.co.uk>
+ *
+ * Copyright (c) 2014-2017 BBC
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+/* Required for strptime() */
+#define _XOPEN_SOURCE                  700
+
+#include "p_patchwork.h"
+
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+/* Metadata about a locally-held object (its MIME type and the validators
+ * of the copy it was retrieved from, or for a graph synthesised from the
+ * database, its expiry time and the value of index.modified) is kept
+ * alongside it in a "sidecar" file named <path>.meta, consisting of
+ * HTTP-style header lines.
+ */
+
+static int patchwork_object_nquads_(const char *mime);
+static int patchwork_object_parse_rdf_(struct patchwork_sink_struct *sink, const char *base, const char *mime, const char *buf, size_t len);
+static char *patchwork_object_metapath_(const char *path);
+static void patchwork_object_header_(char *dest, size_t max, const char *value);
+
+/* Free the resources held by an object (but not the object itself) */
+void
+patchwork_object_free(struct patchwork_object_struct *obj)
+{
+	if(obj->mapped)
+	{
+		munmap(obj->buf, obj->mapped);
+	}
+	else if(!obj->borrowed)
+	{
+		free(obj->buf);
+	}
+	free(obj->mime);
+	memset(obj, 0, sizeof(struct patchwork_object_struct));
+}
+
+/* Parse an object into the request model, decompressing it first if
+ * required; objects in the binary quad and segmented formats are
+ * recognised by their MIME type or magic number. Statements are
+ * post-processed as they are parsed (see patchwork_item_sink_add()).
+ */
+int
+patchwork_object_parse(QUILTREQ *request, struct patchwork_object_struct *obj)
+{
+	return patchwork_object_parse_capture(request, obj, NULL);
+}
+
+/* Parse an object, also capturing its statements (if capture is non-NULL)
+ * before they are filtered; see patchwork_parsed_store()
+ */
+int
+patchwork_object_parse_capture(QUILTREQ *request, struct patchwork_object_struct *obj, struct patchwork_parsed_capture_struct *capture)
+{
+	struct patchwork_sink_struct sink;
+	const char *buf, *mime;
+	char *decoded;
+	size_t len;
+	int r;
+
+	buf = obj->buf;
+	len = obj->len;
+	mime = (obj->mime ? obj->mime : MIME_NQUADS);
+	decoded = NULL;
+	if(obj->encoding == PE_ZSTD || patchwork_zstd_detect(buf, len))
+	{
+		if(patchwork_zstd_decompress(buf, len, &decoded, &len))
+		{
+			return 500;
+		}
+		buf = decoded;
+	}
+	if(patchwork_item_sink_init(&sink, request))
+	{
+		free(decoded);
+		return 500;
+	}
+	sink.capture = capture;
+	if(!strcmp(mime, MIME_PATCHWORK_SEGMENTS) || patchwork_segments_detect(buf, len))
+	{
+		/* Only the segment for a sub-resource is loaded */
+		r = patchwork_segments_parse(&sink, buf, len, sink.facet);
+	}
+	else if(sink.facet && !obj->segment)
+	{
+		/* Only segmented objects have sub-resources */
+		r = 404;
+	}
+	else if(!strcmp(mime, MIME_PATCHWORK_QUADS) || patchwork_quads_detect(buf, len))
+	{
+		/* Binary quads can be loaded without being tokenised */
+		r = (patchwork_quads_parse(&sink, buf, len) ? 500 : 200);
+	}
+	else if(patchwork_object_nquads_(mime))
+	{
+		r = (patchwork_nquads_parse(&sink, buf, len) ? 500 : 200);
+	}
+	else
+	{
+		r = (patchwork_object_parse_rdf_(&sink, request->base, mime, buf, len) ? 500 : 200);
+	}
+	patchwork_item_sink_done(&sink);
+	free(decoded);
+	return r;
+}
+
+/* Serialise a model as N-Quads into an object */
+int
+patchwork_object_serialise(librdf_model *model, struct patchwork_object_struct *obj)
+{
+	librdf_serializer *serializer;
+	unsigned char *buf;
+	size_t len;
+
+	serializer = librdf_new_serializer(quilt_librdf_world(), "nquads", NULL, NULL);
+	if(!serializer)
+	{
+		quilt_logf(LOG_ERR, QUILT_PLUGIN_NAME ": failed to create N-Quads serializer\n");
+		return -1;
+	}
+	buf = librdf_serializer_serialize_model_to_counted_string(serializer, NULL, model, &len);
+	librdf_free_serializer(serializer);
+	if(!buf)
+	{
+		quilt_logf(LOG_ERR, QUILT_PLUGIN_NAME ": failed to serialise model as N-Quads\n");
+		return -1;
+	}
+	/* The buffer belongs to librdf, so copy it in order that the object
+	 * can be freed normally
+	 */
+	obj->buf = (char *) malloc(len + 1);
+	obj->mime = strdup(MIME_NQUADS);
+	if(!obj->buf || !obj->mime)
+	{
+		quilt_logf(LOG_CRIT, QUILT_PLUGIN_NAME ": failed to allocate memory for serialised model\n");
+		librdf_free_memory(buf);
+		patchwork_object_free(obj);
+		return -1;
+	}
+	memcpy(obj->buf, buf, len);
+	obj->buf[len] = 0;
+	obj->len = len;
+	obj->encoding = PE_IDENTITY;
+	librdf_free_memory(buf);
+	return 0;
+}
+
+/* Read the sidecar metadata for the object stored at path, returning -1
+ * if there is none
+ */
+int
+patchwork_object_meta_read(const char *path, struct patchwork_object_struct *obj)
+{
+	char *metapath, *p;
+	char line[512];
+	struct tm tm;
+	FILE *f;
+
+	metapath = patchwork_object_metapath_(path);
+	if(!metapath)
+	{
+		return -1;
+	}
+	f = fopen(metapath, "r");
+	free(metapath);
+	if(!f)
+	{
+		return -1;
+	}
+	while(fgets(line, sizeof(line), f))
+	{
+		p = strchr(line, ':');
+		if(!p)
+		{
+			continue;
+		}
+		*p = 0;
+		p++;
+		while(isspace(*p))
+		{
+			p++;
+		}
+		if(!strcasecmp(line, "Content-Type"))
+		{
+			patchwork_object_header_(line, sizeof(line), p);
+			free(obj->mime);
+			obj->mime = strdup(line);
+		}
+		else if(!strcasecmp(line, "Content-Encoding"))
+		{
+			obj->encoding = (strncasecmp(p, "zstd", 4) ? PE_IDENTITY : PE_ZSTD);
+		}
+		else if(!strcasecmp(line, "ETag"))
+		{
+			patchwork_object_header_(obj->etag, sizeof(obj->etag), p);
+		}
+		else if(!strcasecmp(line, "Last-Modified"))
+		{
+			patchwork_object_header_(obj->modified, sizeof(obj->modified), p);
+		}
+		else if(!strcasecmp(line, "Expires"))
+		{
+			memset(&tm, 0, sizeof(struct tm));
+			if(strptime(p, "%a, %d %b %Y %H:%M:%S GMT", &tm))
+			{
+				obj->expires = timegm(&tm);
+			}
+		}
+		else if(!strcasecmp(line, "X-Index-Modified"))
+		{
+			patchwork_object_header_(obj->indexed, sizeof(obj->indexed), p);
+		}
+	}
+	fclose(f);
+	return 0;
+}
+
+/* Atomically replace the sidecar metadata for the object stored at path */
+int
+patchwork_object_meta_write(const char *path, const struct patchwork_object_struct *obj)
+{
+	char *metapath, *tmppath;
+	char date[PATCHWORK_DATE_MAX];
+	struct tm tm;
+	FILE *f;
+	int fd;
+
+	metapath = patchwork_object_metapath_(path);
+	if(!metapath)
+	{
+		return -1;
+	}
+	tmppath = (char *) malloc(strlen(metapath) + 8);
+	if(!tmppath)
+	{
+		free(metapath);
+		return -1;
+	}
+	/* Several threads may be storing the same object at once */
+	sprintf(tmppath, "%s.XXXXXX", metapath);
+	fd = mkstemp(tmppath);
+	f = (fd == -1 ? NULL : fdopen(fd, "w"));
+	if(!f)
+	{
+		quilt_logf(LOG_ERR, QUILT_PLUGIN_NAME ": failed to open %s for writing: %s\n", tmppath, strerror(errno));
+		if(fd != -1)
+		{
+			close(fd);
+			unlink(tmppath);
+		}
+		free(tmppath);
+		free(metapath);
+		return -1;
+	}
+	fchmod(fd, 0644);
+	if(obj->mime)
+	{
+		fprintf(f, "Content-Type: %s\n", obj->mime);
+	}
+	if(obj->encoding == PE_ZSTD)
+	{
+		fprintf(f, "Content-Encoding: zstd\n");
+	}
+	if(obj->etag[0])
+	{
+		fprintf(f, "ETag: %s\n", obj->etag);
+	}
+	if(obj->modified[0])
+	{
+		fprintf(f, "Last-Modified: %s\n", obj->modified);
+	}
+	if(obj->expires)
+	{
+		gmtime_r(&(obj->expires), &tm);
+		strftime(date, sizeof(date), "%a, %d %b %Y %H:%M:%S GMT", &tm);
+		fprintf(f, "Expires: %s\n", date);
+		fprintf(f, "X-Index-Modified: %s\n", obj->indexed);
+	}
+	if(fclose(f) || rename(tmppath, metapath))
+	{
+		quilt_logf(LOG_ERR, QUILT_PLUGIN_NAME ": failed to write %s: %s\n", metapath, strerror(errno));
+		unlink(tmppath);
+		free(tmppath);
+		free(metapath);
+		return -1;
+	}
+	free(tmppath);
+	free(metapath);
+	return 0;
+}
+
+/* Returns non-zero if mime is one which can be read by
+ * patchwork_nquads_parse()
+ */
+static int
+patchwork_object_nquads_(const char *mime)
+{
+	static const char *const types[] = {
+		MIME_NQUADS, "text/x-nquads", "application/n-triples", NULL
+	};
+	size_t c, l;
+
+	for(l = 0; mime[l] && mime[l] != ';' && !isspace((unsigned char) mime[l]); l++);
+	for(c = 0; types[c]; c++)
+	{
+		if(strlen(types[c]) == l && !strncasecmp(mime, types[c], l))
+		{
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/* Parse a buffer with the librdf parser for its MIME type, passing each
+ * statement to the sink as it is produced
+ */
+static int
+patchwork_object_parse_rdf_(struct patchwork_sink_struct *sink, const char *base, const char *mime, const char *buf, size_t len)
+{
+	librdf_world *world;
+	librdf_parser *parser;
+	librdf_uri *uri;
+	librdf_stream *stream;
+
+	world = quilt_librdf_world();
+	parser = librdf_new_parser(world, NULL, mime, NULL);
+	if(!parser)
+	{
+		quilt_logf(LOG_ERR, QUILT_PLUGIN_NAME ": failed to create parser for '%s'\n", mime);
+		return -1;
+	}
+	uri = librdf_new_uri(world, (const unsigned char *) base);
+	if(!uri)
+	{
+		quilt_logf(LOG_CRIT, QUILT_PLUGIN_NAME ": failed to create base URI for parser\n");
+		librdf_free_parser(parser);
+		return -1;
+	}
+	stream = librdf_parser_parse_counted_string_as_stream(parser, (const unsigned char *) buf, len, uri);
+	if(!stream)
+	{
+		quilt_logf(LOG_ERR, QUILT_PLUGIN_NAME ": failed to parse buffer as '%s'\n", mime);
+		librdf_free_uri(uri);
+		librdf_free_parser(parser);
+		return -1;
+	}
+	for(; !librdf_stream_end(stream); librdf_stream_next(stream))
+	{
+		patchwork_item_sink_add(sink, librdf_stream_get_object(stream), (librdf_node *) librdf_stream_get_context2(stream));
+	}
+	librdf_free_stream(stream);
+	librdf_free_uri(uri);
+	librdf_free_parser(parser);
+	return 0;
+}
+
+static char *
+patchwork_object_metapath_(const char *path)
+{
+	char *p;
+
+	p = (char *) malloc(strlen(path) + 6);
+	if(!p)
+	{
+		quilt_logf(LOG_CRIT, QUILT_PLUGIN_NAME ": failed to allocate memory for metadata path\n");
+		return NULL;
+	}
+	strcpy(p, path);
+	strcat(p, ".meta");
+	return p;
+}
+
+/* Copy a header value, stripping trailing whitespace */
+static void
+patchwork_object_header_(char *dest, size_t max, const char *value)
+{
+	size_t l;
+
+	l = strlen(value);
+	while(l && isspace(value[l - 1]))
+	{
+		l--;
+	}
+	if(l >= max)
+	{
+		dest[0] = 0;
+		return;
+	}
+	memmove(dest, value, l);
+	dest[l] = 0;
+}
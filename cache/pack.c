@@ -0,0 +1,236 @@
+/* This engine processes requests for coreference graphs populated
+ * by Twine's "spindle" post-processing module.
+ *
+ * Author: Mo McRoberts <mo.mcroberts@bbc.co.uk>
+ *
+ * Copyright (c) 2014-2017 BBC
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include "p_patchwork.h"
+#include "packfile.h"
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+/* If the file cache directory contains a packfile index (built from a
+ * directory of cached items by patchwork-pack), the index and each of
+ * its segments are mapped at start-up, so that an item can be found with
+ * a binary search of the index and served directly from the mapping.
+ *
+ * Individual files are looked for before the packfiles, so that a cache
+ * can be packed periodically while new and updated items continue to be
+ * written alongside it (patchwork-pack doesn't remove the files it packs,
+ * so these are never older than the packed copies).
+ */
+
+static const char *patchwork_pack_map_(const char *path, size_t *len);
+
+int
+patchwork_pack_open(const char *path)
+{
+	struct patchwork_pack_struct *pack;
+	char *buf;
+	const unsigned char *index;
+	size_t len, n, header;
+	uint64_t nentries;
+	uint32_t version, generation;
+
+	buf = (char *) malloc(strlen(path) + 32);
+	if(!buf)
+	{
+		quilt_logf(LOG_CRIT, QUILT_PLUGIN_NAME ": failed to allocate memory for packfile path\n");
+		return -1;
+	}
+	sprintf(buf, "%s%s", path, PACK_INDEX_NAME);
+	index = (const unsigned char *) patchwork_pack_map_(buf, &len);
+	if(!index)
+	{
+		if(errno == ENOENT)
+		{
+			/* No packfiles have been built */
+			free(buf);
+			return 0;
+		}
+		quilt_logf(LOG_CRIT, QUILT_PLUGIN_NAME ": failed to map packfile index %s: %s\n", buf, strerror(errno));
+		free(buf);
+		return -1;
+	}
+	version = (len >= PACK_V1_HEADER_SIZE && !memcmp(index, PACK_MAGIC, 8) ? pack_get32(index + 8) : 0);
+	header = (version == 1 ? PACK_V1_HEADER_SIZE : PACK_HEADER_SIZE);
+	if((version != 1 && version != PACK_VERSION) || len < header)
+	{
+		quilt_logf(LOG_CRIT, QUILT_PLUGIN_NAME ": %s is not a supported packfile index\n", buf);
+		munmap((void *) index, len);
+		free(buf);
+		return -1;
+	}
+	generation = (version == 1 ? 0 : pack_get32(index + 24));
+	nentries = pack_get64(index + 16);
+	if(nentries > (len - header) / PACK_ENTRY_SIZE)
+	{
+		quilt_logf(LOG_CRIT, QUILT_PLUGIN_NAME ": packfile index %s is truncated\n", buf);
+		munmap((void *) index, len);
+		free(buf);
+		return -1;
+	}
+	pack = (struct patchwork_pack_struct *) calloc(1, sizeof(struct patchwork_pack_struct));
+	if(pack)
+	{
+		pack->nsegments = pack_get32(index + 12);
+		pack->segments = (struct patchwork_pack_segment_struct *) calloc(pack->nsegments + 1, sizeof(struct patchwork_pack_segment_struct));
+	}
+	if(!pack || !pack->segments)
+	{
+		quilt_logf(LOG_CRIT, QUILT_PLUGIN_NAME ": failed to allocate memory for packfile segments\n");
+		free(pack);
+		munmap((void *) index, len);
+		free(buf);
+		return -1;
+	}
+	pack->index = index;
+	pack->indexlen = len;
+	pack->entries = index + header;
+	pack->nentries = (size_t) nentries;
+	for(n = 0; n < pack->nsegments; n++)
+	{
+		if(version == 1)
+		{
+			sprintf(buf, "%s" PACK_V1_SEGMENT_NAME, path, (unsigned) n);
+		}
+		else
+		{
+			sprintf(buf, "%s" PACK_SEGMENT_NAME, path, (unsigned) generation, (unsigned) n);
+		}
+		pack->segments[n].base = patchwork_pack_map_(buf, &(pack->segments[n].len));
+		if(!pack->segments[n].base)
+		{
+			quilt_logf(LOG_CRIT, QUILT_PLUGIN_NAME ": failed to map packfile segment %s: %s\n", buf, strerror(errno));
+			while(n > 0)
+			{
+				n--;
+				munmap((void *) pack->segments[n].base, pack->segments[n].len);
+			}
+			munmap((void *) index, len);
+			free(pack->segments);
+			free(pack);
+			free(buf);
+			return -1;
+		}
+	}
+	quilt_logf(LOG_INFO, QUILT_PLUGIN_NAME ": file: using %lu packed items in %lu segments\n", (unsigned long) pack->nentries, (unsigned long) pack->nsegments);
+	patchwork->cache.pack = pack;
+	free(buf);
+	return 0;
+}
+
+/* Locate an item in the packfiles, returning -1 if it isn't present */
+int
+patchwork_pack_lookup(const char *id, struct patchwork_object_struct *obj)
+{
+	struct patchwork_pack_struct *pack;
+	unsigned char key[PACK_ID_SIZE];
+	const unsigned char *entry;
+	PATCHWORKID pid;
+	size_t lo, hi, mid;
+	uint32_t segment;
+	uint64_t offset, length;
+	int c;
+
+	pack = patchwork->cache.pack;
+	if(!pack || patchwork_id_parse(&pid, id))
+	{
+		return -1;
+	}
+	pack_putid(key, pid.hi, pid.lo);
+	lo = 0;
+	hi = pack->nentries;
+	while(lo < hi)
+	{
+		mid = lo + (hi - lo) / 2;
+		entry = pack->entries + mid * PACK_ENTRY_SIZE;
+		c = memcmp(key, entry, PACK_ID_SIZE);
+		if(!c)
+		{
+			segment = pack_get32(entry + 16);
+			offset = pack_get64(entry + 24);
+			length = pack_get64(entry + 32);
+			if(segment >= pack->nsegments ||
+			   offset > pack->segments[segment].len ||
+			   length > pack->segments[segment].len - offset)
+			{
+				quilt_logf(LOG_ERR, QUILT_PLUGIN_NAME ": file: packfile index entry for %s is invalid\n", id);
+				return -1;
+			}
+			obj->buf = (char *) pack->segments[segment].base + offset;
+			obj->len = (size_t) length;
+			obj->borrowed = 1;
+			obj->encoding = ((pack_get32(entry + 20) & PACK_FLAG_ZSTD) ? PE_ZSTD : PE_IDENTITY);
+			return 0;
+		}
+		if(c < 0)
+		{
+			hi = mid;
+		}
+		else
+		{
+			lo = mid + 1;
+		}
+	}
+	return -1;
+}
+
+/* Map a whole file read-only, returning NULL (with errno set) on failure */
+static const char *
+patchwork_pack_map_(const char *path, size_t *len)
+{
+	struct stat sbuf;
+	void *p;
+	int fd, e;
+
+	fd = open(path, O_RDONLY);
+	if(fd == -1)
+	{
+		return NULL;
+	}
+	if(fstat(fd, &sbuf))
+	{
+		e = errno;
+		close(fd);
+		errno = e;
+		return NULL;
+	}
+	*len = (size_t) sbuf.st_size;
+	if(!*len)
+	{
+		/* An empty segment can't be mapped, but has nothing to serve */
+		close(fd);
+		return "";
+	}
+	p = mmap(NULL, *len, PROT_READ, MAP_SHARED, fd, 0);
+	e = errno;
+	close(fd);
+	if(p == MAP_FAILED)
+	{
+		errno = e;
+		return NULL;
+	}
+	return (const char *) p;
+}
@@ -0,0 +1,115 @@
+/* This engine processes requests for coreference graphs populated
+ * by Twine's "spindle" post-processing module.
+ *
+ * Author: Mo McRoberts <mo.mcroberts@bbc.co.uk>
+ *
+ * Copyright (c) 2014-2017 BBC
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#ifndef PATCHWORK_PACKFILE_H_
+# define PATCHWORK_PACKFILE_H_         1
+
+# include <stdint.h>
+# include <string.h>
+
+/* A packfile cache consists of a set of append-only segment files, named
+ * pack-G-NNNNN.dat, which hold the cached objects back-to-back, and an
+ * index, pack.idx, which maps each 128-bit item ID to the segment, offset
+ * and length of its object. Each run of patchwork-pack writes a new
+ * generation (G) of segments, so that those referred to by an existing
+ * index are never modified.
+ *
+ * The index consists of a fixed-size header:
+ *
+ *   8 bytes   magic ("PWPACKIX")
+ *   uint32    format version (PACK_VERSION)
+ *   uint32    number of segments
+ *   uint64    number of entries
+ *   uint32    generation of the segments
+ *   uint32    reserved (zero)
+ *
+ * followed by the entries, sorted by ID so that they can be found with a
+ * binary search:
+ *
+ *   16 bytes  item ID
+ *   uint32    segment number
+ *   uint32    flags (PACK_FLAG_xxx)
+ *   uint64    offset of the object within the segment
+ *   uint64    length of the object
+ *
+ * All integers are stored little-endian. Version 1 indexes have no
+ * generation (their header is only 24 bytes long), and their segments
+ * are named pack-NNNNN.dat.
+ */
+
+# define PACK_MAGIC                     "PWPACKIX"
+# define PACK_VERSION                   2
+# define PACK_HEADER_SIZE               32
+# define PACK_ENTRY_SIZE                40
+# define PACK_ID_SIZE                   16
+# define PACK_INDEX_NAME                "pack.idx"
+# define PACK_SEGMENT_NAME              "pack-%u-%05u.dat"
+
+# define PACK_V1_HEADER_SIZE            24
+# define PACK_V1_SEGMENT_NAME           "pack-%05u.dat"
+
+/* The object is Zstandard-compressed */
+# define PACK_FLAG_ZSTD                 0x0001
+
+static inline uint32_t
+pack_get32(const unsigned char *p)
+{
+	return (uint32_t) p[0] | ((uint32_t) p[1] << 8) | ((uint32_t) p[2] << 16) | ((uint32_t) p[3] << 24);
+}
+
+static inline uint64_t
+pack_get64(const unsigned char *p)
+{
+	return (uint64_t) pack_get32(p) | ((uint64_t) pack_get32(p + 4) << 32);
+}
+
+static inline void
+pack_put32(unsigned char *p, uint32_t v)
+{
+	p[0] = v & 0xff;
+	p[1] = (v >> 8) & 0xff;
+	p[2] = (v >> 16) & 0xff;
+	p[3] = (v >> 24) & 0xff;
+}
+
+static inline void
+pack_put64(unsigned char *p, uint64_t v)
+{
+	pack_put32(p, (uint32_t) (v & 0xffffffff));
+	pack_put32(p + 4, (uint32_t) (v >> 32));
+}
+
+/* Write the two 64-bit words of an item ID (see patchwork_id_parse()) as
+ * the big-endian 16-byte key used by the index, so that the entries sort
+ * in the same order as the hexadecimal form of their IDs
+ */
+static inline void
+pack_putid(unsigned char *dest, uint64_t hi, uint64_t lo)
+{
+	int n;
+
+	for(n = 0; n < 8; n++)
+	{
+		dest[n] = (hi >> (56 - n * 8)) & 0xff;
+		dest[n + 8] = (lo >> (56 - n * 8)) & 0xff;
+	}
+}
+
+#endif /*!PATCHWORK_PACKFILE_H_*/
@@ -0,0 +1,540 @@
+/* This engine processes requests for coreference graphs populated
+ * by Twine's "spindle" post-processing module.
+ *
+ * Author: Mo McRoberts <mo.mcroberts@bbc.co.uk>
+ *
+ * Copyright (c) 2014-2017 BBC
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include "p_patchwork.h"
+
+#include <unistd.h>
+#include <sys/stat.h>
+#ifdef HAVE_SYS_INOTIFY_H
+# include <sys/inotify.h>
+#endif
+
+/* A cache of the statements parsed from items in the file cache, so that
+ * a repeat request for an item only needs to copy them into the request
+ * model rather than reading and parsing the file again.
+ *
+ * Each entry records the identity (device, inode and modification time)
+ * of the file it was parsed from. If the cache directory can be watched
+ * with inotify, entries are invalidated as soon as the corresponding
+ * files are replaced or removed; otherwise, each lookup stat()s the file
+ * and compares its identity with that of the entry.
+ *
+ * Statements are captured by the sink as they are parsed, before they are
+ * filtered (by fields= or language) or moved from the abstract document
+ * graph to the concrete graph of the request, and are passed through a
+ * sink again for each request that they're served to.
+ *
+ * The cache is bounded by the total number of statements it holds
+ * (file:parsed_limit), with the least-recently-used items being evicted
+ * first. Statements are held as librdf statements sharing their nodes
+ * with the request models they are copied into, so all access takes
+ * place with the cache lock held.
+ */
+
+struct parsed_entry_struct
+{
+	struct parsed_entry_struct *chain;
+	struct parsed_entry_struct *prev;
+	struct parsed_entry_struct *next;
+	unsigned long long hash;
+	PATCHWORKID item;
+	struct patchwork_parsed_key_struct key;
+	size_t count;
+	librdf_statement **statements;
+	librdf_node **contexts;
+};
+
+static struct
+{
+	pthread_mutex_t lock;
+	int enabled;
+	/* Non-zero if the cache directory is being watched */
+	int watching;
+	/* Incremented whenever an invalidation is received */
+	unsigned long generation;
+	struct parsed_entry_struct **buckets;
+	size_t mask;
+	struct parsed_entry_struct *head;
+	struct parsed_entry_struct *tail;
+	size_t used;
+	size_t limit;
+} patchwork_parsed = { PTHREAD_MUTEX_INITIALIZER, 0, 0, 0, NULL, 0, NULL, NULL, 0, 0 };
+
+static int patchwork_parsed_identify_(const char *id, struct patchwork_parsed_key_struct *key);
+static struct parsed_entry_struct *patchwork_parsed_find_(const PATCHWORKID *item, unsigned long long hash);
+static void patchwork_parsed_evict_(struct parsed_entry_struct *entry);
+static void patchwork_parsed_free_(struct parsed_entry_struct *entry);
+static void patchwork_parsed_invalidate_(const char *name);
+#ifdef HAVE_SYS_INOTIFY_H
+static void *patchwork_parsed_thread_(void *arg);
+#endif
+
+int
+patchwork_parsed_init(void)
+{
+	size_t slots;
+#ifdef HAVE_SYS_INOTIFY_H
+	pthread_attr_t attr;
+	pthread_t thread;
+	int fd;
+#endif
+
+	patchwork_parsed.limit = quilt_config_get_int("file:parsed_limit", DEFAULT_PATCHWORK_PARSED_LIMIT);
+	if(!patchwork_parsed.limit)
+	{
+		return 0;
+	}
+	/* Assume around 64 statements per item */
+	for(slots = 256; slots < patchwork_parsed.limit / 64; slots <<= 1);
+	patchwork_parsed.buckets = (struct parsed_entry_struct **) calloc(slots, sizeof(struct parsed_entry_struct *));
+	if(!patchwork_parsed.buckets)
+	{
+		quilt_logf(LOG_CRIT, QUILT_PLUGIN_NAME ": failed to allocate memory for parsed item cache\n");
+		return -1;
+	}
+	patchwork_parsed.mask = slots - 1;
+	patchwork_parsed.enabled = 1;
+#ifdef HAVE_SYS_INOTIFY_H
+	fd = inotify_init1(IN_CLOEXEC);
+	if(fd == -1 ||
+	   inotify_add_watch(fd, patchwork->cache.path, IN_CLOSE_WRITE|IN_MOVED_TO|IN_MOVED_FROM|IN_DELETE|IN_DELETE_SELF) == -1)
+	{
+		quilt_logf(LOG_NOTICE, QUILT_PLUGIN_NAME ": file: cannot watch %s for changes (%s); parsed items will be checked on each request\n", patchwork->cache.path, strerror(errno));
+		if(fd != -1)
+		{
+			close(fd);
+		}
+		return 0;
+	}
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	if(pthread_create(&thread, &attr, patchwork_parsed_thread_, (void *) (long) fd))
+	{
+		quilt_logf(LOG_NOTICE, QUILT_PLUGIN_NAME ": file: failed to start thread to watch %s; parsed items will be checked on each request\n", patchwork->cache.path);
+		close(fd);
+	}
+	else
+	{
+		patchwork_parsed.watching = 1;
+	}
+	pthread_attr_destroy(&attr);
+#endif
+	return 0;
+}
+
+/* Pass the parsed statements for an item to the request model, if they
+ * are present and current, returning 200; otherwise, populate key so that
+ * the statements can be stored by patchwork_parsed_store() once the item
+ * has been parsed, and return 404
+ */
+int
+patchwork_parsed_item(QUILTREQ *request, const char *id, struct patchwork_parsed_key_struct *key)
+{
+	struct parsed_entry_struct *entry;
+	struct patchwork_sink_struct sink;
+	unsigned long long hash;
+	PATCHWORKID item;
+	size_t c;
+
+	memset(key, 0, sizeof(struct patchwork_parsed_key_struct));
+	if(!patchwork_parsed.enabled || strlen(id) != 32 || patchwork_id_parse(&item, id))
+	{
+		return 404;
+	}
+	if(!patchwork_parsed.watching && patchwork_parsed_identify_(id, key))
+	{
+		return 404;
+	}
+	hash = patchwork_id_hash(&item);
+	if(patchwork_item_sink_init(&sink, request))
+	{
+		return 404;
+	}
+	pthread_mutex_lock(&(patchwork_parsed.lock));
+	key->generation = patchwork_parsed.generation;
+	key->valid = 1;
+	entry = patchwork_parsed_find_(&item, hash);
+	if(entry && !patchwork_parsed.watching &&
+	   (entry->key.dev != key->dev || entry->key.ino != key->ino ||
+		entry->key.mtime != key->mtime || entry->key.mtime_nsec != key->mtime_nsec))
+	{
+		/* The file has changed since it was parsed */
+		patchwork_parsed_evict_(entry);
+		entry = NULL;
+	}
+	if(!entry)
+	{
+		pthread_mutex_unlock(&(patchwork_parsed.lock));
+		patchwork_item_sink_done(&sink);
+		return 404;
+	}
+	for(c = 0; c < entry->count; c++)
+	{
+		patchwork_item_sink_add(&sink, entry->statements[c], entry->contexts[c]);
+	}
+	/* Any statements held back by the sink share nodes with the entry */
+	patchwork_item_sink_done(&sink);
+	/* Move the entry to the head of the LRU list */
+	if(entry != patchwork_parsed.head)
+	{
+		entry->prev->next = entry->next;
+		if(entry->next)
+		{
+			entry->next->prev = entry->prev;
+		}
+		else
+		{
+			patchwork_parsed.tail = entry->prev;
+		}
+		entry->prev = NULL;
+		entry->next = patchwork_parsed.head;
+		patchwork_parsed.head->prev = entry;
+		patchwork_parsed.head = entry;
+	}
+	pthread_mutex_unlock(&(patchwork_parsed.lock));
+	quilt_logf(LOG_DEBUG, QUILT_PLUGIN_NAME ": file: copied %lu parsed statements for %s\n", (unsigned long) c, id);
+	return 200;
+}
+
+/* Store the statements captured while parsing an item, taking ownership
+ * of them
+ */
+int
+patchwork_parsed_store(const char *id, const struct patchwork_parsed_key_struct *key, struct patchwork_parsed_capture_struct *capture)
+{
+	struct parsed_entry_struct *entry, *existing;
+
+	if(!key->valid || capture->failed || !capture->count ||
+	   capture->count > patchwork_parsed.limit / 8)
+	{
+		/* Either something went wrong, or the item is too large */
+		return 0;
+	}
+	entry = (struct parsed_entry_struct *) calloc(1, sizeof(struct parsed_entry_struct));
+	if(!entry)
+	{
+		return -1;
+	}
+	if(patchwork_id_parse(&(entry->item), id))
+	{
+		free(entry);
+		return 0;
+	}
+	entry->hash = patchwork_id_hash(&(entry->item));
+	entry->key = *key;
+	pthread_mutex_lock(&(patchwork_parsed.lock));
+	if(key->generation != patchwork_parsed.generation)
+	{
+		/* The cache directory has changed since the item was read, so
+		 * what was parsed may already be out of date
+		 */
+		pthread_mutex_unlock(&(patchwork_parsed.lock));
+		free(entry);
+		return 0;
+	}
+	entry->count = capture->count;
+	entry->statements = capture->statements;
+	entry->contexts = capture->contexts;
+	memset(capture, 0, sizeof(struct patchwork_parsed_capture_struct));
+	if((existing = patchwork_parsed_find_(&(entry->item), entry->hash)))
+	{
+		patchwork_parsed_evict_(existing);
+	}
+	while(patchwork_parsed.tail && patchwork_parsed.used + entry->count > patchwork_parsed.limit)
+	{
+		patchwork_parsed_evict_(patchwork_parsed.tail);
+	}
+	entry->chain = patchwork_parsed.buckets[(size_t) (entry->hash >> 16) & patchwork_parsed.mask];
+	patchwork_parsed.buckets[(size_t) (entry->hash >> 16) & patchwork_parsed.mask] = entry;
+	entry->next = patchwork_parsed.head;
+	if(patchwork_parsed.head)
+	{
+		patchwork_parsed.head->prev = entry;
+	}
+	patchwork_parsed.head = entry;
+	if(!patchwork_parsed.tail)
+	{
+		patchwork_parsed.tail = entry;
+	}
+	patchwork_parsed.used += entry->count;
+	pthread_mutex_unlock(&(patchwork_parsed.lock));
+	return 0;
+}
+
+/* Record a statement passed to a sink (see patchwork_item_sink_add()) */
+int
+patchwork_parsed_capture(struct patchwork_parsed_capture_struct *capture, librdf_statement *st, librdf_node *context)
+{
+	librdf_statement **sp;
+	librdf_node **cp;
+
+	if(capture->failed)
+	{
+		return -1;
+	}
+	/* Items too large to be cached needn't be captured in full */
+	if(capture->count > patchwork_parsed.limit / 8)
+	{
+		capture->failed = 1;
+		return -1;
+	}
+	if(capture->count == capture->size)
+	{
+		sp = (librdf_statement **) realloc(capture->statements, sizeof(librdf_statement *) * (capture->size + 64));
+		if(sp)
+		{
+			capture->statements = sp;
+		}
+		cp = (librdf_node **) realloc(capture->contexts, sizeof(librdf_node *) * (capture->size + 64));
+		if(cp)
+		{
+			capture->contexts = cp;
+		}
+		if(!sp || !cp)
+		{
+			capture->failed = 1;
+			return -1;
+		}
+		capture->size += 64;
+	}
+	capture->statements[capture->count] = librdf_new_statement_from_statement(st);
+	if(!capture->statements[capture->count])
+	{
+		capture->failed = 1;
+		return -1;
+	}
+	capture->contexts[capture->count] = (context ? librdf_new_node_from_node(context) : NULL);
+	capture->count++;
+	return 0;
+}
+
+void
+patchwork_parsed_capture_free(struct patchwork_parsed_capture_struct *capture)
+{
+	size_t c;
+
+	for(c = 0; c < capture->count; c++)
+	{
+		librdf_free_statement(capture->statements[c]);
+		if(capture->contexts[c])
+		{
+			librdf_free_node(capture->contexts[c]);
+		}
+	}
+	free(capture->statements);
+	free(capture->contexts);
+	memset(capture, 0, sizeof(struct patchwork_parsed_capture_struct));
+}
+
+/* Determine the identity of the file which holds an item, which is all
+ * zeroes if the item is packed (packfiles don't change while they are in
+ * use)
+ */
+static int
+patchwork_parsed_identify_(const char *id, struct patchwork_parsed_key_struct *key)
+{
+	struct stat sbuf;
+	char *path;
+	int r;
+
+	r = -1;
+#ifdef WITH_ZSTD
+	path = patchwork_file_path(id, ".zst");
+	if(!path)
+	{
+		return -1;
+	}
+	r = stat(path, &sbuf);
+	free(path);
+#endif
+	if(r)
+	{
+		path = patchwork_file_path(id, NULL);
+		if(!path)
+		{
+			return -1;
+		}
+		r = stat(path, &sbuf);
+		free(path);
+	}
+	if(r)
+	{
+		return (patchwork->cache.pack ? 0 : -1);
+	}
+	key->dev = sbuf.st_dev;
+	key->ino = sbuf.st_ino;
+	key->mtime = sbuf.st_mtim.tv_sec;
+	key->mtime_nsec = sbuf.st_mtim.tv_nsec;
+	return 0;
+}
+
+static struct parsed_entry_struct *
+patchwork_parsed_find_(const PATCHWORKID *item, unsigned long long hash)
+{
+	struct parsed_entry_struct *entry;
+
+	for(entry = patchwork_parsed.buckets[(size_t) (hash >> 16) & patchwork_parsed.mask]; entry; entry = entry->chain)
+	{
+		if(entry->item.lo == item->lo && entry->item.hi == item->hi)
+		{
+			return entry;
+		}
+	}
+	return NULL;
+}
+
+/* Remove an entry from the cache and free it; the cache must be locked */
+static void
+patchwork_parsed_evict_(struct parsed_entry_struct *entry)
+{
+	struct parsed_entry_struct **p;
+
+	for(p = &(patchwork_parsed.buckets[(size_t) (entry->hash >> 16) & patchwork_parsed.mask]); *p != entry; p = &((*p)->chain));
+	*p = entry->chain;
+	if(entry->prev)
+	{
+		entry->prev->next = entry->next;
+	}
+	else
+	{
+		patchwork_parsed.head = entry->next;
+	}
+	if(entry->next)
+	{
+		entry->next->prev = entry->prev;
+	}
+	else
+	{
+		patchwork_parsed.tail = entry->prev;
+	}
+	patchwork_parsed.used -= entry->count;
+	patchwork_parsed_free_(entry);
+}
+
+static void
+patchwork_parsed_free_(struct parsed_entry_struct *entry)
+{
+	size_t c;
+
+	for(c = 0; c < entry->count; c++)
+	{
+		librdf_free_statement(entry->statements[c]);
+		if(entry->contexts[c])
+		{
+			librdf_free_node(entry->contexts[c]);
+		}
+	}
+	free(entry->statements);
+	free(entry->contexts);
+	free(entry);
+}
+
+/* Invalidate the entry (if any) for the item that a file in the cache
+ * directory belongs to, or every entry if name is NULL
+ */
+static void
+patchwork_parsed_invalidate_(const char *name)
+{
+	struct parsed_entry_struct *entry;
+	PATCHWORKID item;
+	char id[36];
+
+	pthread_mutex_lock(&(patchwork_parsed.lock));
+	patchwork_parsed.generation++;
+	if(!name)
+	{
+		while(patchwork_parsed.tail)
+		{
+			patchwork_parsed_evict_(patchwork_parsed.tail);
+		}
+	}
+	else if(strlen(name) >= 32)
+	{
+		/* <id>, <id>.zst, <id>.meta, or a temporary file */
+		strncpy(id, name, 32);
+		id[32] = 0;
+		if(!patchwork_id_parse(&item, id) &&
+		   (entry = patchwork_parsed_find_(&item, patchwork_id_hash(&item))))
+		{
+			patchwork_parsed_evict_(entry);
+		}
+	}
+	pthread_mutex_unlock(&(patchwork_parsed.lock));
+}
+
+#ifdef HAVE_SYS_INOTIFY_H
+static void *
+patchwork_parsed_thread_(void *arg)
+{
+	char buf[8192] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+	const struct inotify_event *event;
+	ssize_t r;
+	char *p;
+	int fd;
+
+	fd = (int) (long) arg;
+	for(;;)
+	{
+		r = read(fd, buf, sizeof(buf));
+		if(r < 0 && errno == EINTR)
+		{
+			continue;
+		}
+		if(r <= 0)
+		{
+			break;
+		}
+		for(p = buf; p < buf + r; p += sizeof(struct inotify_event) + event->len)
+		{
+			event = (const struct inotify_event *) p;
+			if(event->mask & (IN_Q_OVERFLOW|IN_DELETE_SELF|IN_IGNORED))
+			{
+				/* Events have been lost, or the directory itself has
+				 * gone: nothing can be trusted any more
+				 */
+				patchwork_parsed_invalidate_(NULL);
+				if(event->mask & (IN_DELETE_SELF|IN_IGNORED))
+				{
+					quilt_logf(LOG_WARNING, QUILT_PLUGIN_NAME ": file: %s is no longer being watched; parsed items will be checked on each request\n", patchwork->cache.path);
+					pthread_mutex_lock(&(patchwork_parsed.lock));
+					patchwork_parsed.watching = 0;
+					pthread_mutex_unlock(&(patchwork_parsed.lock));
+					close(fd);
+					return NULL;
+				}
+			}
+			else if(event->len)
+			{
+				patchwork_parsed_invalidate_(event->name);
+			}
+		}
+	}
+	quilt_logf(LOG_WARNING, QUILT_PLUGIN_NAME ": file: failed to read change notifications for %s: %s\n", patchwork->cache.path, strerror(errno));
+	pthread_mutex_lock(&(patchwork_parsed.lock));
+	patchwork_parsed.watching = 0;
+	pthread_mutex_unlock(&(patchwork_parsed.lock));
+	close(fd);
+	return NULL;
+}
+#endif
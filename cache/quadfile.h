@@ -0,0 +1,72 @@
+/* This engine processes requests for coreference graphs populated
+ * by Twine's "spindle" post-processing module.
+ *
+ * Author: Mo McRoberts <mo.mcroberts@bbc.co.uk>
+ *
+ * Copyright (c) 2014-2017 BBC
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#ifndef PATCHWORK_QUADFILE_H_
+# define PATCHWORK_QUADFILE_H_         1
+
+/* Integers are encoded little-endian, as in packfiles */
+# include "packfile.h"
+
+/* The binary quad format holds an item's graph as a dictionary of the
+ * distinct terms it uses, followed by the quads themselves as fixed-width
+ * tuples of term indices, so that it can be loaded without tokenising.
+ *
+ * The header consists of:
+ *
+ *   8 bytes   magic ("PWQUADS" followed by a NUL)
+ *   uint32    format version (QUADS_VERSION)
+ *   uint32    flags (reserved, zero)
+ *   uint32    number of terms
+ *   uint32    number of quads
+ *
+ * Each term is encoded as:
+ *
+ *   uint8     kind (QUADS_xxx)
+ *   uint32    length of the value, in bytes
+ *   bytes     the value (URI, blank node identifier or literal), followed
+ *             by a NUL
+ *
+ * followed, for QUADS_TYPED, by the uint32 index of the datatype's URI
+ * term (which must appear earlier in the dictionary), or for QUADS_LANG,
+ * by a uint32 length and the NUL-terminated language tag.
+ *
+ * The quads follow the dictionary as four uint32 term indices each
+ * (subject, predicate, object, graph), with a graph index of QUADS_NONE
+ * indicating the default graph.
+ *
+ * Objects in this format are stored with the MIME type
+ * application/x-patchwork-quads, but are also recognised by their magic.
+ */
+
+# define QUADS_MAGIC                    "PWQUADS"
+# define QUADS_MAGIC_SIZE               8
+# define QUADS_VERSION                  1
+# define QUADS_HEADER_SIZE              24
+# define QUADS_QUAD_SIZE                16
+# define QUADS_NONE                     0xffffffff
+
+/* Term kinds */
+# define QUADS_URI                      1
+# define QUADS_BLANK                    2
+# define QUADS_LITERAL                  3
+# define QUADS_TYPED                    4
+# define QUADS_LANG                     5
+
+#endif /*!PATCHWORK_QUADFILE_H_*/
@@ -0,0 +1,230 @@
+/* This engine processes requests for coreference graphs populated
+ * by Twine's "spindle" post-processing module.
+ *
+ * Author: Mo McRoberts <mo.mcroberts@bbc.co.uk>
+ *
+ * Copyright (c) 2014-2017 BBC
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include "p_patchwork.h"
+#include "quadfile.h"
+
+/* Load items held in the binary quad format (see quadfile.h), created by
+ * patchwork-quads: each term in the dictionary is converted to a node
+ * once, and each quad then becomes a statement built from copies of
+ * those nodes.
+ */
+
+struct quads_term_struct
+{
+	librdf_node *node;
+	/* For URI terms used as datatypes */
+	librdf_uri *uri;
+};
+
+static int patchwork_quads_terms_(const unsigned char *buf, size_t len, size_t *pos, struct quads_term_struct *terms, size_t nterms);
+static void patchwork_quads_free_(struct quads_term_struct *terms, size_t nterms);
+
+/* Returns non-zero if buf begins with the binary quad format's magic */
+int
+patchwork_quads_detect(const char *buf, size_t len)
+{
+	return (len >= QUADS_MAGIC_SIZE && !memcmp(buf, QUADS_MAGIC, QUADS_MAGIC_SIZE));
+}
+
+/* Pass the quads held in a buffer to a sink */
+int
+patchwork_quads_parse(struct patchwork_sink_struct *sink, const char *buffer, size_t len)
+{
+	const unsigned char *buf, *q;
+	struct quads_term_struct *terms;
+	librdf_statement *st;
+	librdf_world *world;
+	uint32_t nterms, nquads, s, p, o, g;
+	size_t pos, c;
+
+	buf = (const unsigned char *) buffer;
+	if(len < QUADS_HEADER_SIZE || !patchwork_quads_detect(buffer, len) ||
+	   pack_get32(buf + 8) != QUADS_VERSION)
+	{
+		quilt_logf(LOG_ERR, QUILT_PLUGIN_NAME ": quads: buffer is not in a supported format\n");
+		return -1;
+	}
+	nterms = pack_get32(buf + 16);
+	nquads = pack_get32(buf + 20);
+	/* Every term occupies at least six bytes */
+	if(nterms > (len - QUADS_HEADER_SIZE) / 6)
+	{
+		quilt_logf(LOG_ERR, QUILT_PLUGIN_NAME ": quads: term count %lu is invalid\n", (unsigned long) nterms);
+		return -1;
+	}
+	terms = (struct quads_term_struct *) calloc(nterms ? nterms : 1, sizeof(struct quads_term_struct));
+	if(!terms)
+	{
+		quilt_logf(LOG_CRIT, QUILT_PLUGIN_NAME ": quads: failed to allocate memory for %lu terms\n", (unsigned long) nterms);
+		return -1;
+	}
+	pos = QUADS_HEADER_SIZE;
+	if(patchwork_quads_terms_(buf, len, &pos, terms, nterms))
+	{
+		patchwork_quads_free_(terms, nterms);
+		return -1;
+	}
+	if(nquads > (len - pos) / QUADS_QUAD_SIZE)
+	{
+		quilt_logf(LOG_ERR, QUILT_PLUGIN_NAME ": quads: buffer is truncated\n");
+		patchwork_quads_free_(terms, nterms);
+		return -1;
+	}
+	world = quilt_librdf_world();
+	for(c = 0, q = buf + pos; c < nquads; c++, q += QUADS_QUAD_SIZE)
+	{
+		s = pack_get32(q);
+		p = pack_get32(q + 4);
+		o = pack_get32(q + 8);
+		g = pack_get32(q + 12);
+		if(s >= nterms || p >= nterms || o >= nterms || (g != QUADS_NONE && g >= nterms))
+		{
+			quilt_logf(LOG_ERR, QUILT_PLUGIN_NAME ": quads: quad %lu refers to a non-existent term\n", (unsigned long) c);
+			patchwork_quads_free_(terms, nterms);
+			return -1;
+		}
+		st = librdf_new_statement_from_nodes(world,
+			librdf_new_node_from_node(terms[s].node),
+			librdf_new_node_from_node(terms[p].node),
+			librdf_new_node_from_node(terms[o].node));
+		if(!st)
+		{
+			quilt_logf(LOG_CRIT, QUILT_PLUGIN_NAME ": quads: failed to create statement\n");
+			patchwork_quads_free_(terms, nterms);
+			return -1;
+		}
+		patchwork_item_sink_add(sink, st, (g == QUADS_NONE ? NULL : terms[g].node));
+		librdf_free_statement(st);
+	}
+	patchwork_quads_free_(terms, nterms);
+	return 0;
+}
+
+/* Decode the term dictionary, creating a node for each term */
+static int
+patchwork_quads_terms_(const unsigned char *buf, size_t len, size_t *pos, struct quads_term_struct *terms, size_t nterms)
+{
+	librdf_world *world;
+	const char *value, *lang;
+	uint32_t l, vlen, dt;
+	size_t c;
+	int kind;
+
+	world = quilt_librdf_world();
+	for(c = 0; c < nterms; c++)
+	{
+		if(len - *pos < 5)
+		{
+			break;
+		}
+		kind = buf[*pos];
+		vlen = pack_get32(buf + *pos + 1);
+		*pos += 5;
+		if(vlen >= len - *pos || buf[*pos + vlen])
+		{
+			break;
+		}
+		value = (const char *) buf + *pos;
+		*pos += vlen + 1;
+		switch(kind)
+		{
+		case QUADS_URI:
+			terms[c].node = librdf_new_node_from_counted_uri_string(world, (const unsigned char *) value, vlen);
+			break;
+		case QUADS_BLANK:
+			terms[c].node = librdf_new_node_from_counted_blank_identifier(world, (const unsigned char *) value, vlen);
+			break;
+		case QUADS_LITERAL:
+			terms[c].node = librdf_new_node_from_typed_counted_literal(world, (const unsigned char *) value, vlen, NULL, 0, NULL);
+			break;
+		case QUADS_TYPED:
+			if(len - *pos < 4)
+			{
+				return -1;
+			}
+			dt = pack_get32(buf + *pos);
+			*pos += 4;
+			if(dt >= c || !terms[dt].node || !librdf_node_is_resource(terms[dt].node))
+			{
+				quilt_logf(LOG_ERR, QUILT_PLUGIN_NAME ": quads: term %lu has an invalid datatype\n", (unsigned long) c);
+				return -1;
+			}
+			if(!terms[dt].uri)
+			{
+				terms[dt].uri = librdf_new_uri_from_uri(librdf_node_get_uri(terms[dt].node));
+			}
+			terms[c].node = librdf_new_node_from_typed_counted_literal(world, (const unsigned char *) value, vlen, NULL, 0, terms[dt].uri);
+			break;
+		case QUADS_LANG:
+			if(len - *pos < 4)
+			{
+				return -1;
+			}
+			l = pack_get32(buf + *pos);
+			*pos += 4;
+			if(l >= len - *pos || buf[*pos + l])
+			{
+				return -1;
+			}
+			lang = (const char *) buf + *pos;
+			*pos += l + 1;
+			terms[c].node = librdf_new_node_from_typed_counted_literal(world, (const unsigned char *) value, vlen, lang, l, NULL);
+			break;
+		default:
+			quilt_logf(LOG_ERR, QUILT_PLUGIN_NAME ": quads: term %lu is of unknown kind %d\n", (unsigned long) c, kind);
+			return -1;
+		}
+		if(!terms[c].node)
+		{
+			quilt_logf(LOG_ERR, QUILT_PLUGIN_NAME ": quads: failed to create node for term %lu\n", (unsigned long) c);
+			return -1;
+		}
+	}
+	if(c < nterms)
+	{
+		quilt_logf(LOG_ERR, QUILT_PLUGIN_NAME ": quads: buffer is truncated\n");
+		return -1;
+	}
+	return 0;
+}
+
+static void
+patchwork_quads_free_(struct quads_term_struct *terms, size_t nterms)
+{
+	size_t c;
+
+	for(c = 0; c < nterms; c++)
+	{
+		if(terms[c].node)
+		{
+			librdf_free_node(terms[c].node);
+		}
+		if(terms[c].uri)
+		{
+			librdf_free_uri(terms[c].uri);
+		}
+	}
+	free(terms);
+}
@@ -24,39 +24,577 @@
 
 #include "p_patchwork.h"
 
+#include <time.h>
+
 struct data_struct
 {
 	char *buf;
 	size_t size;
 	size_t pos;
+	/* Set when another attempt has already won the race */
+	struct s3_race_struct *race;
+};
+
+/* The outcome of a single GET request */
+struct s3_result_struct
+{
+	long status;
+	struct patchwork_object_struct obj;
+};
+
+/* A single GET, performed on its own thread */
+struct s3_attempt_struct
+{
+	struct s3_race_struct *race;
+	struct s3_result_struct result;
+	int started;
+};
+
+/* A set of (at most two) concurrent GETs for the same object; whichever
+ * completes first wins, and the other is abandoned. The structure is
+ * reference-counted because an abandoned attempt may outlive the request
+ * that started it.
+ */
+struct s3_race_struct
+{
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	AWSS3BUCKET *bucket;
+	char path[36];
+	/* Non-zero if only the headers are wanted */
+	int head;
+	/* The byte range wanted, if not the whole object */
+	char range[48];
+	/* Validators for a conditional request */
+	char etag[PATCHWORK_ETAG_MAX];
+	char modified[PATCHWORK_DATE_MAX];
+	/* When the first attempt was started */
+	long start;
+	int refs;
+	int pending;
+	int cancelled;
+	struct s3_attempt_struct *winner;
+	struct s3_attempt_struct attempts[2];
 };
 
+/* Recently-observed latencies of successful requests, used to determine
+ * when a request is slow enough to be worth hedging
+ */
+static struct
+{
+	pthread_mutex_t lock;
+	long samples[PATCHWORK_S3_LATENCY_SAMPLES];
+	size_t next;
+	size_t count;
+	size_t stale;
+	long threshold;
+} patchwork_s3_latency = { PTHREAD_MUTEX_INITIALIZER, { 0 }, 0, 0, 0, 0 };
+
+static int patchwork_s3_request_(const char *id, struct patchwork_object_struct *obj, int head, const char *range);
+static int patchwork_s3_fetch_shard_(struct patchwork_s3_shard_struct *shard, const char *id, struct patchwork_object_struct *obj, int head, const char *range);
+static long patchwork_s3_get_(AWSS3BUCKET *bucket, const char *path, const struct patchwork_object_struct *cond, int head, const char *range, struct s3_result_struct *result);
+static void patchwork_s3_perform_(struct s3_race_struct *race, struct s3_result_struct *result, int hedged);
+static int patchwork_s3_start_(struct s3_race_struct *race, int n);
+static void *patchwork_s3_thread_(void *arg);
+static void patchwork_s3_release_(struct s3_race_struct *race);
+static int patchwork_s3_retryable_(long status);
+static void patchwork_s3_backoff_(int attempt, unsigned int *seed);
+static long patchwork_s3_hedge_delay_(void);
+static void patchwork_s3_record_(long ms);
+static int patchwork_s3_longcmp_(const void *a, const void *b);
+static long patchwork_s3_now_(void);
 static size_t patchwork_s3_write_(char *ptr, size_t size, size_t nemb, void *userdata);
+static size_t patchwork_s3_header_(char *ptr, size_t size, size_t nemb, void *userdata);
 
 /* Fetch an item by retrieving triples or quads from an S3 bucket */
 int
 patchwork_item_s3(QUILTREQ *request, const char *id)
 {
-	char pathbuf[36];
-	AWSREQUEST *req;
-	CURL *ch;
-	struct data_struct data;
-	long status;
-	char *mime;
+	struct patchwork_object_struct obj;
+	const char *facet;
+	int r;
+
+	memset(&obj, 0, sizeof(struct patchwork_object_struct));
+	facet = patchwork_item_facet(request);
+	if(facet)
+	{
+		/* Only the segment holding a sub-resource is retrieved, and it
+		 * isn't cached in memory
+		 */
+		r = patchwork_s3_fetch_segment(id, facet, &obj);
+		if(r == 200)
+		{
+			r = patchwork_object_parse(request, &obj);
+		}
+		patchwork_object_free(&obj);
+		return r;
+	}
+	r = patchwork_s3_fetch(id, &obj);
+	if(r != 200)
+	{
+		patchwork_object_free(&obj);
+		return r;
+	}
+	if(!obj.mime)
+	{
+		quilt_logf(LOG_ERR, QUILT_PLUGIN_NAME ": S3: server did not send a Content-Type\n");
+		patchwork_object_free(&obj);
+		return 500;
+	}
+	patchwork_memory_store(id, &obj);
+	r = patchwork_object_parse(request, &obj);
+	patchwork_object_free(&obj);
+	return r;
+}
+
+/* Retrieve the raw object for an item from the S3 bucket responsible
+ * for it (or, if that fails and replicas are enabled, from the next bucket
+ * along the ring).
+ *
+ * If obj has an ETag or Last-Modified date already, the request is
+ * made conditional upon the object having changed: if it hasn't, 304 is
+ * returned and obj is left as-is. If the object is retrieved, 200 is
+ * returned and the previous contents of obj (if any) are replaced.
+ */
+int
+patchwork_s3_fetch(const char *id, struct patchwork_object_struct *obj)
+{
+	return patchwork_s3_request_(id, obj, 0, NULL);
+}
+
+/* Retrieve the metadata (but not the contents) of the object for an item,
+ * returning 200 if it exists
+ */
+int
+patchwork_s3_head(const char *id, struct patchwork_object_struct *obj)
+{
+	return patchwork_s3_request_(id, obj, 1, NULL);
+}
+
+/* Retrieve len bytes of the object for an item, starting at offset,
+ * returning 206 if only that range was sent (or 200 if the whole object
+ * was sent instead). The request is never conditional: any validators in
+ * obj (such as those of a previous range) are discarded.
+ */
+int
+patchwork_s3_fetch_range(const char *id, size_t offset, size_t len, struct patchwork_object_struct *obj)
+{
+	char range[48];
+
+	if(!len)
+	{
+		return 416;
+	}
+	obj->etag[0] = 0;
+	obj->modified[0] = 0;
+	sprintf(range, "%lu-%lu", (unsigned long) offset, (unsigned long) (offset + len - 1));
+	return patchwork_s3_request_(id, obj, 0, range);
+}
+
+/* Retrieve only the segment of a segmented object holding the graph for a
+ * sub-resource of an item, by requesting the start of the object (which
+ * should include its index) and then the segment's byte range.
+ *
+ * If the object is compressed, or the server sends the whole object,
+ * obj holds the whole object instead (patchwork_object_parse() will load
+ * just the segment that's needed).
+ */
+int
+patchwork_s3_fetch_segment(const char *id, const char *facet, struct patchwork_object_struct *obj)
+{
+	size_t offset, len, want;
+	int r;
+
+	want = PATCHWORK_SEGMENTS_PROBE;
+	for(;;)
+	{
+		r = patchwork_s3_fetch_range(id, 0, want, obj);
+		if(r == 416)
+		{
+			/* The object is empty */
+			return 404;
+		}
+		if(r != 206)
+		{
+			return r;
+		}
+		if(obj->encoding == PE_ZSTD)
+		{
+			/* Don't make this conditional upon the validators of the
+			 * range just retrieved */
+			obj->etag[0] = 0;
+			obj->modified[0] = 0;
+			return patchwork_s3_fetch(id, obj);
+		}
+		if(!patchwork_segments_detect(obj->buf, obj->len))
+		{
+			quilt_logf(LOG_DEBUG, QUILT_PLUGIN_NAME ": S3: %s is not segmented, so has no sub-resource '%s'\n", id, facet);
+			return 404;
+		}
+		r = patchwork_segments_find(obj->buf, obj->len, facet, &offset, &len);
+		/* If the index is larger than the initial request, fetch it again */
+		if(r != 206 || len <= want)
+		{
+			break;
+		}
+		want = len;
+	}
+	if(r == 206)
+	{
+		quilt_logf(LOG_ERR, QUILT_PLUGIN_NAME ": S3: index of %s is truncated\n", id);
+		return 500;
+	}
+	if(r != 200)
+	{
+		return r;
+	}
+	r = patchwork_s3_fetch_range(id, offset, len, obj);
+	if(r != 206 && r != 200)
+	{
+		return r;
+	}
+	if(r == 200 || obj->len != len)
+	{
+		quilt_logf(LOG_ERR, QUILT_PLUGIN_NAME ": S3: failed to retrieve segment '%s' of %s\n", facet, id);
+		return 500;
+	}
+	free(obj->mime);
+	obj->mime = strdup(MIME_PATCHWORK_QUADS);
+	obj->segment = 1;
+	return 200;
+}
+
+static int
+patchwork_s3_request_(const char *id, struct patchwork_object_struct *obj, int head, const char *range)
+{
+	struct patchwork_s3_shard_struct *shards[2];
+	size_t n, c;
+	int r;
 
 	if(strlen(id) != 32)
 	{
 		return 404;
 	}
+	n = patchwork_s3_shards(id, shards, (patchwork->cache.s3_replica ? 2 : 1));
+	r = 404;
+	for(c = 0; c < n; c++)
+	{
+		r = patchwork_s3_fetch_shard_(shards[c], id, obj, head, range);
+		if(!patchwork_s3_retryable_(r) && r != 503)
+		{
+			break;
+		}
+		if(c + 1 < n)
+		{
+			quilt_logf(LOG_NOTICE, QUILT_PLUGIN_NAME ": %s: failed to fetch %s; trying replica %s\n", shards[c]->name, id, shards[c + 1]->name);
+		}
+	}
+	return r;
+}
+
+/* Determine which buckets hold the item id, in order of preference, by
+ * walking the consistent-hash ring clockwise from the item's position
+ */
+size_t
+patchwork_s3_shards(const char *id, struct patchwork_s3_shard_struct **shards, size_t max)
+{
+	unsigned long long h;
+	size_t lo, hi, mid, c, n, i, d;
+
+	if(!patchwork->cache.nring || !max)
+	{
+		return 0;
+	}
+	h = patchwork_hash(id, strlen(id));
+	lo = 0;
+	hi = patchwork->cache.nring;
+	while(lo < hi)
+	{
+		mid = lo + (hi - lo) / 2;
+		if(patchwork->cache.ring[mid].point < h)
+		{
+			lo = mid + 1;
+		}
+		else
+		{
+			hi = mid;
+		}
+	}
+	n = 0;
+	for(c = 0; c < patchwork->cache.nring && n < max; c++)
+	{
+		i = patchwork->cache.ring[(lo + c) % patchwork->cache.nring].shard;
+		for(d = 0; d < n; d++)
+		{
+			if(shards[d] == &(patchwork->cache.shards[i]))
+			{
+				break;
+			}
+		}
+		if(d == n)
+		{
+			shards[n] = &(patchwork->cache.shards[i]);
+			n++;
+		}
+	}
+	return n;
+}
+
+/* Retrieve the raw object for an item from a specific bucket */
+static int
+patchwork_s3_fetch_shard_(struct patchwork_s3_shard_struct *shard, const char *id, struct patchwork_object_struct *obj, int head, const char *range)
+{
+	char pathbuf[36];
+	struct s3_result_struct result;
+	unsigned int seed;
+	long status, start;
+	int attempt;
+
+	if(!patchwork_breaker_allow(&(shard->breaker)))
+	{
+		/* The bucket is currently failing; don't wait for it to fail again */
+		quilt_logf(LOG_DEBUG, QUILT_PLUGIN_NAME ": %s: circuit is open; skipping request for %s\n", shard->name, id);
+		return 503;
+	}
 	pathbuf[0] = '/';
 	strcpy(pathbuf + 1, id);
-	quilt_logf(LOG_DEBUG, QUILT_PLUGIN_NAME ": S3: request path is %s\n", pathbuf);
+	quilt_logf(LOG_DEBUG, QUILT_PLUGIN_NAME ": %s: request path is %s\n", shard->name, pathbuf);
+	start = patchwork_s3_now_();
+	seed = (unsigned int) patchwork_s3_now_() ^ (unsigned int) (size_t) &result;
+	for(attempt = 0; ; attempt++)
+	{
+		memset(&result, 0, sizeof(struct s3_result_struct));
+		status = patchwork_s3_get_(shard->bucket, pathbuf, obj, head, range, &result);
+		if(attempt >= patchwork->cache.s3_retries || !patchwork_s3_retryable_(status))
+		{
+			break;
+		}
+		patchwork_object_free(&(result.obj));
+		patchwork_s3_backoff_(attempt, &seed);
+		quilt_logf(LOG_NOTICE, QUILT_PLUGIN_NAME ": %s: retrying request for %s (attempt %d of %d)\n", shard->name, pathbuf, attempt + 2, patchwork->cache.s3_retries + 1);
+	}
+	patchwork_breaker_record(&(shard->breaker), patchwork_s3_retryable_(status), patchwork_s3_now_() - start);
+	if(status == 304)
+	{
+		quilt_logf(LOG_DEBUG, QUILT_PLUGIN_NAME ": %s: %s has not been modified\n", shard->name, pathbuf);
+		patchwork_object_free(&(result.obj));
+		return 304;
+	}
+	if(status != 200 && status != 206)
+	{
+		patchwork_object_free(&(result.obj));
+		return (int) status;
+	}
+	patchwork_object_free(obj);
+	*obj = result.obj;
+	return (int) status;
+}
+
+/* Perform a GET (or HEAD) request, issuing a second (hedged) request if the first
+ * has not completed by the time it becomes slower than the configured
+ * percentile of recent requests. If hedging is disabled, or there aren't
+ * yet enough samples, the request is performed on the calling thread. The
+ * result is the HTTP status of the winning request, or -1 if it failed at
+ * the connection level.
+ */
+static long
+patchwork_s3_get_(AWSS3BUCKET *bucket, const char *path, const struct patchwork_object_struct *cond, int head, const char *range, struct s3_result_struct *result)
+{
+	struct s3_race_struct *race;
+	struct s3_attempt_struct *winner;
+	struct timespec deadline;
+	long delay;
+
+	race = (struct s3_race_struct *) calloc(1, sizeof(struct s3_race_struct));
+	if(!race)
+	{
+		quilt_logf(LOG_CRIT, QUILT_PLUGIN_NAME ": S3: failed to allocate request state\n");
+		result->status = 500;
+		return 500;
+	}
+	pthread_mutex_init(&(race->lock), NULL);
+	pthread_cond_init(&(race->cond), NULL);
+	race->bucket = bucket;
+	strcpy(race->path, path);
+	race->head = head;
+	if(range)
+	{
+		strcpy(race->range, range);
+	}
+	strcpy(race->etag, cond->etag);
+	strcpy(race->modified, cond->modified);
+	race->refs = 1;
+	race->attempts[0].race = race;
+	race->attempts[1].race = race;
+	/* Unless a hedged request might be issued (or if a thread couldn't be
+	 * started), perform the request synchronously
+	 */
+	delay = patchwork_s3_hedge_delay_();
+	race->start = patchwork_s3_now_();
+	if(delay <= 0 || patchwork_s3_start_(race, 0))
+	{
+		patchwork_s3_perform_(race, result, 0);
+		/* Latencies are recorded regardless, so that hedging can begin
+		 * once there are enough samples
+		 */
+		if(patchwork->cache.s3_hedge && !head && result->status > 0 && result->status < 500)
+		{
+			patchwork_s3_record_(patchwork_s3_now_() - race->start);
+		}
+		patchwork_s3_release_(race);
+		return result->status;
+	}
+	pthread_mutex_lock(&(race->lock));
+	if(!race->winner)
+	{
+		clock_gettime(CLOCK_REALTIME, &deadline);
+		deadline.tv_sec += delay / 1000;
+		deadline.tv_nsec += (delay % 1000) * 1000000;
+		if(deadline.tv_nsec >= 1000000000)
+		{
+			deadline.tv_sec++;
+			deadline.tv_nsec -= 1000000000;
+		}
+		while(!race->winner)
+		{
+			if(pthread_cond_timedwait(&(race->cond), &(race->lock), &deadline) == ETIMEDOUT)
+			{
+				break;
+			}
+		}
+		if(!race->winner)
+		{
+			quilt_logf(LOG_DEBUG, QUILT_PLUGIN_NAME ": S3: %s has taken longer than %ldms; issuing hedged request\n", path, delay);
+			patchwork_s3_start_(race, 1);
+		}
+	}
+	while(!race->winner)
+	{
+		pthread_cond_wait(&(race->cond), &(race->lock));
+	}
+	/* Take ownership of the winning attempt's results, and abandon any
+	 * other attempt which is still running
+	 */
+	winner = race->winner;
+	*result = winner->result;
+	memset(&(winner->result), 0, sizeof(struct s3_result_struct));
+	race->cancelled = 1;
+	pthread_mutex_unlock(&(race->lock));
+	patchwork_s3_release_(race);
+	return result->status;
+}
+
+/* Start attempt n of a race on a new thread */
+static int
+patchwork_s3_start_(struct s3_race_struct *race, int n)
+{
+	pthread_t thread;
+	pthread_attr_t attr;
+	int r;
+
+	/* The race lock may or may not be held by the caller: the attempt
+	 * structure isn't visible to other threads until started, and the
+	 * counters are only updated here before the thread exists
+	 */
+	race->refs++;
+	race->pending++;
+	race->attempts[n].started = 1;
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	r = pthread_create(&thread, &attr, patchwork_s3_thread_, &(race->attempts[n]));
+	pthread_attr_destroy(&attr);
+	if(r)
+	{
+		quilt_logf(LOG_ERR, QUILT_PLUGIN_NAME ": S3: failed to create request thread: %s\n", strerror(r));
+		race->refs--;
+		race->pending--;
+		race->attempts[n].started = 0;
+		return -1;
+	}
+	return 0;
+}
+
+static void *
+patchwork_s3_thread_(void *arg)
+{
+	struct s3_attempt_struct *attempt;
+	struct s3_race_struct *race;
+
+	attempt = (struct s3_attempt_struct *) arg;
+	race = attempt->race;
+	patchwork_s3_perform_(race, &(attempt->result), 1);
+	pthread_mutex_lock(&(race->lock));
+	race->pending--;
+	/* Every attempt is recorded, including one which lost, and timed
+	 * from the start of the race: otherwise, the slow requests which
+	 * prompted hedging would be replaced by the faster hedged ones, and
+	 * the threshold would fall further with each one. A loser whose
+	 * transfer was abandoned took at least as long as this. HEAD requests
+	 * are much quicker than GETs, so they would skew the threshold too.
+	 */
+	if(!race->head && (race->cancelled || (attempt->result.status > 0 && attempt->result.status < 500)))
+	{
+		patchwork_s3_record_(patchwork_s3_now_() - race->start);
+	}
+	/* An attempt which failed in a retryable fashion only wins if there
+	 * is nothing else left to wait for
+	 */
+	if(!race->winner && (!patchwork_s3_retryable_(attempt->result.status) || !race->pending))
+	{
+		race->winner = attempt;
+		pthread_cond_broadcast(&(race->cond));
+	}
+	pthread_mutex_unlock(&(race->lock));
+	patchwork_s3_release_(race);
+	return NULL;
+}
+
+/* Drop a reference to a race, freeing it when no longer used */
+static void
+patchwork_s3_release_(struct s3_race_struct *race)
+{
+	int n;
+
+	pthread_mutex_lock(&(race->lock));
+	race->refs--;
+	n = race->refs;
+	pthread_mutex_unlock(&(race->lock));
+	if(n)
+	{
+		return;
+	}
+	for(n = 0; n < 2; n++)
+	{
+		patchwork_object_free(&(race->attempts[n].result.obj));
+	}
+	pthread_cond_destroy(&(race->cond));
+	pthread_mutex_destroy(&(race->lock));
+	free(race);
+}
+
+/* Perform a single GET request for the object named by the race,
+ * populating result; if hedged is non-zero, the transfer will be aborted
+ * once another attempt has won
+ */
+static void
+patchwork_s3_perform_(struct s3_race_struct *race, struct s3_result_struct *result, int hedged)
+{
+	AWSREQUEST *req;
+	CURL *ch;
+	struct data_struct data;
+	struct curl_slist *headers;
+	char hbuf[PATCHWORK_ETAG_MAX + 32];
+	long status;
+	char *mime;
+
 	memset(&data, 0, sizeof(struct data_struct));
-	req = aws_s3_request_create(patchwork->cache.bucket, pathbuf, "GET");
+	data.race = (hedged ? race : NULL);
+	req = aws_s3_request_create(race->bucket, race->path, (race->head ? "HEAD" : "GET"));
 	if(!req)
 	{
 		quilt_logf(LOG_CRIT, QUILT_PLUGIN_NAME ": S3: failed to create S3 request\n");
-		return 500;
+		result->status = 500;
+		return;
 	}
 	ch = aws_request_curl(req);
 	curl_easy_setopt(ch, CURLOPT_HEADER, 0);
@@ -64,26 +602,62 @@ patchwork_item_s3(QUILTREQ *request, const char *id)
 	curl_easy_setopt(ch, CURLOPT_VERBOSE, patchwork->cache.s3_verbose);
 	curl_easy_setopt(ch, CURLOPT_WRITEDATA, (void *) &data);
 	curl_easy_setopt(ch, CURLOPT_WRITEFUNCTION, patchwork_s3_write_);
+	curl_easy_setopt(ch, CURLOPT_HEADERDATA, (void *) &(result->obj));
+	curl_easy_setopt(ch, CURLOPT_HEADERFUNCTION, patchwork_s3_header_);
+	curl_easy_setopt(ch, CURLOPT_NOBODY, (long) race->head);
+	if(race->range[0])
+	{
+		curl_easy_setopt(ch, CURLOPT_RANGE, race->range);
+	}
+	if(patchwork->cache.s3_timeout > 0)
+	{
+		curl_easy_setopt(ch, CURLOPT_TIMEOUT_MS, patchwork->cache.s3_timeout);
+	}
+	headers = NULL;
+	if(race->etag[0])
+	{
+		snprintf(hbuf, sizeof(hbuf), "If-None-Match: %s", race->etag);
+		headers = curl_slist_append(headers, hbuf);
+	}
+	if(race->modified[0])
+	{
+		snprintf(hbuf, sizeof(hbuf), "If-Modified-Since: %s", race->modified);
+		headers = curl_slist_append(headers, hbuf);
+	}
+	if(headers)
+	{
+		/* The request takes ownership of the list */
+		aws_request_set_headers(req, headers);
+	}
 	if(aws_request_perform(req) != CURLE_OK)
 	{
 		quilt_logf(LOG_ERR, QUILT_PLUGIN_NAME ": S3: request failed\n");
 		free(data.buf);
 		aws_request_destroy(req);
-		return 500;
+		result->status = -1;
+		return;
 	}
 	if(curl_easy_getinfo(ch, CURLINFO_RESPONSE_CODE, &status) != CURLE_OK)
 	{
 		quilt_logf(LOG_ERR, QUILT_PLUGIN_NAME ": S3: failed to obtain HTTP status code\n");
 		free(data.buf);
 		aws_request_destroy(req);
-		return -1;
-	}		
-	if(status != 200)
+		result->status = -1;
+		return;
+	}
+	if(status == 304 && (race->etag[0] || race->modified[0]))
+	{
+		free(data.buf);
+		aws_request_destroy(req);
+		result->status = 304;
+		return;
+	}
+	if(status != 200 && !(status == 206 && race->range[0]))
 	{
 		if(!status)
 		{
 			if(curl_easy_getinfo(ch, CURLINFO_OS_ERRNO, &status) != CURLE_OK)
-			{		
+			{
 				quilt_logf(LOG_ERR, QUILT_PLUGIN_NAME ": S3: failed to obtain OS-level error code for request\n");
 			}
 			else
@@ -98,27 +672,118 @@ patchwork_item_s3(QUILTREQ *request, const char *id)
 		}
 		free(data.buf);
 		aws_request_destroy(req);
-		return (int) status;
+		result->status = status;
+		return;
 	}
 	mime = NULL;
 	curl_easy_getinfo(ch, CURLINFO_CONTENT_TYPE, &mime);
-	if(!mime)
-	{
-		quilt_logf(LOG_ERR, QUILT_PLUGIN_NAME ": S3: server did not send a Content-Type\n");
-		free(data.buf);
-		aws_request_destroy(req);
-		return 500;
-	}	
-	if(quilt_model_parse(request->model, mime, data.buf, data.pos))
+	if(mime)
 	{
-		quilt_logf(LOG_ERR, QUILT_PLUGIN_NAME ": S3: failed to parse buffer as '%s'\n", mime);
-		free(data.buf);
-		aws_request_destroy(req);
-		return 500;
+		result->obj.mime = strdup(mime);
 	}
-	free(data.buf);
+	result->obj.buf = data.buf;
+	result->obj.len = data.pos;
+	result->status = status;
 	aws_request_destroy(req);
-	return 200;
+}
+
+/* Should a request which resulted in status be retried? */
+static int
+patchwork_s3_retryable_(long status)
+{
+	return (status <= 0 || status >= 500);
+}
+
+/* Sleep for a randomly-jittered interval before retry attempt + 1 */
+static void
+patchwork_s3_backoff_(int attempt, unsigned int *seed)
+{
+	struct timespec ts;
+	long ceiling, ms;
+
+	if(patchwork->cache.s3_backoff <= 0)
+	{
+		return;
+	}
+	ceiling = patchwork->cache.s3_backoff << (attempt < 10 ? attempt : 10);
+	ms = (long) (rand_r(seed) % (ceiling + 1));
+	ts.tv_sec = ms / 1000;
+	ts.tv_nsec = (ms % 1000) * 1000000;
+	nanosleep(&ts, NULL);
+}
+
+/* Determine how long to wait for a request before hedging it, based upon
+ * the configured percentile of recent latencies; returns zero if hedging
+ * is disabled or there aren't yet enough samples to decide
+ */
+static long
+patchwork_s3_hedge_delay_(void)
+{
+	long sorted[PATCHWORK_S3_LATENCY_SAMPLES];
+	long delay;
+	size_t n;
+
+	if(!patchwork->cache.s3_hedge)
+	{
+		return 0;
+	}
+	pthread_mutex_lock(&(patchwork_s3_latency.lock));
+	if(patchwork_s3_latency.count < PATCHWORK_S3_LATENCY_SAMPLES / 8)
+	{
+		pthread_mutex_unlock(&(patchwork_s3_latency.lock));
+		return 0;
+	}
+	/* Only re-compute the threshold periodically */
+	if(!patchwork_s3_latency.threshold || patchwork_s3_latency.stale >= PATCHWORK_S3_LATENCY_SAMPLES / 8)
+	{
+		n = patchwork_s3_latency.count;
+		memcpy(sorted, patchwork_s3_latency.samples, sizeof(long) * n);
+		qsort(sorted, n, sizeof(long), patchwork_s3_longcmp_);
+		patchwork_s3_latency.threshold = sorted[((n - 1) * patchwork->cache.s3_hedge) / 100];
+		patchwork_s3_latency.stale = 0;
+	}
+	delay = patchwork_s3_latency.threshold;
+	pthread_mutex_unlock(&(patchwork_s3_latency.lock));
+	if(delay < patchwork->cache.s3_hedge_min)
+	{
+		delay = patchwork->cache.s3_hedge_min;
+	}
+	return delay;
+}
+
+/* Record the latency of a completed request */
+static void
+patchwork_s3_record_(long ms)
+{
+	pthread_mutex_lock(&(patchwork_s3_latency.lock));
+	patchwork_s3_latency.samples[patchwork_s3_latency.next] = ms;
+	patchwork_s3_latency.next = (patchwork_s3_latency.next + 1) % PATCHWORK_S3_LATENCY_SAMPLES;
+	if(patchwork_s3_latency.count < PATCHWORK_S3_LATENCY_SAMPLES)
+	{
+		patchwork_s3_latency.count++;
+	}
+	patchwork_s3_latency.stale++;
+	pthread_mutex_unlock(&(patchwork_s3_latency.lock));
+}
+
+static int
+patchwork_s3_longcmp_(const void *a, const void *b)
+{
+	long la, lb;
+
+	la = *((const long *) a);
+	lb = *((const long *) b);
+	return (la > lb) - (la < lb);
+}
+
+/* Return a monotonic timestamp in milliseconds */
+static long
+patchwork_s3_now_(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (long) (ts.tv_sec * 1000 + ts.tv_nsec / 1000000);
 }
 
 static size_t
@@ -126,11 +791,24 @@ patchwork_s3_write_(char *ptr, size_t size, size_t nemb, void *userdata)
 {
 	struct data_struct *data;
 	char *p;
+	int cancelled;
 
 	data = (struct data_struct *) userdata;
 
 	size *= nemb;
 
+	if(data->race)
+	{
+		/* If another attempt has already won, abort this transfer */
+		pthread_mutex_lock(&(data->race->lock));
+		cancelled = data->race->cancelled;
+		pthread_mutex_unlock(&(data->race->lock));
+		if(cancelled)
+		{
+			return 0;
+		}
+	}
+
 	if(patchwork->cache.s3_fetch_limit && size > patchwork->cache.s3_fetch_limit)
 	{
 		quilt_logf(LOG_WARNING, QUILT_PLUGIN_NAME ": S3: failing write due to size exceeding fetch limit. input_size:%u > fetch_limit:%u \n", size, patchwork->cache.s3_fetch_limit);
@@ -154,3 +832,53 @@ patchwork_s3_write_(char *ptr, size_t size, size_t nemb, void *userdata)
 	quilt_logf(LOG_DEBUG, QUILT_PLUGIN_NAME ": S3: written %lu bytes\n", (unsigned long) size);
 	return size;
 }
+
+/* Capture the validators from a response so that the object can be
+ * conditionally revalidated later, along with its content-encoding
+ */
+static size_t
+patchwork_s3_header_(char *ptr, size_t size, size_t nemb, void *userdata)
+{
+	struct patchwork_object_struct *obj;
+	char *dest;
+	size_t len, max, n;
+
+	obj = (struct patchwork_object_struct *) userdata;
+	len = size * nemb;
+	if(len > 5 && !strncasecmp(ptr, "ETag:", 5))
+	{
+		dest = obj->etag;
+		max = sizeof(obj->etag);
+		n = 5;
+	}
+	else if(len > 17 && !strncasecmp(ptr, "Content-Encoding:", 17))
+	{
+		for(n = 17; n < len && isspace(ptr[n]); n++);
+		obj->encoding = ((len - n >= 4 && !strncasecmp(&(ptr[n]), "zstd", 4)) ? PE_ZSTD : PE_IDENTITY);
+		return len;
+	}
+	else if(len > 14 && !strncasecmp(ptr, "Last-Modified:", 14))
+	{
+		dest = obj->modified;
+		max = sizeof(obj->modified);
+		n = 14;
+	}
+	else
+	{
+		return len;
+	}
+	while(n < len && isspace(ptr[n]))
+	{
+		n++;
+	}
+	while(len > n && isspace(ptr[len - 1]))
+	{
+		len--;
+	}
+	if(len - n < max)
+	{
+		memcpy(dest, &(ptr[n]), len - n);
+		dest[len - n] = 0;
+	}
+	return size * nemb;
+}
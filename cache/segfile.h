@@ -0,0 +1,62 @@
+/* This engine processes requests for coreference graphs populated
+ * by Twine's "spindle" post-processing module.
+ *
+ * Author: Mo McRoberts <mo.mcroberts@bbc.co.uk>
+ *
+ * Copyright (c) 2014-2017 BBC
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#ifndef PATCHWORK_SEGFILE_H_
+# define PATCHWORK_SEGFILE_H_          1
+
+/* Integers are encoded little-endian, as in packfiles */
+# include "packfile.h"
+
+/* A segmented object holds an item's graph split into one segment per
+ * named graph, each in the binary quad format (see quadfile.h), preceded
+ * by an index so that a request for a sub-resource of an item (such as
+ * /<uuid>/media) can read just the segment it needs, by byte range or
+ * file offset.
+ *
+ * The header consists of:
+ *
+ *   8 bytes   magic ("PWSEGS" followed by two NULs)
+ *   uint32    format version (SEGS_VERSION)
+ *   uint32    number of segments
+ *   uint32    size of the header and index, in bytes
+ *   uint32    flags (reserved, zero)
+ *
+ * followed by an index entry for each segment:
+ *
+ *   uint32    offset of the segment from the start of the object
+ *   uint32    length of the segment
+ *   uint32    length of the segment's name, in bytes
+ *   bytes     the name (the URI of the named graph, or empty for the
+ *             default graph), followed by a NUL
+ *
+ * Objects in this format are stored with the MIME type
+ * application/x-patchwork-segments, but are also recognised by their
+ * magic. They must not be compressed as a whole, or they couldn't be read
+ * in part.
+ */
+
+# define SEGS_MAGIC                     "PWSEGS\0"
+# define SEGS_MAGIC_SIZE                8
+# define SEGS_VERSION                   1
+# define SEGS_HEADER_SIZE               24
+/* Minimum size of an index entry */
+# define SEGS_ENTRY_SIZE                13
+
+#endif /*!PATCHWORK_SEGFILE_H_*/
@@ -0,0 +1,203 @@
+/* This engine processes requests for coreference graphs populated
+ * by Twine's "spindle" post-processing module.
+ *
+ * Author: Mo McRoberts <mo.mcroberts@bbc.co.uk>
+ *
+ * Copyright (c) 2014-2017 BBC
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include "p_patchwork.h"
+#include "segfile.h"
+
+/* Segmented objects (see segfile.h) hold one segment per named graph, so
+ * that a request for a sub-resource of an item only needs to read the
+ * segment holding the corresponding graph: the graph for /<uuid>/<facet>
+ * is the one whose URI (ignoring any fragment) ends with "/<facet>".
+ */
+
+struct segs_entry_struct
+{
+	size_t offset;
+	size_t len;
+	const char *name;
+	size_t namelen;
+};
+
+static int patchwork_segments_header_(const unsigned char *buf, size_t len, uint32_t *count, size_t *indexsize);
+static int patchwork_segments_entry_(const unsigned char *buf, size_t indexsize, size_t *pos, struct segs_entry_struct *entry);
+static int patchwork_segments_match_(const struct segs_entry_struct *entry, const char *facet);
+
+/* Returns non-zero if buf begins with the segmented object magic */
+int
+patchwork_segments_detect(const char *buf, size_t len)
+{
+	return (len >= SEGS_MAGIC_SIZE && !memcmp(buf, SEGS_MAGIC, SEGS_MAGIC_SIZE));
+}
+
+/* Locate the segment holding the graph for a sub-resource, given a buffer
+ * holding at least the beginning of the object.
+ *
+ * Returns 200 and sets *offset and *len if the segment is found, 404 if
+ * the object has no such segment, or 206 if the buffer doesn't hold the
+ * whole index, in which case *len is set to the number of bytes needed.
+ */
+int
+patchwork_segments_find(const char *buffer, size_t buflen, const char *facet, size_t *offset, size_t *len)
+{
+	const unsigned char *buf;
+	struct segs_entry_struct entry;
+	uint32_t count, c;
+	size_t indexsize, pos;
+
+	buf = (const unsigned char *) buffer;
+	*offset = 0;
+	*len = 0;
+	if(buflen < SEGS_HEADER_SIZE)
+	{
+		*len = SEGS_HEADER_SIZE;
+		return 206;
+	}
+	if(patchwork_segments_header_(buf, buflen, &count, &indexsize))
+	{
+		return 500;
+	}
+	if(buflen < indexsize)
+	{
+		*len = indexsize;
+		return 206;
+	}
+	pos = SEGS_HEADER_SIZE;
+	for(c = 0; c < count; c++)
+	{
+		if(patchwork_segments_entry_(buf, indexsize, &pos, &entry))
+		{
+			return 500;
+		}
+		if(patchwork_segments_match_(&entry, facet))
+		{
+			*offset = entry.offset;
+			*len = entry.len;
+			return 200;
+		}
+	}
+	return 404;
+}
+
+/* Pass the quads held in a segmented object to a sink: all of them, or if
+ * facet is non-NULL, only those in the segment for that sub-resource.
+ * Returns 200 on success or 404 if there is no such segment.
+ */
+int
+patchwork_segments_parse(struct patchwork_sink_struct *sink, const char *buffer, size_t len, const char *facet)
+{
+	const unsigned char *buf;
+	struct segs_entry_struct entry;
+	uint32_t count, c;
+	size_t indexsize, pos;
+	int found;
+
+	buf = (const unsigned char *) buffer;
+	if(patchwork_segments_header_(buf, len, &count, &indexsize) || indexsize > len)
+	{
+		return 500;
+	}
+	pos = SEGS_HEADER_SIZE;
+	found = 0;
+	for(c = 0; c < count; c++)
+	{
+		if(patchwork_segments_entry_(buf, indexsize, &pos, &entry))
+		{
+			return 500;
+		}
+		if(facet && !patchwork_segments_match_(&entry, facet))
+		{
+			continue;
+		}
+		if(entry.offset > len || entry.len > len - entry.offset)
+		{
+			quilt_logf(LOG_ERR, QUILT_PLUGIN_NAME ": segments: segment %lu is truncated\n", (unsigned long) c);
+			return 500;
+		}
+		if(patchwork_quads_parse(sink, buffer + entry.offset, entry.len))
+		{
+			return 500;
+		}
+		found = 1;
+	}
+	return ((found || !facet) ? 200 : 404);
+}
+
+/* Validate the header of a segmented object */
+static int
+patchwork_segments_header_(const unsigned char *buf, size_t len, uint32_t *count, size_t *indexsize)
+{
+	if(len < SEGS_HEADER_SIZE || !patchwork_segments_detect((const char *) buf, len) ||
+	   pack_get32(buf + 8) != SEGS_VERSION)
+	{
+		quilt_logf(LOG_ERR, QUILT_PLUGIN_NAME ": segments: buffer is not in a supported format\n");
+		return -1;
+	}
+	*count = pack_get32(buf + 12);
+	*indexsize = pack_get32(buf + 16);
+	if(*indexsize < SEGS_HEADER_SIZE || *count > (*indexsize - SEGS_HEADER_SIZE) / SEGS_ENTRY_SIZE)
+	{
+		quilt_logf(LOG_ERR, QUILT_PLUGIN_NAME ": segments: index is invalid\n");
+		return -1;
+	}
+	return 0;
+}
+
+/* Decode the index entry at *pos */
+static int
+patchwork_segments_entry_(const unsigned char *buf, size_t indexsize, size_t *pos, struct segs_entry_struct *entry)
+{
+	uint32_t l;
+
+	if(indexsize - *pos < SEGS_ENTRY_SIZE)
+	{
+		quilt_logf(LOG_ERR, QUILT_PLUGIN_NAME ": segments: index is truncated\n");
+		return -1;
+	}
+	entry->offset = pack_get32(buf + *pos);
+	entry->len = pack_get32(buf + *pos + 4);
+	l = pack_get32(buf + *pos + 8);
+	*pos += 12;
+	if(l >= indexsize - *pos || buf[*pos + l])
+	{
+		quilt_logf(LOG_ERR, QUILT_PLUGIN_NAME ": segments: index entry is invalid\n");
+		return -1;
+	}
+	entry->name = (const char *) (buf + *pos);
+	entry->namelen = l;
+	*pos += l + 1;
+	return 0;
+}
+
+/* Returns non-zero if the segment holds the graph for the sub-resource */
+static int
+patchwork_segments_match_(const struct segs_entry_struct *entry, const char *facet)
+{
+	const char *p;
+	size_t l, flen;
+
+	p = (const char *) memchr(entry->name, '#', entry->namelen);
+	l = (p ? (size_t) (p - entry->name) : entry->namelen);
+	flen = strlen(facet);
+	return (l > flen && entry->name[l - flen - 1] == '/' && !memcmp(entry->name + l - flen, facet, flen));
+}
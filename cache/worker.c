@@ -0,0 +1,154 @@
+/* This engine processes requests for coreference graphs populated
+ * by Twine's "spindle" post-processing module.
+ *
+ * Author: Mo McRoberts <mo.mcroberts@bbc.co.uk>
+ *
+ * Copyright (c) 2014-2017 BBC
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include "p_patchwork.h"
+
+#ifdef WITH_ZSTD
+# include <zstd.h>
+#endif
+
+/* Each worker thread keeps the state it uses to decode cached items (a
+ * Zstandard decompression context and a scratch buffer) from one request
+ * to the next, rather than allocating it afresh every time, along with
+ * size hints learned from the items it has decoded recently.
+ *
+ * A scratch buffer which has grown beyond PATCHWORK_WORKER_RETAIN bytes
+ * to accommodate an unusually large item is released once the item has
+ * been decoded.
+ */
+
+static pthread_once_t patchwork_worker_once = PTHREAD_ONCE_INIT;
+static pthread_key_t patchwork_worker_key;
+
+static void patchwork_worker_init_(void);
+static void patchwork_worker_destroy_(void *ptr);
+
+/* Return the calling thread's worker state, creating it if needed */
+struct patchwork_worker_struct *
+patchwork_worker(void)
+{
+	struct patchwork_worker_struct *worker;
+
+	pthread_once(&patchwork_worker_once, patchwork_worker_init_);
+	worker = (struct patchwork_worker_struct *) pthread_getspecific(patchwork_worker_key);
+	if(worker)
+	{
+		return worker;
+	}
+	worker = (struct patchwork_worker_struct *) calloc(1, sizeof(struct patchwork_worker_struct));
+	if(!worker)
+	{
+		quilt_logf(LOG_CRIT, QUILT_PLUGIN_NAME ": failed to allocate memory for worker state\n");
+		return NULL;
+	}
+	worker->ratio = PATCHWORK_WORKER_RATIO;
+	pthread_setspecific(patchwork_worker_key, worker);
+	return worker;
+}
+
+/* Ensure that the worker's scratch buffer is at least size bytes long */
+char *
+patchwork_worker_scratch(struct patchwork_worker_struct *worker, size_t size)
+{
+	char *p;
+
+	if(worker->scratchsize >= size)
+	{
+		return worker->scratch;
+	}
+	/* Grow geometrically, so that a run of slightly longer lines doesn't
+	 * cause a reallocation each time
+	 */
+	if(size < worker->scratchsize * 2)
+	{
+		size = worker->scratchsize * 2;
+	}
+	p = (char *) realloc(worker->scratch, size);
+	if(!p)
+	{
+		quilt_logf(LOG_CRIT, QUILT_PLUGIN_NAME ": failed to allocate %lu bytes of scratch space\n", (unsigned long) size);
+		return NULL;
+	}
+	worker->scratch = p;
+	worker->scratchsize = size;
+	return p;
+}
+
+/* Called once an item has been decoded */
+void
+patchwork_worker_release(struct patchwork_worker_struct *worker)
+{
+	if(worker->scratchsize > PATCHWORK_WORKER_RETAIN)
+	{
+		free(worker->scratch);
+		worker->scratch = NULL;
+		worker->scratchsize = 0;
+	}
+}
+
+/* Record the sizes of an item before and after decompression, so that
+ * the output buffer for the next one can be sized correctly up-front
+ */
+void
+patchwork_worker_learn(struct patchwork_worker_struct *worker, size_t in, size_t out)
+{
+	size_t ratio;
+
+	if(!in)
+	{
+		return;
+	}
+	ratio = out * 16 / in;
+	if(ratio < 16)
+	{
+		ratio = 16;
+	}
+	else if(ratio > PATCHWORK_WORKER_RATIO_MAX)
+	{
+		ratio = PATCHWORK_WORKER_RATIO_MAX;
+	}
+	worker->ratio = (worker->ratio * 3 + ratio) / 4;
+}
+
+static void
+patchwork_worker_init_(void)
+{
+	pthread_key_create(&patchwork_worker_key, patchwork_worker_destroy_);
+}
+
+static void
+patchwork_worker_destroy_(void *ptr)
+{
+	struct patchwork_worker_struct *worker;
+
+	worker = (struct patchwork_worker_struct *) ptr;
+#ifdef WITH_ZSTD
+	if(worker->dctx)
+	{
+		ZSTD_freeDCtx((ZSTD_DCtx *) worker->dctx);
+	}
+#endif
+	free(worker->scratch);
+	free(worker);
+}
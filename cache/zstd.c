@@ -0,0 +1,231 @@
+/* This engine processes requests for coreference graphs populated
+ * by Twine's "spindle" post-processing module.
+ *
+ * Author: Mo McRoberts <mo.mcroberts@bbc.co.uk>
+ *
+ * Copyright (c) 2014-2017 BBC
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include "p_patchwork.h"
+
+#ifdef WITH_ZSTD
+# include <zstd.h>
+#endif
+
+/* Cached objects may be compressed with Zstandard, optionally using a
+ * shared dictionary (trained on a sample of cached N-Quads, for example
+ * with 'zstd --train'), which is loaded from the path given by the
+ * zstd:dictionary configuration option.
+ */
+
+#ifdef WITH_ZSTD
+static ZSTD_DDict *patchwork_zstd_dict;
+#endif
+
+int
+patchwork_zstd_init(void)
+{
+#ifdef WITH_ZSTD
+	char *t, *buf, *p;
+	FILE *f;
+	size_t len, r;
+
+	if(!(t = quilt_config_geta("zstd:dictionary", NULL)))
+	{
+		return 0;
+	}
+	f = fopen(t, "rb");
+	if(!f)
+	{
+		quilt_logf(LOG_CRIT, QUILT_PLUGIN_NAME ": zstd: failed to open dictionary %s: %s\n", t, strerror(errno));
+		free(t);
+		return -1;
+	}
+	buf = NULL;
+	len = 0;
+	do
+	{
+		p = (char *) realloc(buf, len + 65536);
+		if(!p)
+		{
+			quilt_logf(LOG_CRIT, QUILT_PLUGIN_NAME ": zstd: failed to allocate memory for dictionary\n");
+			free(buf);
+			fclose(f);
+			free(t);
+			return -1;
+		}
+		buf = p;
+		r = fread(&(buf[len]), 1, 65536, f);
+		len += r;
+	}
+	while(r == 65536);
+	fclose(f);
+	patchwork_zstd_dict = ZSTD_createDDict(buf, len);
+	free(buf);
+	if(!patchwork_zstd_dict)
+	{
+		quilt_logf(LOG_CRIT, QUILT_PLUGIN_NAME ": zstd: failed to load dictionary %s\n", t);
+		free(t);
+		return -1;
+	}
+	quilt_logf(LOG_INFO, QUILT_PLUGIN_NAME ": zstd: loaded dictionary %s (ID %u)\n", t, ZSTD_getDictID_fromDDict(patchwork_zstd_dict));
+	free(t);
+#endif
+	return 0;
+}
+
+/* Returns non-zero if buf begins with a Zstandard frame */
+int
+patchwork_zstd_detect(const char *buf, size_t len)
+{
+	const unsigned char *p;
+
+	p = (const unsigned char *) buf;
+	return (len >= 4 && p[0] == 0x28 && p[1] == 0xb5 && p[2] == 0x2f && p[3] == 0xfd);
+}
+
+/* Decompress a buffer containing one or more Zstandard frames, returning a
+ * newly-allocated (and NUL-terminated) buffer in *out
+ */
+int
+patchwork_zstd_decompress(const char *in, size_t inlen, char **out, size_t *outlen)
+{
+#ifdef WITH_ZSTD
+	struct patchwork_worker_struct *worker;
+	ZSTD_DCtx *dctx;
+	ZSTD_inBuffer input;
+	ZSTD_outBuffer output;
+	unsigned long long expected;
+	size_t r, size;
+	char *p;
+
+	*out = NULL;
+	*outlen = 0;
+	/* Each thread reuses its decompression context from item to item */
+	worker = patchwork_worker();
+	if(!worker)
+	{
+		return -1;
+	}
+	dctx = (ZSTD_DCtx *) worker->dctx;
+	if(!dctx)
+	{
+		dctx = ZSTD_createDCtx();
+		if(!dctx)
+		{
+			quilt_logf(LOG_CRIT, QUILT_PLUGIN_NAME ": zstd: failed to create decompression context\n");
+			return -1;
+		}
+		if(patchwork_zstd_dict)
+		{
+			ZSTD_DCtx_refDDict(dctx, patchwork_zstd_dict);
+		}
+		worker->dctx = dctx;
+	}
+	else
+	{
+		/* Discard anything left over from a failed decompression, but
+		 * keep the dictionary
+		 */
+		ZSTD_DCtx_reset(dctx, ZSTD_reset_session_only);
+	}
+	/* If the frame header records the size of the content, the output
+	 * buffer can be allocated in one go; otherwise, size it according to
+	 * the compression ratio of recent items, and grow it as needed
+	 */
+	expected = ZSTD_getFrameContentSize(in, inlen);
+	if(expected == ZSTD_CONTENTSIZE_ERROR)
+	{
+		quilt_logf(LOG_ERR, QUILT_PLUGIN_NAME ": zstd: buffer is not a valid Zstandard frame\n");
+		return -1;
+	}
+	if(expected == ZSTD_CONTENTSIZE_UNKNOWN)
+	{
+		size = inlen * worker->ratio / 16;
+	}
+	else
+	{
+		size = (size_t) expected;
+	}
+	if(size < ZSTD_DStreamOutSize())
+	{
+		size = ZSTD_DStreamOutSize();
+	}
+	output.dst = malloc(size + 1);
+	if(!output.dst)
+	{
+		quilt_logf(LOG_CRIT, QUILT_PLUGIN_NAME ": zstd: failed to allocate %lu bytes for decompressed object\n", (unsigned long) size + 1);
+		return -1;
+	}
+	output.size = size;
+	output.pos = 0;
+	input.src = in;
+	input.size = inlen;
+	input.pos = 0;
+	for(;;)
+	{
+		if(output.pos == output.size)
+		{
+			p = (char *) realloc(output.dst, output.size * 2 + 1);
+			if(!p)
+			{
+				quilt_logf(LOG_CRIT, QUILT_PLUGIN_NAME ": zstd: failed to expand decompression buffer\n");
+				free(output.dst);
+				return -1;
+			}
+			output.dst = p;
+			output.size *= 2;
+		}
+		r = ZSTD_decompressStream(dctx, &output, &input);
+		if(ZSTD_isError(r))
+		{
+			quilt_logf(LOG_ERR, QUILT_PLUGIN_NAME ": zstd: decompression failed: %s\n", ZSTD_getErrorName(r));
+			free(output.dst);
+			return -1;
+		}
+		/* Once all of the input has been consumed, decoding is complete
+		 * if the last frame has been fully flushed; if it hasn't, but
+		 * the output buffer wasn't filled, the input is truncated
+		 */
+		if(input.pos == input.size && (!r || output.pos < output.size))
+		{
+			break;
+		}
+	}
+	if(r)
+	{
+		quilt_logf(LOG_ERR, QUILT_PLUGIN_NAME ": zstd: compressed object is truncated\n");
+		free(output.dst);
+		return -1;
+	}
+	patchwork_worker_learn(worker, inlen, output.pos);
+	*out = (char *) output.dst;
+	(*out)[output.pos] = 0;
+	*outlen = output.pos;
+	return 0;
+#else
+	(void) in;
+	(void) inlen;
+
+	*out = NULL;
+	*outlen = 0;
+	quilt_logf(LOG_ERR, QUILT_PLUGIN_NAME ": zstd: cannot decompress object: Zstandard support is not available\n");
+	return -1;
+#endif
+}
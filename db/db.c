@@ -33,6 +33,7 @@ int
 patchwork_db_init(void)
 {
 	char *t;
+	int r;
 
 	if((t = quilt_config_geta(QUILT_PLUGIN_NAME ":db", NULL)))
 	{
@@ -43,14 +44,15 @@ patchwork_db_init(void)
 			free(t);
 			return -1;
 		}
-		free(t);
 		sql_set_querylog(patchwork->db, patchwork_db_querylog_);
 		sql_set_errorlog(patchwork->db, patchwork_db_errorlog_);
 		sql_set_noticelog(patchwork->db, patchwork_db_noticelog_);
 		patchwork->db_version = patchwork_db_version_(patchwork->db, "com.github.bbcarchdev.spindle.twine");
 		quilt_logf(LOG_INFO, QUILT_PLUGIN_NAME ": connected to Spindle database version %d\n", patchwork->db_version);
 	}
-	return 0;
+	r = patchwork_known_init(t);
+	free(t);
+	return r;
 }
 
 static int
@@ -0,0 +1,416 @@
+/* This engine processes requests for coreference graphs populated
+ * by Twine's "spindle" post-processing module.
+ *
+ * Author: Mo McRoberts <mo.mcroberts@bbc.co.uk>
+ *
+ * Copyright (c) 2014-2017 BBC
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include "p_patchwork.h"
+
+#include <unistd.h>
+
+/* Requests for items which don't exist (such as crawlers following stale
+ * links) are answered without consulting any back-end where possible.
+ *
+ * When a database is configured, a Bloom filter of every proxy ID is built
+ * from the "proxy" table at start-up: if an ID isn't in the filter, the
+ * item definitely doesn't exist. A background thread, using its own
+ * connection, adds the IDs of items indexed since its last pass every
+ * known:refresh seconds, and rebuilds the filter from scratch every
+ * known:rebuild seconds (which also picks up proxies which haven't been
+ * indexed yet, and sheds any which have been removed).
+ *
+ * Independently, IDs for which every back-end returned 404 are remembered
+ * for known:negative_ttl seconds.
+ */
+
+struct known_filter_struct
+{
+	unsigned char *bits;
+	unsigned long long mask;
+	size_t count;
+};
+
+struct known_negative_struct
+{
+	PATCHWORKID key;
+	time_t expires;
+};
+
+struct patchwork_known_struct
+{
+	pthread_rwlock_t lock;
+	struct known_filter_struct *filter;
+	pthread_mutex_t neglock;
+	struct known_negative_struct *negative;
+	long negative_ttl;
+	char *uri;
+	long refresh;
+	long rebuild;
+};
+
+static struct known_filter_struct *patchwork_known_build_(SQL *sql, char *mark, size_t marklen);
+static int patchwork_known_update_(SQL *sql, char *mark, size_t marklen);
+static int patchwork_known_now_(SQL *sql, char *mark, size_t marklen);
+static void patchwork_known_add_(struct known_filter_struct *filter, unsigned long long hash);
+static int patchwork_known_test_(struct known_filter_struct *filter, unsigned long long hash);
+static void patchwork_known_free_(struct known_filter_struct *filter);
+static void *patchwork_known_thread_(void *arg);
+
+int
+patchwork_known_init(const char *uri)
+{
+	struct patchwork_known_struct *known;
+	pthread_attr_t attr;
+	pthread_t thread;
+	char mark[PATCHWORK_DATE_MAX];
+	int r;
+
+	known = (struct patchwork_known_struct *) calloc(1, sizeof(struct patchwork_known_struct));
+	if(!known)
+	{
+		quilt_logf(LOG_CRIT, QUILT_PLUGIN_NAME ": failed to allocate memory for known item tracking\n");
+		return -1;
+	}
+	pthread_rwlock_init(&(known->lock), NULL);
+	pthread_mutex_init(&(known->neglock), NULL);
+	known->negative_ttl = quilt_config_get_int("known:negative_ttl", DEFAULT_PATCHWORK_KNOWN_NEGATIVE_TTL);
+	if(known->negative_ttl > 0)
+	{
+		known->negative = (struct known_negative_struct *) calloc(PATCHWORK_KNOWN_NEGATIVE_SIZE, sizeof(struct known_negative_struct));
+		if(!known->negative)
+		{
+			quilt_logf(LOG_CRIT, QUILT_PLUGIN_NAME ": failed to allocate memory for negative cache\n");
+			free(known);
+			return -1;
+		}
+	}
+	patchwork->known = known;
+	if(!uri || !quilt_config_get_bool("known:bloom", 1))
+	{
+		return 0;
+	}
+	known->filter = patchwork_known_build_(patchwork->db, mark, sizeof(mark));
+	if(!known->filter)
+	{
+		quilt_logf(LOG_WARNING, QUILT_PLUGIN_NAME ": failed to build known item filter; all item IDs will be looked up\n");
+		return 0;
+	}
+	known->refresh = quilt_config_get_int("known:refresh", DEFAULT_PATCHWORK_KNOWN_REFRESH);
+	known->rebuild = quilt_config_get_int("known:rebuild", DEFAULT_PATCHWORK_KNOWN_REBUILD);
+	if(known->refresh <= 0 && known->rebuild <= 0)
+	{
+		return 0;
+	}
+	known->uri = strdup(uri);
+	if(!known->uri)
+	{
+		quilt_logf(LOG_CRIT, QUILT_PLUGIN_NAME ": failed to allocate memory for database URI\n");
+		return -1;
+	}
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	r = pthread_create(&thread, &attr, patchwork_known_thread_, strdup(mark));
+	pthread_attr_destroy(&attr);
+	if(r)
+	{
+		quilt_logf(LOG_CRIT, QUILT_PLUGIN_NAME ": failed to start known item refresh thread: %s\n", strerror(r));
+		return -1;
+	}
+	return 0;
+}
+
+/* Returns non-zero if the item identified by id definitely doesn't exist */
+int
+patchwork_known_absent(const char *id)
+{
+	struct patchwork_known_struct *known;
+	struct known_negative_struct *slot;
+	unsigned long long hash;
+	PATCHWORKID key;
+	int r;
+
+	known = patchwork->known;
+	if(!known || patchwork_id_parse(&key, id))
+	{
+		return 0;
+	}
+	hash = patchwork_id_hash(&key);
+	r = 0;
+	if(known->filter)
+	{
+		pthread_rwlock_rdlock(&(known->lock));
+		r = !patchwork_known_test_(known->filter, hash);
+		pthread_rwlock_unlock(&(known->lock));
+		if(r)
+		{
+			quilt_logf(LOG_DEBUG, QUILT_PLUGIN_NAME ": %s is not a known item\n", id);
+			return 1;
+		}
+	}
+	if(known->negative)
+	{
+		slot = &(known->negative[hash & (PATCHWORK_KNOWN_NEGATIVE_SIZE - 1)]);
+		pthread_mutex_lock(&(known->neglock));
+		r = (slot->key.lo == key.lo && slot->key.hi == key.hi && slot->expires > time(NULL));
+		pthread_mutex_unlock(&(known->neglock));
+		if(r)
+		{
+			quilt_logf(LOG_DEBUG, QUILT_PLUGIN_NAME ": %s was recently not found\n", id);
+		}
+	}
+	return r;
+}
+
+/* Record that no back-end was able to supply an item */
+void
+patchwork_known_miss(const char *id)
+{
+	struct patchwork_known_struct *known;
+	struct known_negative_struct *slot;
+	PATCHWORKID key;
+
+	known = patchwork->known;
+	if(!known || !known->negative || patchwork_id_parse(&key, id))
+	{
+		return;
+	}
+	slot = &(known->negative[patchwork_id_hash(&key) & (PATCHWORK_KNOWN_NEGATIVE_SIZE - 1)]);
+	pthread_mutex_lock(&(known->neglock));
+	slot->key = key;
+	slot->expires = time(NULL) + known->negative_ttl;
+	pthread_mutex_unlock(&(known->neglock));
+}
+
+static void *
+patchwork_known_thread_(void *arg)
+{
+	struct patchwork_known_struct *known;
+	struct known_filter_struct *filter, *old;
+	char *mark;
+	time_t now, rebuilt;
+	long interval;
+	SQL *sql;
+
+	known = patchwork->known;
+	mark = (char *) arg;
+	if(!mark)
+	{
+		return NULL;
+	}
+	sql = sql_connect(known->uri);
+	if(!sql)
+	{
+		quilt_logf(LOG_CRIT, QUILT_PLUGIN_NAME ": failed to connect to database for known item refresh\n");
+		free(mark);
+		return NULL;
+	}
+	interval = (known->refresh > 0 ? known->refresh : known->rebuild);
+	rebuilt = time(NULL);
+	for(;;)
+	{
+		sleep(interval);
+		now = time(NULL);
+		if(known->rebuild > 0 && now - rebuilt >= known->rebuild)
+		{
+			filter = patchwork_known_build_(sql, mark, PATCHWORK_DATE_MAX);
+			if(!filter)
+			{
+				continue;
+			}
+			pthread_rwlock_wrlock(&(known->lock));
+			old = known->filter;
+			known->filter = filter;
+			pthread_rwlock_unlock(&(known->lock));
+			patchwork_known_free_(old);
+			rebuilt = now;
+		}
+		else if(known->refresh > 0)
+		{
+			patchwork_known_update_(sql, mark, PATCHWORK_DATE_MAX);
+		}
+	}
+	return NULL;
+}
+
+/* Build a filter containing every proxy ID, storing the database's idea
+ * of the time at which it was started in mark
+ */
+static struct known_filter_struct *
+patchwork_known_build_(SQL *sql, char *mark, size_t marklen)
+{
+	struct known_filter_struct *filter;
+	SQL_STATEMENT *rs;
+	PATCHWORKID key;
+	size_t count;
+
+	if(patchwork_known_now_(sql, mark, marklen))
+	{
+		return NULL;
+	}
+	rs = sql_queryf(sql, "SELECT COUNT(*) FROM \"proxy\"");
+	if(!rs)
+	{
+		return NULL;
+	}
+	count = (sql_stmt_eof(rs) ? 0 : (size_t) sql_stmt_long(rs, 0));
+	sql_stmt_destroy(rs);
+	filter = (struct known_filter_struct *) calloc(1, sizeof(struct known_filter_struct));
+	if(!filter)
+	{
+		quilt_logf(LOG_CRIT, QUILT_PLUGIN_NAME ": failed to allocate memory for known item filter\n");
+		return NULL;
+	}
+	/* Allow room for the items created before the next rebuild */
+	count += count / 4;
+	for(filter->mask = 65536; filter->mask < count * PATCHWORK_KNOWN_BITS; filter->mask <<= 1);
+	filter->bits = (unsigned char *) calloc(filter->mask / 8, 1);
+	if(!filter->bits)
+	{
+		quilt_logf(LOG_CRIT, QUILT_PLUGIN_NAME ": failed to allocate %llu bytes for known item filter\n", filter->mask / 8);
+		free(filter);
+		return NULL;
+	}
+	filter->mask--;
+	rs = sql_queryf(sql, "SELECT \"id\" FROM \"proxy\"");
+	if(!rs)
+	{
+		patchwork_known_free_(filter);
+		return NULL;
+	}
+	for(; !sql_stmt_eof(rs); sql_stmt_next(rs))
+	{
+		if(!patchwork_id_parse(&key, sql_stmt_str(rs, 0)))
+		{
+			patchwork_known_add_(filter, patchwork_id_hash(&key));
+			filter->count++;
+		}
+	}
+	sql_stmt_destroy(rs);
+	quilt_logf(LOG_INFO, QUILT_PLUGIN_NAME ": known item filter: %lu items in %llu KiB\n", (unsigned long) filter->count, (filter->mask + 1) / 8192);
+	return filter;
+}
+
+/* Add the IDs of items indexed since mark to the current filter */
+static int
+patchwork_known_update_(SQL *sql, char *mark, size_t marklen)
+{
+	struct patchwork_known_struct *known;
+	SQL_STATEMENT *rs;
+	char since[PATCHWORK_DATE_MAX];
+	PATCHWORKID key;
+	size_t count;
+
+	known = patchwork->known;
+	strcpy(since, mark);
+	if(patchwork_known_now_(sql, mark, marklen))
+	{
+		return -1;
+	}
+	rs = sql_queryf(sql, "SELECT \"id\" FROM \"index\" WHERE \"modified\" >= %Q", since);
+	if(!rs)
+	{
+		strcpy(mark, since);
+		return -1;
+	}
+	count = 0;
+	pthread_rwlock_wrlock(&(known->lock));
+	for(; !sql_stmt_eof(rs); sql_stmt_next(rs))
+	{
+		if(!patchwork_id_parse(&key, sql_stmt_str(rs, 0)))
+		{
+			patchwork_known_add_(known->filter, patchwork_id_hash(&key));
+			count++;
+		}
+	}
+	pthread_rwlock_unlock(&(known->lock));
+	sql_stmt_destroy(rs);
+	if(count)
+	{
+		quilt_logf(LOG_DEBUG, QUILT_PLUGIN_NAME ": known item filter: added %lu recently-indexed items\n", (unsigned long) count);
+	}
+	return 0;
+}
+
+/* Obtain the current time according to the database server, so that
+ * clock differences can't cause updates to be missed
+ */
+static int
+patchwork_known_now_(SQL *sql, char *mark, size_t marklen)
+{
+	SQL_STATEMENT *rs;
+	const char *t;
+
+	rs = sql_queryf(sql, "SELECT NOW()");
+	if(!rs)
+	{
+		return -1;
+	}
+	t = (sql_stmt_eof(rs) ? NULL : sql_stmt_str(rs, 0));
+	if(!t || strlen(t) >= marklen)
+	{
+		sql_stmt_destroy(rs);
+		return -1;
+	}
+	strcpy(mark, t);
+	sql_stmt_destroy(rs);
+	return 0;
+}
+
+/* The probe positions are derived from the two halves of the hash */
+static void
+patchwork_known_add_(struct known_filter_struct *filter, unsigned long long hash)
+{
+	unsigned long long h, step;
+	int c;
+
+	step = (hash >> 32) | 1;
+	for(c = 0, h = hash; c < PATCHWORK_KNOWN_HASHES; c++, h += step)
+	{
+		filter->bits[(h & filter->mask) >> 3] |= (1 << (h & 7));
+	}
+}
+
+static int
+patchwork_known_test_(struct known_filter_struct *filter, unsigned long long hash)
+{
+	unsigned long long h, step;
+	int c;
+
+	step = (hash >> 32) | 1;
+	for(c = 0, h = hash; c < PATCHWORK_KNOWN_HASHES; c++, h += step)
+	{
+		if(!(filter->bits[(h & filter->mask) >> 3] & (1 << (h & 7))))
+		{
+			return 0;
+		}
+	}
+	return 1;
+}
+
+static void
+patchwork_known_free_(struct known_filter_struct *filter)
+{
+	if(filter)
+	{
+		free(filter->bits);
+		free(filter);
+	}
+}
@@ -46,10 +46,25 @@ struct db_item_struct
 	const char *titles;
 	const char *descriptions;
 	const char *coords;
+	/* Languages of the literals to render */
+	const struct patchwork_langs_struct *langs;
+};
+
+/* The item and slot URIs of the results on a page differ only by the
+ * item's ID, so each is generated once with a placeholder ID, which is
+ * overwritten for each row
+ */
+struct db_rowuri_struct
+{
+	char *item;
+	size_t itemid;
+	char *slot;
+	size_t slotid;
 };
 
 static int process_rs(QUILTREQ *request, struct query_struct *query, SQL_STATEMENT *rs);
-static int process_row(QUILTREQ *request, struct query_struct *query, SQL_STATEMENT *rs, const char *id, const char *self, QUILTCANON *item, int index);
+static int process_row(QUILTREQ *request, struct query_struct *query, SQL_STATEMENT *rs, const char *self, const char *uri, const char *slotstr, int index);
+static char *row_uri_template(QUILTCANON *canon, int options, size_t *offset);
 static const char *checklang(QUILTREQ *request, const char *lang);
 static int process_membership_row(QUILTREQ *request, SQL_STATEMENT *rs, const char *id, const char *self, QUILTCANON *item);
 
@@ -57,7 +72,7 @@ static int process_membership_row(QUILTREQ *request, SQL_STATEMENT *rs, const ch
 /* Utilities for parsing specific kinds of data types and materialising
  * them as quads or triples
  */
-static int add_langvector(librdf_model *model, librdf_node *graph, const char *vector, const char *subject, const char *predicate);
+static int add_langvector(librdf_model *model, librdf_node *graph, const char *vector, const char *subject, const char *predicate, const struct patchwork_langs_struct *langs);
 static int add_array(librdf_model *model, librdf_node *graph, const char *array, const char *subject, const char *predicate, int reverse);
 static int add_point(librdf_model *model, librdf_node *graph, const char *array, const char *subject);
 
@@ -206,8 +221,15 @@ patchwork_query_db(QUILTREQ *request, struct query_struct *query)
 			i++;
 		}
 	}
-	/* SELECT */
-	appendf(&qbuf, "SELECT DISTINCT ON(\"i\".\"id\") \"i\".\"id\", \"i\".\"classes\", \"i\".\"title\", \"i\".\"description\", \"i\".\"coordinates\", \"i\".\"modified\"");
+	/* SELECT: columns which won't be used (because they weren't selected
+	 * by fields=) are replaced with NULLs, so that the remainder keep
+	 * their positions
+	 */
+	appendf(&qbuf, "SELECT DISTINCT ON(\"i\".\"id\") \"i\".\"id\", %s, %s, %s, %s, \"i\".\"modified\"",
+		((query->fields.flags & PF_TYPE) ? "\"i\".\"classes\"" : "NULL"),
+		((query->fields.flags & PF_LABEL) ? "\"i\".\"title\"" : "NULL"),
+		((query->fields.flags & PF_COMMENT) ? "\"i\".\"description\"" : "NULL"),
+		((query->fields.flags & PF_GEO) ? "\"i\".\"coordinates\"" : "NULL"));
 	if(query->text)
 	{
 		/* Rank flags:
@@ -441,8 +463,11 @@ patchwork_query_db_media_(struct db_qbuf_struct *qbuf, struct query_struct *quer
 int
 patchwork_item_db(QUILTREQ *request, const char *id)
 {
-	const char *t;
+	const char *t, *modified;
+	char *abstracturi;
 	struct db_item_struct item;
+	struct patchwork_langs_struct langs;
+	librdf_model *model;
 	SQL_STATEMENT *rs;
 
 	/* Extract the UUID from the request-URI */
@@ -465,7 +490,6 @@ patchwork_item_db(QUILTREQ *request, const char *id)
 	memset(&item, 0, sizeof(struct db_item_struct));
 	item.request = request;
 	item.model = quilt_request_model(request);
-	item.graph = quilt_request_graph(request);
 	item.id = id;
 	rs = sql_queryf(patchwork->db, "SELECT \"sameas\" FROM \"proxy\" WHERE \"id\" = %Q", item.id);
 	if(!rs)
@@ -486,15 +510,65 @@ patchwork_item_db(QUILTREQ *request, const char *id)
 	item.sameas = (const char *) strdup(t);
 	sql_stmt_destroy(rs);
 	/* Attempt to fetch index information about the item */
-	rs = sql_queryf(patchwork->db, "SELECT \"classes\", \"title\", \"description\", \"coordinates\" FROM \"index\" WHERE \"id\" = %Q", item.id);
+	rs = sql_queryf(patchwork->db, "SELECT \"classes\", \"title\", \"description\", \"coordinates\", \"modified\" FROM \"index\" WHERE \"id\" = %Q", item.id);
+	modified = NULL;
 	if(rs && !sql_stmt_eof(rs))
 	{
 		item.classes = sql_stmt_str(rs, 0);
 		item.titles = sql_stmt_str(rs, 1);
 		item.descriptions = sql_stmt_str(rs, 2);
 		item.coords = sql_stmt_str(rs, 3);
+		modified = sql_stmt_str(rs, 4);
+	}
+	if(patchwork_langs_request(&langs, request))
+	{
+		if(rs)
+		{
+			sql_stmt_destroy(rs);
+		}
+		free((char *) (item.sameas));
+		return 500;
+	}
+	/* The item is rendered into the abstract document graph, which is
+	 * moved to the concrete graph of the request by post-processing, so
+	 * that the cached copy can be served for any representation
+	 */
+	abstracturi = quilt_canon_str(request->canonical, QCO_ABSTRACT);
+	item.graph = (abstracturi ? quilt_node_create_uri(abstracturi) : NULL);
+	free(abstracturi);
+	if(!item.graph)
+	{
+		patchwork_langs_free(&langs);
+		if(rs)
+		{
+			sql_stmt_destroy(rs);
+		}
+		free((char *) (item.sameas));
+		return 500;
+	}
+	/* Cache the synthesised graph so that subsequent requests for the
+	 * item don't need to query the database again; once it expires, it
+	 * will be renewed if index.modified hasn't changed. The cached graph
+	 * is rendered into a model of its own, so that it always has every
+	 * language and nothing else which the request model may hold (such
+	 * as the remains of a cached copy which failed to parse).
+	 */
+	if(patchwork->cache.path && patchwork->cache.db_ttl > 0)
+	{
+		model = patchwork_model_create();
+		if(model)
+		{
+			item.model = model;
+			patchwork_item_db_render_(&item);
+			item.model = quilt_request_model(request);
+			patchwork_file_store_graph(id, model, modified);
+			librdf_free_model(model);
+		}
 	}
+	item.langs = &langs;
 	patchwork_item_db_render_(&item);
+	librdf_free_node(item.graph);
+	patchwork_langs_free(&langs);
 	if(rs)
 	{
 		sql_stmt_destroy(rs);
@@ -503,17 +577,47 @@ patchwork_item_db(QUILTREQ *request, const char *id)
 	return 200;
 }
 
+/* Retrieve the value of index.modified for an item (which is empty if
+ * it has not been indexed yet), returning 404 if the item doesn't exist,
+ * or -1 if the query failed
+ */
+int
+patchwork_item_db_modified(const char *id, char *buf, size_t len)
+{
+	SQL_STATEMENT *rs;
+	const char *t;
+
+	rs = sql_queryf(patchwork->db, "SELECT \"i\".\"modified\" FROM \"proxy\" \"p\" LEFT JOIN \"index\" \"i\" ON \"i\".\"id\" = \"p\".\"id\" WHERE \"p\".\"id\" = %Q", id);
+	if(!rs)
+	{
+		return -1;
+	}
+	if(sql_stmt_eof(rs))
+	{
+		sql_stmt_destroy(rs);
+		return 404;
+	}
+	t = sql_stmt_str(rs, 0);
+	buf[0] = 0;
+	if(t && strlen(t) < len)
+	{
+		strcpy(buf, t);
+	}
+	sql_stmt_destroy(rs);
+	return 0;
+}
+
 /* For a given item, determine what collections (if any) this item is part
  * of.
  */
 int
 patchwork_membership_db(QUILTREQ *request, const char *id)
 {
-	const char *t, *self;
+	const char *self;
 	SQL_STATEMENT *rs;
 	QUILTCANON *item;
+	PATCHWORKID uuid;
 	char idbuf[36];
-	char *p;
 
 	quilt_logf(LOG_DEBUG, QUILT_PLUGIN_NAME ": DB: membership: '%s'\n", id);
 	self = quilt_request_subject(request);
@@ -532,16 +636,12 @@ patchwork_membership_db(QUILTREQ *request, const char *id)
 		quilt_canon_reset_path(item);
 		quilt_canon_reset_params(item);
 		quilt_canon_set_fragment(item, "id");
-		t = sql_stmt_str(rs, 0);
-		for(p = idbuf; p - idbuf < 32; t++)
+		if(patchwork_id_parse(&uuid, sql_stmt_str(rs, 0)))
 		{
-			if(isalnum(*t))
-			{
-				*p = tolower(*t);
-				p++;
-			}
+			quilt_canon_destroy(item);
+			continue;
 		}
-		*p = 0;
+		patchwork_id_format(&uuid, idbuf);
 		quilt_canon_add_path(item, idbuf);
 		process_membership_row(request, rs, idbuf, self, item);
 		quilt_canon_destroy(item);
@@ -556,8 +656,8 @@ int
 patchwork_lookup_db(QUILTREQ *request, const char *target)
 {
 	SQL_STATEMENT *rs;
-	const char *t;
-	char *buf, *p;
+	PATCHWORKID id;
+	char *buf;
 
 	rs = sql_queryf(patchwork->db, "SELECT \"id\" FROM \"proxy\" WHERE %Q = ANY(\"sameas\")", target);
 	if(!rs)
@@ -576,17 +676,16 @@ patchwork_lookup_db(QUILTREQ *request, const char *target)
 		sql_stmt_destroy(rs);
 		return 500;
 	}
-	buf[0] = '/';
-	p = &(buf[1]);
-	for(t = sql_stmt_str(rs, 0); *t; t++)
+	if(patchwork_id_parse(&id, sql_stmt_str(rs, 0)))
 	{
-		if(isalnum(*t))
-		{
-			*p = *t;
-			p++;
-		}
+		quilt_logf(LOG_ERR, QUILT_PLUGIN_NAME ": DB: proxy for <%s> has an invalid ID\n", target);
+		free(buf);
+		sql_stmt_destroy(rs);
+		return 500;
 	}
-	strcpy(p, "#id");
+	buf[0] = '/';
+	patchwork_id_format(&id, &(buf[1]));
+	strcpy(&(buf[33]), "#id");
 	sql_stmt_destroy(rs);
 	quilt_request_headers(request, "Status: 303 See other\n");
 	quilt_request_headers(request, "Server: Quilt/" PACKAGE_VERSION "\n");
@@ -663,7 +762,7 @@ patchwork_audiences_db(QUILTREQ *request, struct query_struct *query)
 		librdf_free_statement(st);
 		if(title)
 		{
-			add_langvector(request->model, NULL, title, audience, NS_RDFS "label");
+			add_langvector(request->model, NULL, title, audience, NS_RDFS "label", &(query->langs));
 		}
 		free(deststr);
 	}
@@ -680,103 +779,180 @@ patchwork_audiences_db(QUILTREQ *request, struct query_struct *query)
 static int
 process_rs(QUILTREQ *request, struct query_struct *query, SQL_STATEMENT *rs)
 {
-	QUILTCANON *item;
+	QUILTCANON *canon;
+	struct db_rowuri_struct uris;
 	int c, r;
-	const char *t;
-	char idbuf[36], *p;
+	PATCHWORKID id;
+	char idbuf[36];
 	const char *self;	
+	librdf_statement *st;
 	
 	self = query->resource;
+	memset(&uris, 0, sizeof(struct db_rowuri_struct));
+	canon = quilt_canon_create(request->canonical);
+	quilt_canon_reset_path(canon);
+	quilt_canon_reset_params(canon);
+	quilt_canon_set_fragment(canon, "id");
+	quilt_canon_add_path(canon, PATCHWORK_ROW_PLACEHOLDER);
+	uris.item = row_uri_template(canon, QCO_SUBJECT, &(uris.itemid));
+	quilt_canon_destroy(canon);
+	if(!query->lean && (query->fields.flags & PF_SLOT))
+	{
+		canon = quilt_canon_create(request->canonical);
+		quilt_canon_set_fragment(canon, PATCHWORK_ROW_PLACEHOLDER);
+		uris.slot = row_uri_template(canon, QCO_FRAGMENT, &(uris.slotid));
+		quilt_canon_destroy(canon);
+	}
+	if(!uris.item || (!query->lean && (query->fields.flags & PF_SLOT) && !uris.slot))
+	{
+		free(uris.item);
+		free(uris.slot);
+		sql_stmt_destroy(rs);
+		return 500;
+	}
+	if(query->lean)
+	{
+		/* The results are listed in order as members of the page */
+		st = quilt_st_create_uri(self, NS_RDF "type", NS_RDF "Seq");
+		librdf_model_context_add_statement(request->model, quilt_request_graph(request), st);
+		librdf_free_statement(st);
+	}
 	for(c = 0; !sql_stmt_eof(rs) && c < request->limit; sql_stmt_next(rs))
 	{
-		item = quilt_canon_create(request->canonical);
-		quilt_canon_reset_path(item);
-		quilt_canon_reset_params(item);
-		quilt_canon_set_fragment(item, "id");
-		t = sql_stmt_str(rs, 0);
-		for(p = idbuf; p - idbuf < 32; t++)
+		if(patchwork_id_parse(&id, sql_stmt_str(rs, 0)))
 		{
-			if(isalnum(*t))
-			{
-				*p = tolower(*t);
-				p++;
-			}
+			continue;
 		}
-		*p = 0;
-		quilt_canon_add_path(item, idbuf);
-		r = process_row(request, query, rs, idbuf, self, item, query->offset + c);
+		patchwork_id_format(&id, idbuf);
+		memcpy(&(uris.item[uris.itemid]), idbuf, 32);
+		if(uris.slot)
+		{
+			memcpy(&(uris.slot[uris.slotid]), idbuf, 32);
+		}
+		r = process_row(request, query, rs, self, uris.item, uris.slot, query->offset + c);
 		if(r > 0)
 		{
 			/* Only increment the count if a row was actually added to the model */
 			c++;
 		}
-		quilt_canon_destroy(item);
 	}
 	if(!sql_stmt_eof(rs))
 	{
 		query->more = 1;
 	}
+	free(uris.item);
+	free(uris.slot);
 	sql_stmt_destroy(rs);
 	return 200;
 }
 
+/* Generate a URI from a canon containing PATCHWORK_ROW_PLACEHOLDER, noting
+ * where the placeholder is: either the fragment itself (QCO_FRAGMENT), or
+ * the last path segment before it; anything else in the URI which happens
+ * to look like the placeholder is left alone
+ */
+static char *
+row_uri_template(QUILTCANON *canon, int options, size_t *offset)
+{
+	char *str, *frag, *p, *t;
+	size_t len;
+
+	str = quilt_canon_str(canon, options);
+	if(!str)
+	{
+		return NULL;
+	}
+	len = strlen(PATCHWORK_ROW_PLACEHOLDER);
+	frag = strrchr(str, '#');
+	p = NULL;
+	if(options & QCO_FRAGMENT)
+	{
+		if(frag && !strncmp(frag + 1, PATCHWORK_ROW_PLACEHOLDER, len))
+		{
+			p = frag + 1;
+		}
+	}
+	else
+	{
+		for(t = str; (t = strstr(t, PATCHWORK_ROW_PLACEHOLDER)) && (!frag || t + len <= frag); t++)
+		{
+			p = t;
+		}
+	}
+	if(!p)
+	{
+		quilt_logf(LOG_ERR, QUILT_PLUGIN_NAME ": DB: placeholder ID is missing from generated URI <%s>\n", str);
+		free(str);
+		return NULL;
+	}
+	*offset = p - str;
+	return str;
+}
+
 static int
-process_row(QUILTREQ *request, struct query_struct *query, SQL_STATEMENT *rs, const char *id, const char *self, QUILTCANON *item, int index)
+process_row(QUILTREQ *request, struct query_struct *query, SQL_STATEMENT *rs, const char *self, const char *uri, const char *slotstr, int index)
 {
 	librdf_statement *st;
 	const char *s;
-	QUILTCANON *slot;
-	char *slotstr, *uri, *related;
+	char *related;
 	char nbuf[64];
 	librdf_node *node, *graph;
 
-	uri = quilt_canon_str(item, QCO_SUBJECT);
 	graph = quilt_request_graph(request);
 
 	if(!strcmp(self, uri))
 	{
 		/* Never ever state that <foo> foaf:topic <foo> */
-		free(uri);
 		return 0;
 	}
 	quilt_logf(LOG_DEBUG, "adding row <%s>\n", uri);
 
-	slot = quilt_canon_create(request->canonical);
-	quilt_canon_set_fragment(slot, id);
-	slotstr = quilt_canon_str(slot, QCO_FRAGMENT);
-
-	/* rdfs:seeAlso */
-	st = quilt_st_create_uri(self, NS_RDFS "seeAlso", uri);
-	librdf_model_context_add_statement(request->model, graph, st);
-	librdf_free_statement(st);
+	if(query->lean)
+	{
+		/* <self> rdf:_nn <item> */
+		snprintf(nbuf, sizeof(nbuf) - 1, NS_RDF "_%d", index + 1);
+		st = quilt_st_create_uri(self, nbuf, uri);
+		librdf_model_context_add_statement(request->model, graph, st);
+		librdf_free_statement(st);
+	}
+	else
+	{
+		/* rdfs:seeAlso */
+		st = quilt_st_create_uri(self, NS_RDFS "seeAlso", uri);
+		librdf_model_context_add_statement(request->model, graph, st);
+		librdf_free_statement(st);
+	}
 
-	/* olo:slot */
-	st = quilt_st_create_uri(self, NS_OLO "slot", slotstr);
-	librdf_model_context_add_statement(request->model, graph, st);
-	librdf_free_statement(st);
+	if(slotstr)
+	{
+		/* olo:slot */
+		st = quilt_st_create_uri(self, NS_OLO "slot", slotstr);
+		librdf_model_context_add_statement(request->model, graph, st);
+		librdf_free_statement(st);
 
-	/* <slot> rdf:type olo:Slot */
-	st = quilt_st_create_uri(slotstr, NS_RDF "type", NS_OLO "Slot");
-	librdf_model_context_add_statement(request->model, graph, st);
-	librdf_free_statement(st);
+		/* <slot> rdf:type olo:Slot */
+		st = quilt_st_create_uri(slotstr, NS_RDF "type", NS_OLO "Slot");
+		librdf_model_context_add_statement(request->model, graph, st);
+		librdf_free_statement(st);
 
-	/* <slot> olo:item <item> */
-	st = quilt_st_create_uri(slotstr, NS_OLO "item", uri);
-	librdf_model_context_add_statement(request->model, graph, st);
-	librdf_free_statement(st);
+		/* <slot> olo:item <item> */
+		st = quilt_st_create_uri(slotstr, NS_OLO "item", uri);
+		librdf_model_context_add_statement(request->model, graph, st);
+		librdf_free_statement(st);
 
-	/* <slot> rdfs:label "Result item %d" */
-	snprintf(nbuf, sizeof(nbuf) - 1, "Result #%d", index + 1);
-	st = quilt_st_create_literal(slotstr, NS_RDFS "label", nbuf, "en-gb");
-	librdf_model_context_add_statement(request->model, graph, st);
-	librdf_free_statement(st);
+		/* <slot> rdfs:label "Result item %d" */
+		snprintf(nbuf, sizeof(nbuf) - 1, "Result #%d", index + 1);
+		st = quilt_st_create_literal(slotstr, NS_RDFS "label", nbuf, "en-gb");
+		librdf_model_context_add_statement(request->model, graph, st);
+		librdf_free_statement(st);
 
-	/* <slot> olo:index nn */
-	st = quilt_st_create(slotstr, NS_OLO "index");
-	node = quilt_node_create_int(index + 1);
-	librdf_statement_set_object(st, node);
-	librdf_model_context_add_statement(request->model, graph, st);
-	librdf_free_statement(st);
+		/* <slot> olo:index nn */
+		st = quilt_st_create(slotstr, NS_OLO "index");
+		node = quilt_node_create_int(index + 1);
+		librdf_statement_set_object(st, node);
+		librdf_model_context_add_statement(request->model, graph, st);
+		librdf_free_statement(st);
+	}
 
 	if(query->rcanon)
 	{
@@ -792,14 +968,14 @@ process_row(QUILTREQ *request, struct query_struct *query, SQL_STATEMENT *rs, co
 	s = sql_stmt_str(rs, 2);
 	if(s)
 	{
-		add_langvector(request->model, graph, s, uri, NS_RDFS "label");
+		add_langvector(request->model, graph, s, uri, NS_RDFS "label", &(query->langs));
 	}
 
 	/* rdfs:comment */
 	s = sql_stmt_str(rs, 3);
 	if(s)
 	{
-		add_langvector(request->model, graph, s, uri, NS_RDFS "comment");
+		add_langvector(request->model, graph, s, uri, NS_RDFS "comment", &(query->langs));
 	}
 
 	/* rdf:type */
@@ -815,9 +991,6 @@ process_row(QUILTREQ *request, struct query_struct *query, SQL_STATEMENT *rs, co
 	{
 		add_point(request->model, graph, s, uri);
 	}
-	free(uri);
-	quilt_canon_destroy(slot);
-	free(slotstr);
 	return 1;
 }
 
@@ -1063,12 +1236,16 @@ add_point(librdf_model *model, librdf_node *graph, const char *array, const char
 	return 0;
 }
 
-/* Add a language=>literal PostgreSQL vector to the model */
+/* Add a language=>literal PostgreSQL vector to the model; if langs is
+ * non-empty, only the literals in the most-preferred language which is
+ * present are added (along with any which have no language at all)
+ */
 static int
-add_langvector(librdf_model *model, librdf_node *graph, const char *vector, const char *subject, const char *predicate)
+add_langvector(librdf_model *model, librdf_node *graph, const char *vector, const char *subject, const char *predicate, const struct patchwork_langs_struct *langs)
 {
 	librdf_statement *st;
-	char *buf, *lang, *value, *p;
+	char *buf, *lang, *value, *p, *end;
+	size_t best, rank;
 	int q, e;
 
 	buf = (char *) malloc(strlen(vector) + 1);
@@ -1079,6 +1256,11 @@ add_langvector(librdf_model *model, librdf_node *graph, const char *vector, cons
 	}
 	q = 0;
 	e = 0;
+	/* The pairs are unpacked into buf as "lang\0value\0lang\0value\0..."
+	 * (which takes no more space than the vector itself) so that the best
+	 * language can be determined before anything is added
+	 */
+	p = buf;
 	/* "lang" => "literal value", "lang" => "literal value", ... */
 	while(*vector)
 	{
@@ -1091,8 +1273,8 @@ add_langvector(librdf_model *model, librdf_node *graph, const char *vector, cons
 		{
 			break;
 		}
-		lang = buf;
-		for(p = buf; *vector; vector++)
+		lang = p;
+		for(; *vector; vector++)
 		{
 			if(e)
 			{
@@ -1139,10 +1321,12 @@ add_langvector(librdf_model *model, librdf_node *graph, const char *vector, cons
 		{
 			/* Unexpectedly-formed; skip to the next one */
 			vector++;
+			p = lang;
 			continue;
 		}
 		if(!*vector || vector[0] != '=' || vector[1] != '>')
 		{
+			p = lang;
 			break;
 		}		 
 		vector += 2;
@@ -1152,6 +1336,7 @@ add_langvector(librdf_model *model, librdf_node *graph, const char *vector, cons
 		}
 		if(!*vector)
 		{
+			p = lang;
 			break;
 		}
 		/* Now process the value */
@@ -1193,11 +1378,37 @@ add_langvector(librdf_model *model, librdf_node *graph, const char *vector, cons
 			p++;
 		}
 		*p = 0;
-
+		p++;
+	}
+	end = p;
+	best = 0;
+	if(langs && langs->count)
+	{
+		best = langs->count;
+		for(lang = buf; lang < end && best; lang = value + strlen(value) + 1)
+		{
+			value = lang + strlen(lang) + 1;
+			if(lang[0] && lang[0] != '_')
+			{
+				rank = patchwork_langs_rank(langs, lang);
+				if(rank < best)
+				{
+					best = rank;
+				}
+			}
+		}
+	}
+	for(lang = buf; lang < end; lang = value + strlen(value) + 1)
+	{
+		value = lang + strlen(lang) + 1;
 		if(!lang[0] || lang[0] == '_')
 		{
 			lang = NULL;
 		}
+		else if(langs && best < langs->count && patchwork_langs_rank(langs, lang) != best)
+		{
+			continue;
+		}
 		else
 		{
 			for(p = lang; *p; p++)
@@ -1347,11 +1558,11 @@ patchwork_item_db_render_(struct db_item_struct *item)
 	}
 	if(item->titles)
 	{
-		add_langvector(item->model, item->graph, item->titles, item->subject, NS_RDFS "label");
+		add_langvector(item->model, item->graph, item->titles, item->subject, NS_RDFS "label", item->langs);
 	}
 	if(item->descriptions)
 	{
-		add_langvector(item->model, item->graph, item->descriptions, item->subject, NS_RDFS "comment");
+		add_langvector(item->model, item->graph, item->descriptions, item->subject, NS_RDFS "comment", item->langs);
 	}
 	if(item->coords)
 	{
@@ -0,0 +1,178 @@
+/* This engine processes requests for coreference graphs populated
+ * by Twine's "spindle" post-processing module.
+ *
+ * Author: Mo McRoberts <mo.mcroberts@bbc.co.uk>
+ *
+ * Copyright (c) 2014-2017 BBC
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include "p_patchwork.h"
+
+/* The fields= parameter limits the properties which are returned, either
+ * for an item or for each of the results in a page, to those named: each
+ * comma-separated field is either one of the short names below or the
+ * absolute URI of a predicate (for items).
+ */
+
+static struct
+{
+	const char *name;
+	unsigned flag;
+	const char *predicate;
+} patchwork_fields_names[] = {
+	{ "label", PF_LABEL, NS_RDFS "label" },
+	{ "comment", PF_COMMENT, NS_RDFS "comment" },
+	{ "type", PF_TYPE, NS_RDF "type" },
+	{ "coordinates", PF_GEO, NS_GEO "lat" },
+	{ "coordinates", PF_GEO, NS_GEO "long" },
+	{ "sameas", PF_SAMEAS, NS_OWL "sameAs" },
+	/* The olo:Slot structure of each result */
+	{ "slot", PF_SLOT, NULL },
+	{ NULL, 0, NULL }
+};
+
+static int patchwork_fields_add_(struct patchwork_fields_struct *fields, const char *predicate, size_t len);
+
+/* Determine the properties selected by a request; if there is no fields=
+ * parameter, everything is selected
+ */
+int
+patchwork_fields_request(struct patchwork_fields_struct *fields, QUILTREQ *request)
+{
+	const char *t, *end;
+	size_t c, len;
+	int found;
+
+	memset(fields, 0, sizeof(struct patchwork_fields_struct));
+	t = quilt_request_getparam(request, "fields");
+	if(!t || !t[0])
+	{
+		fields->flags = PF_ALL;
+		return 0;
+	}
+	quilt_canon_set_param(request->canonical, "fields", t);
+	fields->projected = 1;
+	while(*t)
+	{
+		for(; *t == ',' || isspace((unsigned char) *t); t++);
+		for(end = t; *end && *end != ','; end++);
+		for(len = end - t; len && isspace((unsigned char) t[len - 1]); len--);
+		if(!len)
+		{
+			t = end;
+			continue;
+		}
+		found = 0;
+		for(c = 0; patchwork_fields_names[c].name; c++)
+		{
+			if(strlen(patchwork_fields_names[c].name) != len || strncasecmp(patchwork_fields_names[c].name, t, len))
+			{
+				continue;
+			}
+			found = 1;
+			fields->flags |= patchwork_fields_names[c].flag;
+			if(patchwork_fields_names[c].predicate &&
+			   patchwork_fields_add_(fields, patchwork_fields_names[c].predicate, strlen(patchwork_fields_names[c].predicate)))
+			{
+				patchwork_fields_free(fields);
+				return -1;
+			}
+		}
+		if(!found)
+		{
+			if(memchr(t, ':', len))
+			{
+				if(patchwork_fields_add_(fields, t, len))
+				{
+					patchwork_fields_free(fields);
+					return -1;
+				}
+			}
+			else
+			{
+				quilt_logf(LOG_DEBUG, QUILT_PLUGIN_NAME ": ignoring unknown field '%.*s'\n", (int) len, t);
+			}
+		}
+		t = end;
+	}
+	return 0;
+}
+
+/* Returns non-zero if statements with the given predicate are selected */
+int
+patchwork_fields_match(const struct patchwork_fields_struct *fields, librdf_node *predicate)
+{
+	const char *uri;
+	size_t c;
+
+	if(!fields->projected)
+	{
+		return 1;
+	}
+	if(!librdf_node_is_resource(predicate))
+	{
+		return 0;
+	}
+	uri = (const char *) librdf_uri_as_string(librdf_node_get_uri(predicate));
+	for(c = 0; c < fields->count; c++)
+	{
+		if(!strcmp(fields->predicates[c], uri))
+		{
+			return 1;
+		}
+	}
+	return 0;
+}
+
+void
+patchwork_fields_free(struct patchwork_fields_struct *fields)
+{
+	size_t c;
+
+	for(c = 0; c < fields->count; c++)
+	{
+		free(fields->predicates[c]);
+	}
+	free(fields->predicates);
+	memset(fields, 0, sizeof(struct patchwork_fields_struct));
+}
+
+static int
+patchwork_fields_add_(struct patchwork_fields_struct *fields, const char *predicate, size_t len)
+{
+	char **p;
+
+	p = (char **) realloc(fields->predicates, sizeof(char *) * (fields->count + 1));
+	if(!p)
+	{
+		quilt_logf(LOG_CRIT, QUILT_PLUGIN_NAME ": failed to allocate memory for fields\n");
+		return -1;
+	}
+	fields->predicates = p;
+	p[fields->count] = (char *) malloc(len + 1);
+	if(!p[fields->count])
+	{
+		quilt_logf(LOG_CRIT, QUILT_PLUGIN_NAME ": failed to allocate memory for fields\n");
+		return -1;
+	}
+	memcpy(p[fields->count], predicate, len);
+	p[fields->count][len] = 0;
+	fields->count++;
+	return 0;
+}
@@ -179,38 +179,93 @@ patchwork_lookup_sparql(QUILTREQ *request, const char *target)
 	return 0;
 }
 
-/* Fetch an item using the SPARQL back-end */
+/* Fetch an item using the SPARQL back-end: each row of the results is
+ * passed through a sink straight into the request model, so that it's
+ * post-processed in the same pass, and appended to a serialised copy for
+ * the in-memory cache
+ */
 int
 patchwork_item_sparql(QUILTREQ *request, const char *id)
 {
-	char *query;
+	struct patchwork_object_struct obj;
+	struct patchwork_sink_struct sink;
+	librdf_world *world;
+	SPARQL *sparql;
+	SPARQLRES *res;
+	SPARQLROW *row;
+	librdf_node *s, *p, *o, *g;
+	librdf_statement *st;
+	size_t count, size;
 
-	query = (char *) malloc(strlen(request->base) + strlen(id) + 1024);
-	if(!query)
+	sparql = quilt_sparql();
+	if(!sparql)
 	{
-		quilt_logf(LOG_CRIT, QUILT_PLUGIN_NAME ": failed to allocate %u bytes\n", (unsigned) strlen(request->subject) + 128);
 		return 500;
 	}
 	/* Fetch the contents of the graph named in the request */
-	sprintf(query, "SELECT DISTINCT * WHERE {\n"
-			"GRAPH ?g {\n"
-			"  ?s ?p ?o . \n"
-			"  FILTER( ?g = <%s%s#id> )\n"
-			"}\n"
-			"}", request->base, id);
-	if(quilt_sparql_query_rdf(query, request->model))
+	res = sparql_queryf(sparql, "SELECT DISTINCT ?s ?p ?o ?g WHERE {\n"
+						"GRAPH ?g {\n"
+						"  ?s ?p ?o . \n"
+						"  FILTER( ?g = <%s%s#id> )\n"
+						"}\n"
+						"}", request->base, id);
+	if(!res)
 	{
-		quilt_logf(LOG_ERR, QUILT_PLUGIN_NAME ": failed to create model from query\n");
-		free(query);
+		quilt_logf(LOG_ERR, QUILT_PLUGIN_NAME ": SPARQL query for item failed\n");
 		return 500;
 	}
-	/* If the model is completely empty, consider the graph to be Not Found */
-	if(quilt_model_isempty(request->model))
+	if(patchwork_item_sink_init(&sink, request))
+	{
+		sparqlres_destroy(res);
+		return 500;
+	}
+	world = quilt_librdf_world();
+	memset(&obj, 0, sizeof(struct patchwork_object_struct));
+	size = 0;
+	count = 0;
+	while((row = sparqlres_next(res)))
+	{
+		s = sparqlrow_binding(row, 0);
+		p = sparqlrow_binding(row, 1);
+		o = sparqlrow_binding(row, 2);
+		g = sparqlrow_binding(row, 3);
+		if(!s || !p || !o || !g)
+		{
+			continue;
+		}
+		st = librdf_new_statement_from_nodes(world, librdf_new_node_from_node(s), librdf_new_node_from_node(p), librdf_new_node_from_node(o));
+		if(!st)
+		{
+			continue;
+		}
+		patchwork_item_sink_add(&sink, st, g);
+		/* Stop serialising (but carry on with the request) if it fails */
+		if(patchwork->cache.memory && size != (size_t) -1 && patchwork_nquads_write(&obj, &size, st, g))
+		{
+			size = (size_t) -1;
+		}
+		librdf_free_statement(st);
+		count++;
+	}
+	sparqlres_destroy(res);
+	patchwork_item_sink_done(&sink);
+	/* If the graph is completely empty, consider it to be Not Found */
+	if(!count)
 	{
-		free(query);
+		patchwork_object_free(&obj);
 		return 404;
 	}
-	free(query);
+	/* Keep the serialised copy of the graph in the in-memory cache */
+	if(obj.buf && size != (size_t) -1)
+	{
+		obj.mime = strdup(MIME_NQUADS);
+		obj.encoding = PE_IDENTITY;
+		if(obj.mime)
+		{
+			patchwork_memory_store(id, &obj);
+		}
+	}
+	patchwork_object_free(&obj);
 	return 200;
 }
 
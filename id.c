@@ -0,0 +1,161 @@
+/* This engine processes requests for coreference graphs populated
+ * by Twine's "spindle" post-processing module.
+ *
+ * Author: Mo McRoberts <mo.mcroberts@bbc.co.uk>
+ *
+ * Copyright (c) 2014-2017 BBC
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include "p_patchwork.h"
+
+/* Item IDs are 128-bit values, written as 32 hex digits (optionally with
+ * hyphens, as in a UUID). They're parsed and formatted eight digits at a
+ * time, with each digit occupying a byte of a 64-bit word.
+ */
+
+#define ID_ONES                        0x0101010101010101ULL
+#define ID_HIGH                        0x8080808080808080ULL
+#define ID_LOW                         0x7f7f7f7f7f7f7f7fULL
+/* Sets the high bit of each byte of x which is greater than m and less
+ * than n, provided that no byte of x has its high bit set
+ */
+#define ID_BETWEEN(x, m, n) \
+	(((ID_ONES * (127 + (n)) - ((x) & ID_LOW)) & ~(x) & (((x) & ID_LOW) + ID_ONES * (127 - (m)))) & ID_HIGH)
+
+static int patchwork_id_word_(const char *str, unsigned long long *word);
+static void patchwork_id_hex_(unsigned long long word, char *buf);
+
+/* Parse an ID, returning -1 if it isn't 32 hex digits (ignoring hyphens) */
+int
+patchwork_id_parse(PATCHWORKID *id, const char *str)
+{
+	char buf[32];
+	unsigned long long w[4];
+	size_t c;
+
+	if(!str)
+	{
+		return -1;
+	}
+	if(strlen(str) != 32)
+	{
+		for(c = 0; *str; str++)
+		{
+			if(*str == '-')
+			{
+				continue;
+			}
+			if(c == 32)
+			{
+				return -1;
+			}
+			buf[c] = *str;
+			c++;
+		}
+		if(c != 32)
+		{
+			return -1;
+		}
+		str = buf;
+	}
+	if(patchwork_id_word_(str, &(w[0])) || patchwork_id_word_(&(str[8]), &(w[1])) ||
+	   patchwork_id_word_(&(str[16]), &(w[2])) || patchwork_id_word_(&(str[24]), &(w[3])))
+	{
+		return -1;
+	}
+	id->hi = (w[0] << 32) | w[1];
+	id->lo = (w[2] << 32) | w[3];
+	return 0;
+}
+
+/* Write an ID as 32 lowercase hex digits (plus a NUL) into buf */
+void
+patchwork_id_format(const PATCHWORKID *id, char *buf)
+{
+	patchwork_id_hex_(id->hi >> 32, buf);
+	patchwork_id_hex_(id->hi & 0xffffffffULL, &(buf[8]));
+	patchwork_id_hex_(id->lo >> 32, &(buf[16]));
+	patchwork_id_hex_(id->lo & 0xffffffffULL, &(buf[24]));
+	buf[32] = 0;
+}
+
+/* Hash an ID for use as a table key */
+unsigned long long
+patchwork_id_hash(const PATCHWORKID *id)
+{
+	unsigned long long h;
+
+	h = id->hi ^ (id->lo * 0x9e3779b97f4a7c15ULL);
+	h ^= h >> 33;
+	h *= 0xff51afd7ed558ccdULL;
+	h ^= h >> 33;
+	return h;
+}
+
+/* Convert eight hex digits to a 32-bit value */
+static int
+patchwork_id_word_(const char *str, unsigned long long *word)
+{
+	const unsigned char *s;
+	unsigned long long x, lower;
+
+	s = (const unsigned char *) str;
+	x = ((unsigned long long) s[0] << 56) | ((unsigned long long) s[1] << 48) |
+		((unsigned long long) s[2] << 40) | ((unsigned long long) s[3] << 32) |
+		((unsigned long long) s[4] << 24) | ((unsigned long long) s[5] << 16) |
+		((unsigned long long) s[6] << 8) | (unsigned long long) s[7];
+	/* Every byte must be '0'-'9', 'a'-'f' or 'A'-'F' */
+	if(x & ID_HIGH)
+	{
+		return -1;
+	}
+	lower = x | (ID_ONES * 0x20);
+	if((ID_BETWEEN(x, '0' - 1, '9' + 1) | ID_BETWEEN(lower, 'a' - 1, 'f' + 1)) != ID_HIGH)
+	{
+		return -1;
+	}
+	/* The low nibble of each byte, plus nine for letters (which have
+	 * 0x40 set), is the value of the digit
+	 */
+	x = (x & (ID_ONES * 0x0f)) + ((x >> 6) & ID_ONES) * 9;
+	/* Pack the digits together, the first being the most significant */
+	x = (x | (x >> 4)) & 0x00ff00ff00ff00ffULL;
+	x = (x | (x >> 8)) & 0x0000ffff0000ffffULL;
+	x = (x | (x >> 16)) & 0x00000000ffffffffULL;
+	*word = x;
+	return 0;
+}
+
+/* Convert a 32-bit value to eight lowercase hex digits */
+static void
+patchwork_id_hex_(unsigned long long x, char *buf)
+{
+	int c;
+
+	/* Spread the digits out, one per byte */
+	x = (x | (x << 16)) & 0x0000ffff0000ffffULL;
+	x = (x | (x << 8)) & 0x00ff00ff00ff00ffULL;
+	x = (x | (x << 4)) & 0x0f0f0f0f0f0f0f0fULL;
+	/* Digits above 9 need 'a' - '0' - 10 adding to reach the letters */
+	x += (ID_ONES * '0') + (((x + (ID_ONES * 6)) >> 4) & ID_ONES) * ('a' - '0' - 10);
+	for(c = 0; c < 8; c++)
+	{
+		buf[c] = (char) (x >> (56 - (c * 8)));
+	}
+}
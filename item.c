@@ -25,8 +25,12 @@
 #include "p_patchwork.h"
 
 static int patchwork_item_id_(QUILTREQ *request, char *idbuf);
+static int patchwork_item_head_(QUILTREQ *request, const char *id);
 static int patchwork_item_is_collection_(QUILTREQ *req, const char *id);
 static int patchwork_item_postprocess_(QUILTREQ *req, const char *id);
+static int patchwork_item_sink_defer_(struct patchwork_sink_struct *sink, librdf_statement *st, librdf_node *context, size_t rank);
+static void patchwork_item_sink_flush_(struct patchwork_sink_struct *sink);
+static int patchwork_item_pending_cmp_(const void *a, const void *b);
 
 /* Given an item's URI, attempt to redirect to it */
 int
@@ -44,15 +48,23 @@ patchwork_lookup(QUILTREQ *request, const char *target)
 int
 patchwork_item(QUILTREQ *request)
 {
-	int r;
+	int r, processed;
 	char idbuf[36], *uri;
+	const char *facet;
 	
 	r = patchwork_item_id_(request, idbuf);
 	if(r)
 	{
 		return r;
 	}
-	/* XXX Check for a sub-graph */
+	/* Check for a sub-resource, such as /<uuid>/media, which is served from
+	 * the corresponding segment of a segmented cache object
+	 */
+	facet = patchwork_item_facet(request);
+	if(facet && strspn(facet, "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789-_") != strlen(facet))
+	{
+		return 404;
+	}
 	/* Set the canonical URI & subject */
 	quilt_canon_add_path(request->canonical, idbuf);
 	quilt_canon_set_fragment(request->canonical, "#id");
@@ -60,8 +72,37 @@ patchwork_item(QUILTREQ *request)
 	quilt_request_set_subject_uristr(request, uri);
 	quilt_logf(LOG_DEBUG, QUILT_PLUGIN_NAME ": item: canonical URI is <%s>\n", uri);
 	free(uri);
+	if(facet)
+	{
+		quilt_canon_add_path(request->canonical, facet);
+	}
 
-	if(patchwork->cache.bucket)
+	if(patchwork_known_absent(idbuf))
+	{
+		return 404;
+	}
+	if(!facet && request->method && !strcmp(request->method, "HEAD"))
+	{
+		r = patchwork_item_head_(request, idbuf);
+		if(r >= 0)
+		{
+			return r;
+		}
+	}
+	/* Items retrieved from caches or the graph store are post-processed as
+	 * they're parsed
+	 */
+	processed = 1;
+	r = patchwork_memory_item(request, idbuf);
+	if(r == 200)
+	{
+		/* Served from the in-memory cache */
+	}
+	else if(patchwork->cache.local)
+	{
+		r = patchwork_item_local(request, idbuf);
+	}
+	else if(patchwork->cache.nshards)
 	{
 		r = patchwork_item_s3(request, idbuf);
 	}
@@ -69,26 +110,39 @@ patchwork_item(QUILTREQ *request)
 	{
 		r = patchwork_item_file(request, idbuf);
 	}
+	else if(facet)
+	{
+		/* Only segmented cache objects have sub-resources */
+		r = 404;
+	}
 	else
 	{
 		r = patchwork_item_sparql(request, idbuf);
 	}
-	if(r != 200 && patchwork->db)
+	if(r != 200 && patchwork->db && !facet)
 	{
 		/* If no data was retrieved from caches, synthesise it
 		 * from the database (#106)
 		 */
 		r = patchwork_item_db(request, idbuf);
+		processed = 0;
 	}
-	if(r != 200)
+	if(r == 404 && !facet)
 	{
-		return r;
+		patchwork_known_miss(idbuf);
 	}
-	r = patchwork_item_postprocess_(request, idbuf);
 	if(r != 200)
 	{
 		return r;
 	}
+	if(!processed)
+	{
+		r = patchwork_item_postprocess_(request, idbuf);
+		if(r != 200)
+		{
+			return r;
+		}
+	}
 /*	r = patchwork_membership(request, idbuf);
 	if(r != 200)
 	{
@@ -155,6 +209,9 @@ patchwork_item_related(QUILTREQ *request, const char *id)
 	return 200;
 }
 
+/* Post-process an item synthesised from the database (items from caches
+ * or the graph store pass through patchwork_item_sink_add())
+ */
 static int
 patchwork_item_postprocess_(QUILTREQ *request, const char *id)
 {
@@ -207,6 +264,258 @@ patchwork_item_postprocess_(QUILTREQ *request, const char *id)
 	return 200;
 }
 
+/* Prepare to receive the statements of an item as they are parsed, so that
+ * they can be post-processed (as by patchwork_item_postprocess_()) in the
+ * same pass, any not selected by a fields= parameter discarded, and
+ * literals filtered by language
+ */
+int
+patchwork_item_sink_init(struct patchwork_sink_struct *sink, QUILTREQ *request)
+{
+	char *abstracturi;
+
+	memset(sink, 0, sizeof(struct patchwork_sink_struct));
+	sink->model = quilt_request_model(request);
+	sink->graph = quilt_request_graph(request);
+	abstracturi = quilt_canon_str(request->canonical, QCO_ABSTRACT);
+	/* The canonical URI of a sub-resource isn't that of the item, so use
+	 * the subject set by patchwork_item()
+	 */
+	sink->subject = strdup(request->subject);
+	sink->facet = patchwork_item_facet(request);
+	if(!abstracturi || !sink->subject || patchwork_fields_request(&(sink->fields), request) ||
+	   patchwork_langs_request(&(sink->langs), request))
+	{
+		free(abstracturi);
+		patchwork_item_sink_done(sink);
+		return -1;
+	}
+	sink->abstract = quilt_node_create_uri(abstracturi);
+	free(abstracturi);
+	sink->sameas = quilt_node_create_uri(NS_OWL "sameAs");
+	if(librdf_node_equals(sink->abstract, sink->graph))
+	{
+		librdf_free_node(sink->abstract);
+		sink->abstract = NULL;
+	}
+	return 0;
+}
+
+/* Add a parsed statement to the request model, moving it from the abstract
+ * document graph to the concrete graph, and adding <subject> owl:sameAs ?s
+ * for any ?s owl:sameAs ?o
+ */
+int
+patchwork_item_sink_add(struct patchwork_sink_struct *sink, librdf_statement *st, librdf_node *context)
+{
+	librdf_node *coref, *object;
+	librdf_statement *newst;
+	const char *lang;
+	size_t rank;
+
+	if(sink->capture)
+	{
+		patchwork_parsed_capture(sink->capture, st, context);
+	}
+	if(!patchwork_fields_match(&(sink->fields), librdf_statement_get_predicate(st)))
+	{
+		return 0;
+	}
+	if(context && sink->abstract && librdf_node_equals(context, sink->abstract))
+	{
+		context = sink->graph;
+	}
+	/* Literals in the preferred language are added straight away (but
+	 * noted, so that alternatives can be discarded); others are held back
+	 * until it's known whether anything better is present
+	 */
+	object = librdf_statement_get_object(st);
+	if(sink->langs.count && librdf_node_is_literal(object) &&
+	   (lang = librdf_node_get_literal_value_language(object)))
+	{
+		rank = patchwork_langs_rank(&(sink->langs), lang);
+		if(patchwork_item_sink_defer_(sink, st, context, rank))
+		{
+			return -1;
+		}
+		if(rank)
+		{
+			return 0;
+		}
+	}
+	if(context)
+	{
+		librdf_model_context_add_statement(sink->model, context, st);
+	}
+	else
+	{
+		librdf_model_add_statement(sink->model, st);
+	}
+	if(!sink->sameas || !librdf_node_equals(librdf_statement_get_predicate(st), sink->sameas))
+	{
+		return 0;
+	}
+	coref = librdf_statement_get_subject(st);
+	if(librdf_node_is_resource(coref))
+	{
+		newst = quilt_st_create_uri(sink->subject, NS_OWL "sameAs", (const char *) librdf_uri_as_string(librdf_node_get_uri(coref)));
+		librdf_model_context_add_statement(sink->model, sink->graph, newst);
+		librdf_free_statement(newst);
+	}
+	return 0;
+}
+
+void
+patchwork_item_sink_done(struct patchwork_sink_struct *sink)
+{
+	size_t c;
+
+	patchwork_item_sink_flush_(sink);
+	for(c = 0; c < sink->npending; c++)
+	{
+		free(sink->pending[c].key);
+		if(sink->pending[c].st)
+		{
+			librdf_free_statement(sink->pending[c].st);
+		}
+		if(sink->pending[c].context)
+		{
+			librdf_free_node(sink->pending[c].context);
+		}
+	}
+	free(sink->pending);
+	if(sink->abstract)
+	{
+		librdf_free_node(sink->abstract);
+	}
+	if(sink->sameas)
+	{
+		librdf_free_node(sink->sameas);
+	}
+	free(sink->subject);
+	patchwork_fields_free(&(sink->fields));
+	patchwork_langs_free(&(sink->langs));
+	memset(sink, 0, sizeof(struct patchwork_sink_struct));
+}
+
+/* Record a literal with a language tag, keyed by its subject and predicate;
+ * only the key of one in the preferred language (rank 0) is recorded, as
+ * it has already been added to the model
+ */
+static int
+patchwork_item_sink_defer_(struct patchwork_sink_struct *sink, librdf_statement *st, librdf_node *context, size_t rank)
+{
+	struct patchwork_sink_pending_struct *p;
+	librdf_node *subject;
+	const char *s, *pred;
+	size_t size;
+
+	subject = librdf_statement_get_subject(st);
+	if(librdf_node_is_resource(subject))
+	{
+		s = (const char *) librdf_uri_as_string(librdf_node_get_uri(subject));
+	}
+	else if(librdf_node_is_blank(subject))
+	{
+		s = (const char *) librdf_node_get_blank_identifier(subject);
+	}
+	else
+	{
+		s = "";
+	}
+	pred = (const char *) librdf_uri_as_string(librdf_node_get_uri(librdf_statement_get_predicate(st)));
+	if(sink->npending == sink->pendingsize)
+	{
+		size = sink->pendingsize ? sink->pendingsize * 2 : 16;
+		p = (struct patchwork_sink_pending_struct *) realloc(sink->pending, sizeof(struct patchwork_sink_pending_struct) * size);
+		if(!p)
+		{
+			quilt_logf(LOG_CRIT, QUILT_PLUGIN_NAME ": failed to allocate memory for pending literals\n");
+			return -1;
+		}
+		sink->pending = p;
+		sink->pendingsize = size;
+	}
+	p = &(sink->pending[sink->npending]);
+	memset(p, 0, sizeof(struct patchwork_sink_pending_struct));
+	p->key = (char *) malloc(strlen(s) + strlen(pred) + 2);
+	if(!p->key)
+	{
+		quilt_logf(LOG_CRIT, QUILT_PLUGIN_NAME ": failed to allocate memory for pending literals\n");
+		return -1;
+	}
+	sprintf(p->key, "%s %s", s, pred);
+	p->rank = rank;
+	if(rank)
+	{
+		p->st = librdf_new_statement_from_statement(st);
+		p->context = (context ? librdf_new_node_from_node(context) : NULL);
+		if(!p->st || (context && !p->context))
+		{
+			quilt_logf(LOG_CRIT, QUILT_PLUGIN_NAME ": failed to copy pending literal\n");
+			if(p->st)
+			{
+				librdf_free_statement(p->st);
+			}
+			free(p->key);
+			return -1;
+		}
+	}
+	sink->npending++;
+	return 0;
+}
+
+/* Add the held-back literals for each subject and predicate in the best
+ * language available (unless one in the preferred language was added
+ * already); if none is in a language in the chain, all of them are added
+ */
+static void
+patchwork_item_sink_flush_(struct patchwork_sink_struct *sink)
+{
+	size_t c, start, best;
+
+	if(!sink->npending)
+	{
+		return;
+	}
+	qsort(sink->pending, sink->npending, sizeof(struct patchwork_sink_pending_struct), patchwork_item_pending_cmp_);
+	for(start = 0; start < sink->npending; start = c)
+	{
+		best = sink->pending[start].rank;
+		for(c = start; c < sink->npending && !strcmp(sink->pending[c].key, sink->pending[start].key); c++)
+		{
+			if(!best || (best < sink->langs.count && sink->pending[c].rank != best))
+			{
+				continue;
+			}
+			if(sink->pending[c].context)
+			{
+				librdf_model_context_add_statement(sink->model, sink->pending[c].context, sink->pending[c].st);
+			}
+			else
+			{
+				librdf_model_add_statement(sink->model, sink->pending[c].st);
+			}
+		}
+	}
+}
+
+static int
+patchwork_item_pending_cmp_(const void *a, const void *b)
+{
+	const struct patchwork_sink_pending_struct *pa, *pb;
+	int r;
+
+	pa = (const struct patchwork_sink_pending_struct *) a;
+	pb = (const struct patchwork_sink_pending_struct *) b;
+	r = strcmp(pa->key, pb->key);
+	if(r)
+	{
+		return r;
+	}
+	return (pa->rank < pb->rank ? -1 : (pa->rank > pb->rank ? 1 : 0));
+}
+
 static int
 patchwork_item_is_collection_(QUILTREQ *req, const char *id)
 {
@@ -234,37 +543,101 @@ patchwork_item_is_collection_(QUILTREQ *req, const char *id)
 	return r;
 }
 
-/* Given a request, determine the UUID of the item being requested */
+/* Answer a HEAD request for an item using only the metadata held by the
+ * caches (or the proxy table), without retrieving or parsing the item
+ * itself; returns -1 if the full request must be processed instead
+ */
 static int
-patchwork_item_id_(QUILTREQ *request, char *idbuf)
+patchwork_item_head_(QUILTREQ *request, const char *id)
 {
-	const char *seg;
-	char *p;
+	struct patchwork_object_struct obj;
+	char modified[PATCHWORK_DATE_MAX];
+	int r;
 
-	seg = quilt_request_consume(request);
-	if(!seg)
+	memset(&obj, 0, sizeof(struct patchwork_object_struct));
+	if(patchwork->cache.local)
 	{
-		return 404;
+		r = patchwork_local_head(id, &obj);
 	}
-	
-	for(p = idbuf; *seg; seg++)
+	else if(patchwork->cache.nshards)
+	{
+		r = patchwork_s3_head(id, &obj);
+	}
+	else if(patchwork->cache.path)
 	{
-		if(*seg == '-')
+		r = patchwork_file_head(id, &obj);
+	}
+	else if(!patchwork->db)
+	{
+		/* There's no way to tell without querying the graph store */
+		return -1;
+	}
+	else
+	{
+		r = 404;
+	}
+	if(r != 200 && patchwork->db)
+	{
+		patchwork_object_free(&obj);
+		r = patchwork_item_db_modified(id, modified, sizeof(modified));
+		if(r < 0)
 		{
-			continue;
+			return -1;
 		}
-		if(isalnum(*seg))
+		if(!r)
 		{
-			*p = tolower(*seg);
-			p++;
-			continue;
+			r = 200;
 		}
+	}
+	if(r == 404)
+	{
+		patchwork_known_miss(id);
+	}
+	if(r != 200)
+	{
+		patchwork_object_free(&obj);
+		return r;
+	}
+	quilt_request_headers(request, "Status: 200 OK\n");
+	quilt_request_headers(request, "Server: Quilt/" PACKAGE_VERSION "\n");
+	/* The same headers are sent as for a GET, which has no validators */
+	quilt_request_headerf(request, "Content-Type: %s\n", request->type);
+	patchwork_object_free(&obj);
+	/* Return 0 to supress output */
+	return 0;
+}
+
+/* Return the name of the sub-resource of an item being requested (such as
+ * "media" for /<uuid>/media), or NULL if it's the item itself
+ */
+const char *
+patchwork_item_facet(QUILTREQ *request)
+{
+	const char *t;
+
+	for(t = request->path; *t == '/'; t++);
+	for(; isalnum(*t) || *t == '-'; t++);
+	for(; *t == '/'; t++);
+	return (*t ? t : NULL);
+}
+
+/* Given a request, determine the UUID of the item being requested */
+static int
+patchwork_item_id_(QUILTREQ *request, char *idbuf)
+{
+	const char *seg;
+	PATCHWORKID id;
+
+	seg = quilt_request_consume(request);
+	if(!seg)
+	{
 		return 404;
 	}
-	*p = 0;
-	if(strlen(idbuf) != 32)
+	/* Normalise the ID to 32 lowercase hex digits */
+	if(patchwork_id_parse(&id, seg))
 	{
 		return 404;
 	}
+	patchwork_id_format(&id, idbuf);
 	return 0;
 }
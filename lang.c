@@ -0,0 +1,203 @@
+/* This engine processes requests for coreference graphs populated
+ * by Twine's "spindle" post-processing module.
+ *
+ * Author: Mo McRoberts <mo.mcroberts@bbc.co.uk>
+ *
+ * Copyright (c) 2014-2017 BBC
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include "p_patchwork.h"
+
+/* If lang:filter is enabled, only the literals in a single language are
+ * returned for each property of each subject, both for the rows of a
+ * page of results and for items: the language requested with lang= (or
+ * if that isn't available, the first of the lang:fallback chain that is;
+ * if none is, every variant is returned). Literals without a language
+ * are always returned.
+ */
+
+static struct
+{
+	int enabled;
+	/* The lang:fallback chain */
+	struct patchwork_langs_struct fallback;
+} patchwork_langs = { 0, { NULL, 0 } };
+
+static int patchwork_langs_add_(struct patchwork_langs_struct *langs, const char *tag, size_t len);
+
+int
+patchwork_langs_init(void)
+{
+	char *t;
+	int r;
+
+	patchwork_langs.enabled = quilt_config_get_bool("lang:filter", 0);
+	if(!patchwork_langs.enabled)
+	{
+		return 0;
+	}
+	t = quilt_config_geta("lang:fallback", DEFAULT_PATCHWORK_LANG_FALLBACK);
+	if(!t)
+	{
+		return -1;
+	}
+	r = patchwork_langs_parse(&(patchwork_langs.fallback), t);
+	quilt_logf(LOG_INFO, QUILT_PLUGIN_NAME ": literals will be filtered by language (falling back to %s)\n", t);
+	free(t);
+	return r;
+}
+
+/* Returns non-zero if literals are being filtered by language */
+int
+patchwork_langs_filtered(void)
+{
+	return patchwork_langs.enabled;
+}
+
+/* Determine the chain of languages acceptable for a request: the one
+ * requested, followed by the fallbacks. If filtering is disabled, the
+ * chain is empty and every literal is acceptable.
+ */
+int
+patchwork_langs_request(struct patchwork_langs_struct *langs, QUILTREQ *request)
+{
+	const char *t;
+	size_t c;
+
+	memset(langs, 0, sizeof(struct patchwork_langs_struct));
+	if(!patchwork_langs.enabled)
+	{
+		return 0;
+	}
+	t = quilt_request_getparam(request, "lang");
+	if(t && t[0])
+	{
+		/* The representation depends upon the language requested */
+		quilt_canon_set_param(request->canonical, "lang", t);
+		if(patchwork_langs_parse(langs, t))
+		{
+			return -1;
+		}
+	}
+	for(c = 0; c < patchwork_langs.fallback.count; c++)
+	{
+		if(patchwork_langs_rank(langs, patchwork_langs.fallback.tags[c]) < langs->count)
+		{
+			continue;
+		}
+		if(patchwork_langs_add_(langs, patchwork_langs.fallback.tags[c], strlen(patchwork_langs.fallback.tags[c])))
+		{
+			patchwork_langs_free(langs);
+			return -1;
+		}
+	}
+	return 0;
+}
+
+/* Parse a comma-separated list of language tags, which are normalised to
+ * lower-case, with '-' in place of '_' (so en_GB becomes en-gb)
+ */
+int
+patchwork_langs_parse(struct patchwork_langs_struct *langs, const char *list)
+{
+	const char *end;
+	size_t len;
+
+	while(*list)
+	{
+		for(; *list == ',' || isspace((unsigned char) *list); list++);
+		for(end = list; *end && *end != ',' && !isspace((unsigned char) *end); end++);
+		len = end - list;
+		if(len && patchwork_langs_add_(langs, list, len))
+		{
+			patchwork_langs_free(langs);
+			return -1;
+		}
+		list = end;
+	}
+	return 0;
+}
+
+/* Return the position of a language tag in the chain, or the length of the
+ * chain if it isn't present; a tag in the chain also matches any more
+ * specific tag (so "cy" matches "cy-gb")
+ */
+size_t
+patchwork_langs_rank(const struct patchwork_langs_struct *langs, const char *lang)
+{
+	const char *a, *b;
+	size_t c;
+
+	for(c = 0; c < langs->count; c++)
+	{
+		for(a = langs->tags[c], b = lang; *a && *b; a++, b++)
+		{
+			if(*a != (*b == '_' ? '-' : tolower((unsigned char) *b)))
+			{
+				break;
+			}
+		}
+		if(!*a && (!*b || *b == '-' || *b == '_'))
+		{
+			return c;
+		}
+	}
+	return langs->count;
+}
+
+void
+patchwork_langs_free(struct patchwork_langs_struct *langs)
+{
+	size_t c;
+
+	for(c = 0; c < langs->count; c++)
+	{
+		free(langs->tags[c]);
+	}
+	free(langs->tags);
+	memset(langs, 0, sizeof(struct patchwork_langs_struct));
+}
+
+static int
+patchwork_langs_add_(struct patchwork_langs_struct *langs, const char *tag, size_t len)
+{
+	char **p;
+	size_t c;
+
+	p = (char **) realloc(langs->tags, sizeof(char *) * (langs->count + 1));
+	if(!p)
+	{
+		quilt_logf(LOG_CRIT, QUILT_PLUGIN_NAME ": failed to allocate memory for language chain\n");
+		return -1;
+	}
+	langs->tags = p;
+	p[langs->count] = (char *) malloc(len + 1);
+	if(!p[langs->count])
+	{
+		quilt_logf(LOG_CRIT, QUILT_PLUGIN_NAME ": failed to allocate memory for language chain\n");
+		return -1;
+	}
+	for(c = 0; c < len; c++)
+	{
+		p[langs->count][c] = (tag[c] == '_' ? '-' : tolower((unsigned char) tag[c]));
+	}
+	p[langs->count][len] = 0;
+	langs->count++;
+	return 0;
+}
@@ -60,6 +60,10 @@ quilt_plugin_init(void)
 	}
 	patchwork->threshold = quilt_config_get_int(QUILT_PLUGIN_NAME ":score", PATCHWORK_THRESHOLD);
 	quilt_logf(LOG_INFO, QUILT_PLUGIN_NAME ": default score threshold set to %d\n", patchwork->threshold);
+	if(patchwork_langs_init())
+	{
+		return -1;
+	}
 	if(patchwork_db_init())
 	{
 		return -1;
@@ -94,6 +98,34 @@ patchwork_array_contains(const char *const *array, const char *string)
 	return 0;
 }
 
+/* Create an empty in-memory model with contexts, for graphs which are
+ * rendered separately from the request model
+ */
+librdf_model *
+patchwork_model_create(void)
+{
+	librdf_world *world;
+	librdf_storage *storage;
+	librdf_model *model;
+
+	world = quilt_librdf_world();
+	storage = librdf_new_storage(world, "hashes", NULL, "hash-type='memory',contexts='yes'");
+	if(!storage)
+	{
+		quilt_logf(LOG_ERR, QUILT_PLUGIN_NAME ": failed to create storage\n");
+		return NULL;
+	}
+	model = librdf_new_model(world, storage, NULL);
+	/* The model holds its own reference to the storage */
+	librdf_free_storage(storage);
+	if(!model)
+	{
+		quilt_logf(LOG_ERR, QUILT_PLUGIN_NAME ": failed to create model\n");
+		return NULL;
+	}
+	return model;
+}
+
 /* quilt_config_getall() callback */
 static int
 patchwork_partition_cb_(const char *key, const char *value, void *data)
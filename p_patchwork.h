@@ -29,6 +29,8 @@
 # include <string.h>
 # include <ctype.h>
 # include <errno.h>
+# include <pthread.h>
+# include <time.h>
 # include <libsparqlclient.h>
 # include <libawsclient.h>
 # include <libsql.h>
@@ -41,9 +43,106 @@
 
 # define DEFAULT_PATCHWORK_FETCH_LIMIT	( 2 * 1024 )
 
+/* S3 request timeout, in milliseconds */
+# define DEFAULT_PATCHWORK_S3_TIMEOUT   10000
+/* Number of times a failed S3 GET will be retried */
+# define DEFAULT_PATCHWORK_S3_RETRIES   2
+/* Base delay for retry back-off, in milliseconds */
+# define DEFAULT_PATCHWORK_S3_BACKOFF   50
+/* Latency percentile after which a hedged S3 GET is issued (0 disables) */
+# define DEFAULT_PATCHWORK_S3_HEDGE     95
+/* Minimum delay before hedging, in milliseconds */
+# define DEFAULT_PATCHWORK_S3_HEDGE_MIN 10
+/* Number of recent S3 latencies used to determine the hedge delay */
+# define PATCHWORK_S3_LATENCY_SAMPLES   256
+
+/* Seconds after which an item in the local tier is revalidated (0 never) */
+# define DEFAULT_PATCHWORK_LOCAL_TTL    300
+/* Maximum size of the local tier, in MiB (0 for unlimited) */
+# define DEFAULT_PATCHWORK_LOCAL_SIZE   10240
+/* Interval between local tier eviction sweeps, in seconds */
+# define DEFAULT_PATCHWORK_LOCAL_SWEEP  60
+
+/* Seconds for which a graph synthesised from the database is cached */
+# define DEFAULT_PATCHWORK_DB_CACHE_TTL 60
+/* Stands in for the ID of each result when generating their URIs */
+# define PATCHWORK_ROW_PLACEHOLDER      "00000000000000000000000000000000"
+
+/* Size of the in-memory item cache, in MiB (0 disables it) */
+# define DEFAULT_PATCHWORK_MEMORY_SIZE  256
+/* Seconds for which an item is held in the in-memory cache */
+# define DEFAULT_PATCHWORK_MEMORY_TTL   60
+/* Upper bound on the number of in-memory cache shards */
+# define PATCHWORK_MEMORY_SHARDS_MAX    64
+
+/* Number of file cache reads submitted together by a bulk fetch */
+# define PATCHWORK_BULK_DEPTH           256
+
+/* Largest scratch buffer a worker thread keeps between items */
+# define PATCHWORK_WORKER_RETAIN        (1024 * 1024)
+/* Initial guess at the compression ratio of cached items, in 1/16ths */
+# define PATCHWORK_WORKER_RATIO         64
+# define PATCHWORK_WORKER_RATIO_MAX     512
+
+/* Maximum number of parsed statements held for file cache items */
+# define DEFAULT_PATCHWORK_PARSED_LIMIT 1000000
+
+/* Seconds for which an item which couldn't be found is remembered */
+# define DEFAULT_PATCHWORK_KNOWN_NEGATIVE_TTL 30
+/* Number of slots in the negative cache (a power of two) */
+# define PATCHWORK_KNOWN_NEGATIVE_SIZE  65536
+/* Interval between incremental updates of the known item filter */
+# define DEFAULT_PATCHWORK_KNOWN_REFRESH 60
+/* Interval between complete rebuilds of the known item filter */
+# define DEFAULT_PATCHWORK_KNOWN_REBUILD 3600
+/* Bits per item and probes per lookup in the known item filter (about a
+ * 1% false positive rate) */
+# define PATCHWORK_KNOWN_BITS           10
+# define PATCHWORK_KNOWN_HASHES         7
+
+/* Percentage of recent S3 requests which must fail (or be slow) before
+ * the circuit breaker opens (0 disables)
+ */
+# define DEFAULT_PATCHWORK_BREAKER_THRESHOLD 50
+/* Latency, in milliseconds, beyond which a request counts as failed */
+# define DEFAULT_PATCHWORK_BREAKER_SLOW 2000
+/* Seconds to wait after opening before probing the back-end again */
+# define DEFAULT_PATCHWORK_BREAKER_COOLDOWN 10
+
+/* Languages to fall back to when filtering literals by language */
+# define DEFAULT_PATCHWORK_LANG_FALLBACK "en-gb,en"
+
+/* Number of recent outcomes tracked by a circuit breaker */
+# define PATCHWORK_BREAKER_WINDOW       64
+/* Minimum number of outcomes before a circuit breaker can open */
+# define PATCHWORK_BREAKER_MINIMUM      16
+
+/* Number of points each S3 shard occupies on the consistent-hash ring */
+# define PATCHWORK_S3_VNODES            64
+
 # define PATCHWORK_ABOUT_MAX            6
 
 # define MIME_NQUADS                    "application/n-quads"
+# define MIME_PATCHWORK_QUADS           "application/x-patchwork-quads"
+# define MIME_PATCHWORK_SEGMENTS        "application/x-patchwork-segments"
+
+/* Number of bytes read from the start of a segmented object in the hope
+ * of obtaining its whole index at once
+ */
+# define PATCHWORK_SEGMENTS_PROBE       4096
+
+/* Properties which can be selected with the fields= parameter */
+# define PF_LABEL                       0x0001
+# define PF_COMMENT                     0x0002
+# define PF_TYPE                        0x0004
+# define PF_GEO                         0x0008
+# define PF_SAMEAS                      0x0010
+# define PF_SLOT                        0x0020
+# define PF_ALL                         0xffff
+
+/* Maximum lengths of stored HTTP validators */
+# define PATCHWORK_ETAG_MAX             128
+# define PATCHWORK_DATE_MAX             64
 
 /* Namespaces */
 # define NS_RDF                         "http://www.w3.org/1999/02/22-rdf-syntax-ns#"
@@ -71,6 +170,7 @@
 # define NS_OLO                         "http://purl.org/ontology/olo/core#"
 
 typedef struct patchwork_struct PATCHWORK;
+typedef struct patchwork_id_struct PATCHWORKID;
 
 typedef enum
 {
@@ -78,22 +178,231 @@ typedef enum
 	QM_AUTOCOMPLETE = 1
 } PATCHWORKQMODE;
 
+typedef enum
+{
+	PE_IDENTITY = 0,
+	PE_ZSTD = 1
+} PATCHWORKENCODING;
+
+typedef enum
+{
+	PB_CLOSED = 0,
+	PB_OPEN = 1,
+	PB_HALF_OPEN = 2
+} PATCHWORKBREAKERSTATE;
+
+/* A circuit breaker guarding a remote back-end */
+struct patchwork_breaker_struct
+{
+	pthread_mutex_t lock;
+	const char *name;
+	PATCHWORKBREAKERSTATE state;
+	/* Outcomes of recent requests (non-zero for a failure) */
+	unsigned char window[PATCHWORK_BREAKER_WINDOW];
+	size_t next;
+	size_t count;
+	size_t failures;
+	/* When the circuit was last opened */
+	long opened;
+	/* Failure percentage at which the circuit opens (0 disables) */
+	int threshold;
+	/* Latency (ms) beyond which a successful request counts as a failure */
+	long slow;
+	/* Time (seconds) to wait before probing an open circuit */
+	long cooldown;
+};
+
+/* An S3 bucket which holds some portion of the item cache */
+struct patchwork_s3_shard_struct
+{
+	char *name;
+	AWSS3BUCKET *bucket;
+	struct patchwork_breaker_struct breaker;
+};
+
+/* A point on the consistent-hash ring mapping items to S3 shards */
+struct patchwork_ring_struct
+{
+	unsigned long long point;
+	size_t shard;
+};
+
+/* The identity of a file cache item whose parsed statements are cached */
+struct patchwork_parsed_key_struct
+{
+	int valid;
+	unsigned long generation;
+	dev_t dev;
+	ino_t ino;
+	time_t mtime;
+	long mtime_nsec;
+};
+
+/* The statements passed to a sink, as parsed and before any filtering,
+ * captured so that they can be held by the parsed-statement cache */
+struct patchwork_parsed_capture_struct
+{
+	int failed;
+	size_t count;
+	size_t size;
+	librdf_statement **statements;
+	librdf_node **contexts;
+};
+
+/* A mapped packfile segment */
+struct patchwork_pack_segment_struct
+{
+	const char *base;
+	size_t len;
+};
+
+/* A set of packfiles, and the index of their contents */
+struct patchwork_pack_struct
+{
+	const unsigned char *index;
+	size_t indexlen;
+	/* The first entry, which follows the index header */
+	const unsigned char *entries;
+	size_t nentries;
+	struct patchwork_pack_segment_struct *segments;
+	size_t nsegments;
+};
+
 struct patchwork_struct
 {
 	struct
 	{
-		AWSS3BUCKET *bucket;
+		struct patchwork_s3_shard_struct *shards;
+		size_t nshards;
+		struct patchwork_ring_struct *ring;
+		size_t nring;
+		int s3_replica;
 		char *path;
+		struct patchwork_pack_struct *pack;
+		struct patchwork_memory_struct *memory;
+		/* Non-zero if the file cache is a local tier in front of S3 */
+		int local;
+		long local_ttl;
+		unsigned long long local_size;
+		long local_sweep;
+		/* Lifetime of cached graphs synthesised from the database */
+		long db_ttl;
 		int s3_verbose;
 		size_t s3_fetch_limit;
+		long s3_timeout;
+		int s3_retries;
+		long s3_backoff;
+		int s3_hedge;
+		long s3_hedge_min;
 	} cache;	  
 	SQL *db;
 	int db_version;
+	struct patchwork_known_struct *known;
 	int threshold;
 	struct index_struct *indices;
 	struct mediamatch_struct *mediamatch;
 };
 
+/* State kept by each worker thread between requests */
+struct patchwork_worker_struct
+{
+	/* Zstandard decompression context */
+	void *dctx;
+	char *scratch;
+	size_t scratchsize;
+	/* Recent ratio of decompressed to compressed sizes, in 1/16ths */
+	size_t ratio;
+};
+
+/* A 128-bit item ID (see patchwork_id_parse()) */
+struct patchwork_id_struct
+{
+	unsigned long long hi;
+	unsigned long long lo;
+};
+
+/* The properties selected by a request's fields= parameter */
+struct patchwork_fields_struct
+{
+	/* Non-zero if there is a fields= parameter at all */
+	int projected;
+	/* The named fields selected (PF_xxx) */
+	unsigned flags;
+	/* The predicates selected */
+	char **predicates;
+	size_t count;
+};
+
+/* The languages acceptable for the literals returned by a request, in
+ * order of preference (empty if literals aren't being filtered)
+ */
+struct patchwork_langs_struct
+{
+	char **tags;
+	size_t count;
+};
+
+/* Receives the statements of an item as they are parsed */
+struct patchwork_sink_struct
+{
+	librdf_model *model;
+	/* The request graph */
+	librdf_node *graph;
+	/* The abstract document graph, if it differs from the request graph */
+	librdf_node *abstract;
+	librdf_node *sameas;
+	char *subject;
+	/* The sub-resource requested, if any (see patchwork_item_facet()) */
+	const char *facet;
+	/* Statements whose predicates aren't selected are discarded */
+	struct patchwork_fields_struct fields;
+	/* Literals in languages other than the preferred one are held back
+	 * until the whole item has been parsed */
+	struct patchwork_langs_struct langs;
+	struct patchwork_sink_pending_struct *pending;
+	size_t npending;
+	size_t pendingsize;
+	/* If set, every statement added is also captured here */
+	struct patchwork_parsed_capture_struct *capture;
+};
+
+/* A literal held back by a sink in case no better language turns up */
+struct patchwork_sink_pending_struct
+{
+	/* The subject and predicate, used to group alternatives */
+	char *key;
+	size_t rank;
+	librdf_statement *st;
+	librdf_node *context;
+};
+
+/* A raw object retrieved from (or held by) a cache back-end */
+struct patchwork_object_struct
+{
+	char *buf;
+	size_t len;
+	/* If non-zero, buf is a mapped region of this size rather than a
+	 * heap allocation */
+	size_t mapped;
+	/* If non-zero, buf belongs to something else (such as a packfile) and
+	 * must not be freed */
+	int borrowed;
+	char *mime;
+	/* Non-zero if buf holds only the segment of a segmented object for
+	 * the sub-resource being requested */
+	int segment;
+	/* How buf is encoded, if at all */
+	PATCHWORKENCODING encoding;
+	/* Validators, used for conditional revalidation */
+	char etag[PATCHWORK_ETAG_MAX];
+	char modified[PATCHWORK_DATE_MAX];
+	/* For objects synthesised from the database, the time after which
+	 * the object must be checked against the index, and the value of
+	 * index.modified when it was generated */
+	time_t expires;
+	char indexed[PATCHWORK_DATE_MAX];
+};
+
 struct index_struct
 {
 	char *uri;
@@ -137,6 +446,13 @@ struct query_struct
 	/* Minimum and maximum durations of media */
 	int duration_min;
 	int duration_max;
+	/* Properties to return for each result */
+	struct patchwork_fields_struct fields;
+	/* Languages of the literals to return */
+	struct patchwork_langs_struct langs;
+	/* If non-zero, results are listed as members of an rdf:Seq, without
+	 * the olo:Slot structure and rdfs:seeAlso links */
+	int lean;
 };
 
 struct mediamatch_struct
@@ -160,12 +476,35 @@ int patchwork_index(QUILTREQ *req, const char *qclass);
 int patchwork_home(QUILTREQ *req);
 int patchwork_item(QUILTREQ *req);
 int patchwork_item_related(QUILTREQ *request, const char *id);
+const char *patchwork_item_facet(QUILTREQ *request);
+int patchwork_item_sink_init(struct patchwork_sink_struct *sink, QUILTREQ *request);
+int patchwork_item_sink_add(struct patchwork_sink_struct *sink, librdf_statement *st, librdf_node *context);
+void patchwork_item_sink_done(struct patchwork_sink_struct *sink);
 int patchwork_lookup(QUILTREQ *req, const char *uri);
 
 int patchwork_add_concrete(QUILTREQ *request);
 
 int patchwork_array_contains(const char *const *array, const char *value);
 
+/* Property projection (fields=) */
+int patchwork_fields_request(struct patchwork_fields_struct *fields, QUILTREQ *request);
+int patchwork_fields_match(const struct patchwork_fields_struct *fields, librdf_node *predicate);
+void patchwork_fields_free(struct patchwork_fields_struct *fields);
+
+/* Binary item IDs */
+int patchwork_id_parse(PATCHWORKID *id, const char *str);
+void patchwork_id_format(const PATCHWORKID *id, char *buf);
+unsigned long long patchwork_id_hash(const PATCHWORKID *id);
+
+/* Language filtering of literals */
+int patchwork_langs_init(void);
+int patchwork_langs_filtered(void);
+int patchwork_langs_request(struct patchwork_langs_struct *langs, QUILTREQ *request);
+int patchwork_langs_parse(struct patchwork_langs_struct *langs, const char *list);
+size_t patchwork_langs_rank(const struct patchwork_langs_struct *langs, const char *lang);
+void patchwork_langs_free(struct patchwork_langs_struct *langs);
+librdf_model *patchwork_model_create(void);
+
 /* Initialise a query structure */
 int patchwork_query_init(struct query_struct *dest);
 /* Free resources used by a query structure */
@@ -189,6 +528,12 @@ int patchwork_lookup_db(QUILTREQ *request, const char *target);
 int patchwork_audiences_db(QUILTREQ *request, struct query_struct *query);
 int patchwork_membership_db(QUILTREQ *request, const char *id);
 int patchwork_item_db(QUILTREQ *request, const char *id);
+int patchwork_item_db_modified(const char *id, char *buf, size_t len);
+
+/* Known and unknown item IDs */
+int patchwork_known_init(const char *uri);
+int patchwork_known_absent(const char *id);
+void patchwork_known_miss(const char *id);
 
 /* SPARQL back-end */
 int patchwork_query_sparql(QUILTREQ *request, struct query_struct *query);
@@ -198,10 +543,84 @@ int patchwork_item_sparql(QUILTREQ *req, const char *id);
 /* Caches */
 int patchwork_cache_init(void);
 
+/* Cached objects */
+void patchwork_object_free(struct patchwork_object_struct *obj);
+int patchwork_object_parse(QUILTREQ *request, struct patchwork_object_struct *obj);
+int patchwork_object_parse_capture(QUILTREQ *request, struct patchwork_object_struct *obj, struct patchwork_parsed_capture_struct *capture);
+int patchwork_object_meta_read(const char *path, struct patchwork_object_struct *obj);
+int patchwork_object_meta_write(const char *path, const struct patchwork_object_struct *obj);
+int patchwork_object_serialise(librdf_model *model, struct patchwork_object_struct *obj);
+
+/* Circuit breakers */
+int patchwork_breaker_init(struct patchwork_breaker_struct *breaker, const char *name, int threshold, long slow, long cooldown);
+int patchwork_breaker_allow(struct patchwork_breaker_struct *breaker);
+int patchwork_breaker_record(struct patchwork_breaker_struct *breaker, int failed, long ms);
+
+/* Zstandard-compressed objects */
+int patchwork_zstd_init(void);
+int patchwork_zstd_detect(const char *buf, size_t len);
+int patchwork_zstd_decompress(const char *in, size_t inlen, char **out, size_t *outlen);
+
 /* S3 cache back-end */
 int patchwork_item_s3(QUILTREQ *req, const char *id);
+int patchwork_s3_fetch(const char *id, struct patchwork_object_struct *obj);
+int patchwork_s3_head(const char *id, struct patchwork_object_struct *obj);
+int patchwork_s3_fetch_range(const char *id, size_t offset, size_t len, struct patchwork_object_struct *obj);
+int patchwork_s3_fetch_segment(const char *id, const char *facet, struct patchwork_object_struct *obj);
+size_t patchwork_s3_shards(const char *id, struct patchwork_s3_shard_struct **shards, size_t max);
+unsigned long long patchwork_hash(const char *str, size_t len);
 
 /* File cache back-end */
 int patchwork_item_file(QUILTREQ *request, const char *id);
+int patchwork_file_fetch(const char *id, struct patchwork_object_struct *obj);
+int patchwork_file_fetch_segment(const char *id, const char *facet, struct patchwork_object_struct *obj);
+int patchwork_file_finish(const char *id, struct patchwork_object_struct *obj);
+int patchwork_file_head(const char *id, struct patchwork_object_struct *obj);
+int patchwork_file_fetch_many(const char *const *ids, size_t n, struct patchwork_object_struct *objs, int *status);
+int patchwork_bulk_warm(void);
+int patchwork_file_store(const char *id, const struct patchwork_object_struct *obj);
+int patchwork_file_store_graph(const char *id, librdf_model *model, const char *indexed);
+char *patchwork_file_path(const char *id, const char *suffix);
+
+/* Parsed statements of file cache items */
+int patchwork_parsed_init(void);
+int patchwork_parsed_item(QUILTREQ *request, const char *id, struct patchwork_parsed_key_struct *key);
+int patchwork_parsed_store(const char *id, const struct patchwork_parsed_key_struct *key, struct patchwork_parsed_capture_struct *capture);
+int patchwork_parsed_capture(struct patchwork_parsed_capture_struct *capture, librdf_statement *st, librdf_node *context);
+void patchwork_parsed_capture_free(struct patchwork_parsed_capture_struct *capture);
+
+/* Per-thread decoding state */
+struct patchwork_worker_struct *patchwork_worker(void);
+char *patchwork_worker_scratch(struct patchwork_worker_struct *worker, size_t size);
+void patchwork_worker_release(struct patchwork_worker_struct *worker);
+void patchwork_worker_learn(struct patchwork_worker_struct *worker, size_t in, size_t out);
+
+/* N-Quads reader and writer */
+int patchwork_nquads_parse(struct patchwork_sink_struct *sink, const char *buf, size_t len);
+/* Append a statement to a serialised graph */
+int patchwork_nquads_write(struct patchwork_object_struct *obj, size_t *size, librdf_statement *st, librdf_node *context);
+
+/* Binary quad format */
+int patchwork_quads_detect(const char *buf, size_t len);
+int patchwork_quads_parse(struct patchwork_sink_struct *sink, const char *buf, size_t len);
+
+/* Segmented objects */
+int patchwork_segments_detect(const char *buf, size_t len);
+int patchwork_segments_find(const char *buf, size_t buflen, const char *facet, size_t *offset, size_t *len);
+int patchwork_segments_parse(struct patchwork_sink_struct *sink, const char *buf, size_t len, const char *facet);
+
+/* In-memory item cache */
+int patchwork_memory_init(void);
+int patchwork_memory_item(QUILTREQ *request, const char *id);
+int patchwork_memory_store(const char *id, const struct patchwork_object_struct *obj);
+
+/* Local disk tier in front of S3 */
+int patchwork_local_init(void);
+int patchwork_item_local(QUILTREQ *request, const char *id);
+int patchwork_local_head(const char *id, struct patchwork_object_struct *obj);
+
+/* Packfiles */
+int patchwork_pack_open(const char *path);
+int patchwork_pack_lookup(const char *id, struct patchwork_object_struct *obj);
 
 #endif /*!P_PATCHWORK_H_*/
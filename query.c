@@ -34,6 +34,7 @@ patchwork_query_init(struct query_struct *dest)
 {
 	memset(dest, 0, sizeof(struct query_struct));
 	dest->score = -1;
+	dest->fields.flags = PF_ALL;
 	return 0;
 }
 
@@ -137,6 +138,13 @@ patchwork_query_request(struct query_struct *dest, QUILTREQ *request, const char
 			quilt_canon_set_param(request->canonical, "mode", t);
 		}
 	}
+	/* Output profile */
+	t = quilt_request_getparam(request, "profile");
+	if(t && !strcmp(t, "lean"))
+	{
+		dest->lean = 1;
+		quilt_canon_set_param(request->canonical, "profile", t);
+	}
 	/* Score threshold */
 	t = quilt_request_getparam(request, "score");
 	if(t && t[0])
@@ -149,6 +157,16 @@ patchwork_query_request(struct query_struct *dest, QUILTREQ *request, const char
 	{
 		dest->score = patchwork->threshold;
 	}
+	/* Properties to include for each result */
+	if(patchwork_fields_request(&(dest->fields), request))
+	{
+		return 500;
+	}
+	/* Languages of the literals to include */
+	if(patchwork_langs_request(&(dest->langs), request))
+	{
+		return 500;
+	}
 	return 200;
 }
 
@@ -158,6 +176,8 @@ patchwork_query_free(struct query_struct *query)
 {
 	free(query->base);
 	free(query->resource);
+	patchwork_fields_free(&(query->fields));
+	patchwork_langs_free(&(query->langs));
 	return 0;
 }
 
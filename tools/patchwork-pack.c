@@ -0,0 +1,545 @@
+/* patchwork-pack: build packfiles from a directory of cached items
+ *
+ * Author: Mo McRoberts <mo.mcroberts@bbc.co.uk>
+ *
+ * Copyright (c) 2014-2017 BBC
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+#include "p_patchwork.h"
+#include "packfile.h"
+
+/* Usage: patchwork-pack [-s SEGMENT-MB] CACHE-DIR
+ *
+ * Each item in CACHE-DIR (a file named by its 32-character ID, optionally
+ * with a .zst suffix if it is Zstandard-compressed) is appended to a
+ * segment, in ID order, and the index is written once all of the segments
+ * are complete. Items with an expiry time in their metadata (graphs
+ * synthesised from the database) are left out, as the packed copies have
+ * no metadata of their own.
+ *
+ * The segments are a new generation, written alongside those referred to
+ * by the current index, which are only removed once the new index has
+ * been renamed into place: a running server which has mapped the previous
+ * set of packfiles is unaffected until it is restarted, and one which
+ * starts while the packfiles are being written uses the previous set.
+ */
+
+#define DEFAULT_SEGMENT_SIZE            1024
+
+struct entry_struct
+{
+	unsigned char id[PACK_ID_SIZE];
+	char *name;
+	uint32_t segment;
+	uint32_t flags;
+	uint64_t offset;
+	uint64_t length;
+};
+
+static const char *short_program_name = "patchwork-pack";
+
+static int pack_scan(const char *dir, struct entry_struct **entries, size_t *count);
+static int pack_expires(const char *dir, const char *name);
+static int pack_entrycmp(const void *a, const void *b);
+static uint32_t pack_generation(const char *dir);
+static int pack_write_segments(const char *dir, struct entry_struct *entries, size_t *count, uint64_t limit, uint32_t generation, uint32_t *nsegments);
+static int pack_copy(int out, const char *dir, struct entry_struct *entry);
+static int pack_write_index(const char *dir, struct entry_struct *entries, size_t count, uint32_t generation, uint32_t nsegments);
+static void pack_prune(const char *dir, uint32_t generation);
+static int pack_commit(const char *tmppath, const char *path);
+
+int
+main(int argc, char **argv)
+{
+	struct entry_struct *entries;
+	size_t count, n;
+	uint32_t generation, nsegments;
+	unsigned long mb;
+	char *dir;
+	int c;
+
+	if(argv[0])
+	{
+		short_program_name = strrchr(argv[0], '/');
+		short_program_name = (short_program_name ? short_program_name + 1 : argv[0]);
+	}
+	mb = DEFAULT_SEGMENT_SIZE;
+	while((c = getopt(argc, argv, "hs:")) != -1)
+	{
+		switch(c)
+		{
+		case 's':
+			mb = strtoul(optarg, NULL, 10);
+			if(!mb)
+			{
+				fprintf(stderr, "%s: invalid segment size '%s'\n", short_program_name, optarg);
+				return 1;
+			}
+			break;
+		case 'h':
+		default:
+			fprintf(stderr, "Usage: %s [-s SEGMENT-MB] CACHE-DIR\n", short_program_name);
+			return (c == 'h' ? 0 : 1);
+		}
+	}
+	if(optind + 1 != argc)
+	{
+		fprintf(stderr, "Usage: %s [-s SEGMENT-MB] CACHE-DIR\n", short_program_name);
+		return 1;
+	}
+	dir = (char *) malloc(strlen(argv[optind]) + 2);
+	if(!dir)
+	{
+		perror(short_program_name);
+		return 1;
+	}
+	strcpy(dir, argv[optind]);
+	if(!dir[0] || dir[strlen(dir) - 1] != '/')
+	{
+		strcat(dir, "/");
+	}
+	if(pack_scan(dir, &entries, &count))
+	{
+		return 1;
+	}
+	qsort(entries, count, sizeof(struct entry_struct), pack_entrycmp);
+	for(n = 1; n < count; n++)
+	{
+		if(!memcmp(entries[n - 1].id, entries[n].id, PACK_ID_SIZE))
+		{
+			fprintf(stderr, "%s: %s and %s are the same item; remove one of them and try again\n", short_program_name, entries[n - 1].name, entries[n].name);
+			return 1;
+		}
+	}
+	generation = pack_generation(dir) + 1;
+	if(pack_write_segments(dir, entries, &count, (uint64_t) mb * 1024 * 1024, generation, &nsegments) ||
+	   pack_write_index(dir, entries, count, generation, nsegments))
+	{
+		return 1;
+	}
+	pack_prune(dir, generation);
+	fprintf(stderr, "%s: packed %lu items into %lu segments\n", short_program_name, (unsigned long) count, (unsigned long) nsegments);
+	for(n = 0; n < count; n++)
+	{
+		free(entries[n].name);
+	}
+	free(entries);
+	free(dir);
+	return 0;
+}
+
+/* Find all of the cached items in a directory */
+static int
+pack_scan(const char *dir, struct entry_struct **entries, size_t *count)
+{
+	DIR *d;
+	struct dirent *de;
+	struct entry_struct *p;
+	char idbuf[PACK_ID_SIZE * 2 + 1];
+	PATCHWORKID id;
+	size_t size, l;
+
+	*entries = NULL;
+	*count = 0;
+	size = 0;
+	d = opendir(dir);
+	if(!d)
+	{
+		fprintf(stderr, "%s: %s: %s\n", short_program_name, dir, strerror(errno));
+		return -1;
+	}
+	while((de = readdir(d)))
+	{
+		l = strlen(de->d_name);
+		if(l != PACK_ID_SIZE * 2 && (l != PACK_ID_SIZE * 2 + 4 || strcmp(de->d_name + PACK_ID_SIZE * 2, ".zst")))
+		{
+			continue;
+		}
+		if(*count == size)
+		{
+			p = (struct entry_struct *) realloc(*entries, sizeof(struct entry_struct) * (size + 4096));
+			if(!p)
+			{
+				perror(short_program_name);
+				closedir(d);
+				return -1;
+			}
+			*entries = p;
+			size += 4096;
+		}
+		/* Parse only the ID, without any extension */
+		memcpy(idbuf, de->d_name, PACK_ID_SIZE * 2);
+		idbuf[PACK_ID_SIZE * 2] = 0;
+		if(patchwork_id_parse(&id, idbuf) || pack_expires(dir, de->d_name))
+		{
+			continue;
+		}
+		p = &((*entries)[*count]);
+		memset(p, 0, sizeof(struct entry_struct));
+		pack_putid(p->id, id.hi, id.lo);
+		p->name = strdup(de->d_name);
+		if(!p->name)
+		{
+			perror(short_program_name);
+			closedir(d);
+			return -1;
+		}
+		if(l > PACK_ID_SIZE * 2)
+		{
+			p->flags |= PACK_FLAG_ZSTD;
+		}
+		(*count)++;
+	}
+	closedir(d);
+	return 0;
+}
+
+/* Determine whether the metadata for a cached item gives an expiry time */
+static int
+pack_expires(const char *dir, const char *name)
+{
+	char line[256];
+	char *path;
+	FILE *f;
+	int r;
+
+	path = (char *) malloc(strlen(dir) + strlen(name) + 6);
+	if(!path)
+	{
+		return 0;
+	}
+	sprintf(path, "%s%s.meta", dir, name);
+	f = fopen(path, "r");
+	free(path);
+	if(!f)
+	{
+		return 0;
+	}
+	r = 0;
+	while(!r && fgets(line, sizeof(line), f))
+	{
+		r = !strncasecmp(line, "Expires:", 8);
+	}
+	fclose(f);
+	return r;
+}
+
+static int
+pack_entrycmp(const void *a, const void *b)
+{
+	return memcmp(((const struct entry_struct *) a)->id, ((const struct entry_struct *) b)->id, PACK_ID_SIZE);
+}
+
+/* Determine the generation of the segments referred to by the current
+ * index, if any (zero for a version 1 index, or if there is none)
+ */
+static uint32_t
+pack_generation(const char *dir)
+{
+	unsigned char buf[PACK_HEADER_SIZE];
+	char *path;
+	FILE *f;
+	uint32_t generation;
+
+	path = (char *) malloc(strlen(dir) + 32);
+	if(!path)
+	{
+		return 0;
+	}
+	sprintf(path, "%s%s", dir, PACK_INDEX_NAME);
+	f = fopen(path, "rb");
+	free(path);
+	if(!f)
+	{
+		return 0;
+	}
+	generation = 0;
+	if(fread(buf, PACK_HEADER_SIZE, 1, f) == 1 && !memcmp(buf, PACK_MAGIC, 8) &&
+	   pack_get32(buf + 8) == PACK_VERSION)
+	{
+		generation = pack_get32(buf + 24);
+	}
+	fclose(f);
+	return generation;
+}
+
+/* Append each item to a segment, starting a new segment whenever the
+ * current one reaches the size limit; items which have been removed since
+ * the directory was scanned are dropped from the list
+ */
+static int
+pack_write_segments(const char *dir, struct entry_struct *entries, size_t *count, uint64_t limit, uint32_t generation, uint32_t *nsegments)
+{
+	char *path, *tmppath;
+	uint64_t offset;
+	size_t n, kept;
+	int out, r;
+
+	path = (char *) malloc(strlen(dir) + 32);
+	tmppath = (char *) malloc(strlen(dir) + 32);
+	if(!path || !tmppath)
+	{
+		perror(short_program_name);
+		return -1;
+	}
+	*nsegments = 0;
+	out = -1;
+	offset = 0;
+	kept = 0;
+	for(n = 0; n < *count; n++)
+	{
+		if(out != -1 && offset >= limit)
+		{
+			if(close(out) || pack_commit(tmppath, path))
+			{
+				fprintf(stderr, "%s: %s: %s\n", short_program_name, tmppath, strerror(errno));
+				return -1;
+			}
+			out = -1;
+		}
+		if(out == -1)
+		{
+			sprintf(path, "%s" PACK_SEGMENT_NAME, dir, (unsigned) generation, (unsigned) *nsegments);
+			sprintf(tmppath, "%s.tmp", path);
+			out = open(tmppath, O_WRONLY|O_CREAT|O_TRUNC, 0644);
+			if(out == -1)
+			{
+				fprintf(stderr, "%s: %s: %s\n", short_program_name, tmppath, strerror(errno));
+				return -1;
+			}
+			(*nsegments)++;
+			offset = 0;
+		}
+		entries[n].segment = *nsegments - 1;
+		entries[n].offset = offset;
+		r = pack_copy(out, dir, &(entries[n]));
+		if(r < 0)
+		{
+			close(out);
+			unlink(tmppath);
+			return -1;
+		}
+		if(r)
+		{
+			/* The item has been removed from the cache */
+			free(entries[n].name);
+			continue;
+		}
+		offset += entries[n].length;
+		entries[kept] = entries[n];
+		kept++;
+	}
+	*count = kept;
+	if(out != -1 && (close(out) || pack_commit(tmppath, path)))
+	{
+		fprintf(stderr, "%s: %s: %s\n", short_program_name, tmppath, strerror(errno));
+		return -1;
+	}
+	free(path);
+	free(tmppath);
+	return 0;
+}
+
+/* Append the contents of a cached item to a segment, returning 1 if the
+ * item no longer exists
+ */
+static int
+pack_copy(int out, const char *dir, struct entry_struct *entry)
+{
+	char buf[65536];
+	char *path;
+	ssize_t r, w, n;
+	int in;
+
+	path = (char *) malloc(strlen(dir) + strlen(entry->name) + 1);
+	if(!path)
+	{
+		perror(short_program_name);
+		return -1;
+	}
+	sprintf(path, "%s%s", dir, entry->name);
+	in = open(path, O_RDONLY);
+	if(in == -1 && errno == ENOENT)
+	{
+		free(path);
+		return 1;
+	}
+	if(in == -1)
+	{
+		fprintf(stderr, "%s: %s: %s\n", short_program_name, path, strerror(errno));
+		free(path);
+		return -1;
+	}
+	entry->length = 0;
+	while((r = read(in, buf, sizeof(buf))) != 0)
+	{
+		if(r < 0)
+		{
+			if(errno == EINTR)
+			{
+				continue;
+			}
+			fprintf(stderr, "%s: %s: %s\n", short_program_name, path, strerror(errno));
+			close(in);
+			free(path);
+			return -1;
+		}
+		for(n = 0; n < r; n += w)
+		{
+			w = write(out, buf + n, r - n);
+			if(w < 0)
+			{
+				if(errno == EINTR)
+				{
+					w = 0;
+					continue;
+				}
+				fprintf(stderr, "%s: failed to write segment: %s\n", short_program_name, strerror(errno));
+				close(in);
+				free(path);
+				return -1;
+			}
+		}
+		entry->length += r;
+	}
+	close(in);
+	free(path);
+	return 0;
+}
+
+static int
+pack_write_index(const char *dir, struct entry_struct *entries, size_t count, uint32_t generation, uint32_t nsegments)
+{
+	unsigned char buf[PACK_ENTRY_SIZE];
+	char *path, *tmppath;
+	FILE *f;
+	size_t n;
+
+	path = (char *) malloc(strlen(dir) + 32);
+	tmppath = (char *) malloc(strlen(dir) + 32);
+	if(!path || !tmppath)
+	{
+		perror(short_program_name);
+		return -1;
+	}
+	sprintf(path, "%s%s", dir, PACK_INDEX_NAME);
+	sprintf(tmppath, "%s.tmp", path);
+	f = fopen(tmppath, "wb");
+	if(!f)
+	{
+		fprintf(stderr, "%s: %s: %s\n", short_program_name, tmppath, strerror(errno));
+		return -1;
+	}
+	memcpy(buf, PACK_MAGIC, 8);
+	pack_put32(buf + 8, PACK_VERSION);
+	pack_put32(buf + 12, nsegments);
+	pack_put64(buf + 16, (uint64_t) count);
+	pack_put32(buf + 24, generation);
+	pack_put32(buf + 28, 0);
+	fwrite(buf, PACK_HEADER_SIZE, 1, f);
+	for(n = 0; n < count; n++)
+	{
+		memcpy(buf, entries[n].id, PACK_ID_SIZE);
+		pack_put32(buf + 16, entries[n].segment);
+		pack_put32(buf + 20, entries[n].flags);
+		pack_put64(buf + 24, entries[n].offset);
+		pack_put64(buf + 32, entries[n].length);
+		fwrite(buf, PACK_ENTRY_SIZE, 1, f);
+	}
+	if(ferror(f))
+	{
+		fprintf(stderr, "%s: failed to write %s\n", short_program_name, tmppath);
+		fclose(f);
+		unlink(tmppath);
+		return -1;
+	}
+	if(fclose(f) || pack_commit(tmppath, path))
+	{
+		fprintf(stderr, "%s: %s: %s\n", short_program_name, path, strerror(errno));
+		unlink(tmppath);
+		return -1;
+	}
+	free(path);
+	free(tmppath);
+	return 0;
+}
+
+/* Remove any segments which don't belong to the current generation,
+ * including those left behind by an unsuccessful run
+ */
+static void
+pack_prune(const char *dir, uint32_t generation)
+{
+	DIR *d;
+	struct dirent *de;
+	char prefix[32];
+	char *path;
+	size_t l;
+
+	sprintf(prefix, "pack-%u-", (unsigned) generation);
+	d = opendir(dir);
+	if(!d)
+	{
+		fprintf(stderr, "%s: %s: %s\n", short_program_name, dir, strerror(errno));
+		return;
+	}
+	while((de = readdir(d)))
+	{
+		l = strlen(de->d_name);
+		if(strncmp(de->d_name, "pack-", 5) || !strncmp(de->d_name, prefix, strlen(prefix)) ||
+		   ((l < 4 || strcmp(de->d_name + l - 4, ".dat")) && (l < 8 || strcmp(de->d_name + l - 8, ".dat.tmp"))))
+		{
+			continue;
+		}
+		path = (char *) malloc(strlen(dir) + l + 1);
+		if(!path)
+		{
+			break;
+		}
+		sprintf(path, "%s%s", dir, de->d_name);
+		if(unlink(path))
+		{
+			fprintf(stderr, "%s: %s: %s\n", short_program_name, path, strerror(errno));
+		}
+		free(path);
+	}
+	closedir(d);
+}
+
+/* Rename a completed file into place */
+static int
+pack_commit(const char *tmppath, const char *path)
+{
+	if(rename(tmppath, path))
+	{
+		unlink(tmppath);
+		return -1;
+	}
+	return 0;
+}
@@ -0,0 +1,573 @@
+/* patchwork-quads: convert N-Quads to the binary quad format
+ *
+ * Author: Mo McRoberts <mo.mcroberts@bbc.co.uk>
+ *
+ * Copyright (c) 2014-2017 BBC
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <librdf.h>
+
+#include "quadfile.h"
+#include "segfile.h"
+
+/* Usage: patchwork-quads [-s] [-o OUTPUT] [INPUT]
+ *
+ * Reads an item graph as N-Quads (from INPUT, or standard input) and
+ * writes it in the binary quad format described in quadfile.h (to OUTPUT,
+ * or standard output). The output can be compressed with zstd and stored
+ * in place of the original object: it should be given the MIME type
+ * application/x-patchwork-quads when uploaded to S3.
+ *
+ * With -s, each named graph is written as a separate segment of a
+ * segmented object (see segfile.h), so that sub-resources of the item can
+ * be retrieved individually. Segmented objects must not be compressed, and
+ * should be given the MIME type application/x-patchwork-segments.
+ */
+
+struct term_struct
+{
+	/* The kind, followed by the value and any datatype or language, used
+	 * as the dictionary key */
+	char *key;
+	size_t keylen;
+	/* The length of the value, which may contain NULs if it's a literal */
+	size_t vlen;
+	unsigned long long hash;
+	uint32_t index;
+	struct term_struct *chain;
+};
+
+struct dict_struct
+{
+	struct term_struct **buckets;
+	size_t nbuckets;
+	struct term_struct **terms;
+	size_t nterms;
+	size_t size;
+	unsigned char *quads;
+	size_t nquads;
+	size_t quadsize;
+};
+
+/* The quads in a single named graph, for segmented output */
+struct segment_struct
+{
+	char *name;
+	struct dict_struct dict;
+};
+
+struct segments_struct
+{
+	struct segment_struct *segments;
+	size_t count;
+};
+
+static const char *short_program_name = "patchwork-quads";
+
+static char *quads_read(FILE *f, size_t *len);
+static int quads_add_node(struct dict_struct *dict, librdf_node *node, uint32_t *index);
+static int quads_add_term(struct dict_struct *dict, int kind, const char *value, size_t vlen, const char *extra, uint32_t dt, uint32_t *index);
+static int quads_add_quad(struct dict_struct *dict, const uint32_t *q);
+static int quads_write(FILE *f, struct dict_struct *dict);
+static size_t quads_size(struct dict_struct *dict);
+static int quads_dict_init(struct dict_struct *dict);
+static struct dict_struct *segs_dict(struct segments_struct *segs, librdf_node *context);
+static int segs_write(FILE *f, struct segments_struct *segs);
+
+int
+main(int argc, char **argv)
+{
+	librdf_world *world;
+	librdf_parser *parser;
+	librdf_stream *stream;
+	librdf_statement *st;
+	librdf_node *context;
+	librdf_uri *base;
+	struct dict_struct dict, *d;
+	struct segments_struct segs;
+	const char *output;
+	uint32_t q[4];
+	char *buf;
+	size_t len, n, nquads, nterms;
+	FILE *f;
+	int c, r, segmented;
+
+	if(argv[0])
+	{
+		short_program_name = strrchr(argv[0], '/');
+		short_program_name = (short_program_name ? short_program_name + 1 : argv[0]);
+	}
+	output = NULL;
+	segmented = 0;
+	while((c = getopt(argc, argv, "ho:s")) != -1)
+	{
+		switch(c)
+		{
+		case 'o':
+			output = optarg;
+			break;
+		case 's':
+			segmented = 1;
+			break;
+		case 'h':
+		default:
+			fprintf(stderr, "Usage: %s [-s] [-o OUTPUT] [INPUT]\n", short_program_name);
+			return (c == 'h' ? 0 : 1);
+		}
+	}
+	if(argc - optind > 1)
+	{
+		fprintf(stderr, "Usage: %s [-s] [-o OUTPUT] [INPUT]\n", short_program_name);
+		return 1;
+	}
+	f = (optind < argc ? fopen(argv[optind], "rb") : stdin);
+	if(!f)
+	{
+		fprintf(stderr, "%s: %s: %s\n", short_program_name, argv[optind], strerror(errno));
+		return 1;
+	}
+	buf = quads_read(f, &len);
+	if(f != stdin)
+	{
+		fclose(f);
+	}
+	if(!buf)
+	{
+		return 1;
+	}
+	world = librdf_new_world();
+	librdf_world_open(world);
+	parser = librdf_new_parser(world, "nquads", NULL, NULL);
+	base = librdf_new_uri(world, (const unsigned char *) "file:///");
+	if(!parser || !base)
+	{
+		fprintf(stderr, "%s: failed to create N-Quads parser\n", short_program_name);
+		return 1;
+	}
+	memset(&segs, 0, sizeof(struct segments_struct));
+	if(quads_dict_init(&dict))
+	{
+		return 1;
+	}
+	stream = librdf_parser_parse_counted_string_as_stream(parser, (const unsigned char *) buf, len, base);
+	if(!stream)
+	{
+		fprintf(stderr, "%s: failed to parse input as N-Quads\n", short_program_name);
+		return 1;
+	}
+	r = 0;
+	for(; !r && !librdf_stream_end(stream); librdf_stream_next(stream))
+	{
+		st = librdf_stream_get_object(stream);
+		context = (librdf_node *) librdf_stream_get_context2(stream);
+		d = (segmented ? segs_dict(&segs, context) : &dict);
+		if(!d)
+		{
+			r = 1;
+			break;
+		}
+		q[3] = QUADS_NONE;
+		r = quads_add_node(d, librdf_statement_get_subject(st), &(q[0])) ||
+			quads_add_node(d, librdf_statement_get_predicate(st), &(q[1])) ||
+			quads_add_node(d, librdf_statement_get_object(st), &(q[2])) ||
+			(context && quads_add_node(d, context, &(q[3]))) ||
+			quads_add_quad(d, q);
+	}
+	librdf_free_stream(stream);
+	if(r)
+	{
+		return 1;
+	}
+	f = (output ? fopen(output, "wb") : stdout);
+	if(!f)
+	{
+		fprintf(stderr, "%s: %s: %s\n", short_program_name, output, strerror(errno));
+		return 1;
+	}
+	if((segmented ? segs_write(f, &segs) : quads_write(f, &dict)) || (f != stdout && fclose(f)) || (f == stdout && fflush(f)))
+	{
+		fprintf(stderr, "%s: failed to write output: %s\n", short_program_name, strerror(errno));
+		return 1;
+	}
+	if(segmented)
+	{
+		nquads = nterms = 0;
+		for(n = 0; n < segs.count; n++)
+		{
+			nquads += segs.segments[n].dict.nquads;
+			nterms += segs.segments[n].dict.nterms;
+		}
+		fprintf(stderr, "%s: wrote %lu quads using %lu terms in %lu segments\n", short_program_name, (unsigned long) nquads, (unsigned long) nterms, (unsigned long) segs.count);
+	}
+	else
+	{
+		fprintf(stderr, "%s: wrote %lu quads using %lu terms\n", short_program_name, (unsigned long) dict.nquads, (unsigned long) dict.nterms);
+	}
+	librdf_free_uri(base);
+	librdf_free_parser(parser);
+	librdf_free_world(world);
+	free(buf);
+	return 0;
+}
+
+static char *
+quads_read(FILE *f, size_t *len)
+{
+	char *buf, *p;
+	size_t size, r;
+
+	buf = NULL;
+	size = 0;
+	*len = 0;
+	do
+	{
+		if(size - *len < 65536)
+		{
+			p = (char *) realloc(buf, size ? size * 2 : 65536);
+			if(!p)
+			{
+				perror(short_program_name);
+				free(buf);
+				return NULL;
+			}
+			buf = p;
+			size = (size ? size * 2 : 65536);
+		}
+		r = fread(buf + *len, 1, size - *len - 1, f);
+		*len += r;
+	}
+	while(r);
+	if(ferror(f))
+	{
+		fprintf(stderr, "%s: failed to read input: %s\n", short_program_name, strerror(errno));
+		free(buf);
+		return NULL;
+	}
+	buf[*len] = 0;
+	return buf;
+}
+
+/* Add a node to the dictionary (if it isn't already present) */
+static int
+quads_add_node(struct dict_struct *dict, librdf_node *node, uint32_t *index)
+{
+	librdf_uri *dturi;
+	const char *lang, *value, *dtstr;
+	size_t vlen;
+	uint32_t dt;
+
+	if(librdf_node_is_resource(node))
+	{
+		value = (const char *) librdf_uri_as_string(librdf_node_get_uri(node));
+		return quads_add_term(dict, QUADS_URI, value, strlen(value), NULL, 0, index);
+	}
+	if(librdf_node_is_blank(node))
+	{
+		value = (const char *) librdf_node_get_blank_identifier(node);
+		return quads_add_term(dict, QUADS_BLANK, value, strlen(value), NULL, 0, index);
+	}
+	if(!librdf_node_is_literal(node))
+	{
+		fprintf(stderr, "%s: unsupported node type\n", short_program_name);
+		return -1;
+	}
+	value = (const char *) librdf_node_get_literal_value_as_counted_string(node, &vlen);
+	lang = librdf_node_get_literal_value_language(node);
+	dturi = librdf_node_get_literal_value_datatype_uri(node);
+	if(lang && lang[0])
+	{
+		return quads_add_term(dict, QUADS_LANG, value, vlen, lang, 0, index);
+	}
+	if(dturi)
+	{
+		dtstr = (const char *) librdf_uri_as_string(dturi);
+		if(quads_add_term(dict, QUADS_URI, dtstr, strlen(dtstr), NULL, 0, &dt))
+		{
+			return -1;
+		}
+		return quads_add_term(dict, QUADS_TYPED, value, vlen, NULL, dt, index);
+	}
+	return quads_add_term(dict, QUADS_LITERAL, value, vlen, NULL, 0, index);
+}
+
+static int
+quads_add_term(struct dict_struct *dict, int kind, const char *value, size_t vlen, const char *extra, uint32_t dt, uint32_t *index)
+{
+	struct term_struct *term, **p;
+	unsigned long long h;
+	size_t elen, keylen, c;
+	char *key;
+
+	elen = (extra ? strlen(extra) : 0);
+	keylen = 1 + vlen + 1 + elen + 4;
+	key = (char *) malloc(keylen);
+	if(!key)
+	{
+		perror(short_program_name);
+		return -1;
+	}
+	key[0] = kind;
+	memcpy(key + 1, value, vlen);
+	key[1 + vlen] = 0;
+	if(extra)
+	{
+		memcpy(key + 1 + vlen + 1, extra, elen);
+	}
+	pack_put32((unsigned char *) key + 1 + vlen + 1 + elen, dt);
+	/* FNV-1a */
+	h = 14695981039346656037ULL;
+	for(c = 0; c < keylen; c++)
+	{
+		h ^= (unsigned char) key[c];
+		h *= 1099511628211ULL;
+	}
+	for(term = dict->buckets[h % dict->nbuckets]; term; term = term->chain)
+	{
+		if(term->hash == h && term->keylen == keylen && term->vlen == vlen && !memcmp(term->key, key, keylen))
+		{
+			free(key);
+			*index = term->index;
+			return 0;
+		}
+	}
+	if(dict->nterms == dict->size)
+	{
+		p = (struct term_struct **) realloc(dict->terms, sizeof(struct term_struct *) * (dict->size + 4096));
+		if(!p)
+		{
+			perror(short_program_name);
+			free(key);
+			return -1;
+		}
+		dict->terms = p;
+		dict->size += 4096;
+	}
+	term = (struct term_struct *) calloc(1, sizeof(struct term_struct));
+	if(!term)
+	{
+		perror(short_program_name);
+		free(key);
+		return -1;
+	}
+	term->key = key;
+	term->keylen = keylen;
+	term->vlen = vlen;
+	term->hash = h;
+	term->index = (uint32_t) dict->nterms;
+	term->chain = dict->buckets[h % dict->nbuckets];
+	dict->buckets[h % dict->nbuckets] = term;
+	dict->terms[dict->nterms] = term;
+	dict->nterms++;
+	*index = term->index;
+	return 0;
+}
+
+static int
+quads_add_quad(struct dict_struct *dict, const uint32_t *q)
+{
+	unsigned char *p;
+	size_t c;
+
+	if((dict->nquads + 1) * QUADS_QUAD_SIZE > dict->quadsize)
+	{
+		p = (unsigned char *) realloc(dict->quads, dict->quadsize + 65536);
+		if(!p)
+		{
+			perror(short_program_name);
+			return -1;
+		}
+		dict->quads = p;
+		dict->quadsize += 65536;
+	}
+	p = dict->quads + dict->nquads * QUADS_QUAD_SIZE;
+	for(c = 0; c < 4; c++)
+	{
+		pack_put32(p + c * 4, q[c]);
+	}
+	dict->nquads++;
+	return 0;
+}
+
+static int
+quads_write(FILE *f, struct dict_struct *dict)
+{
+	unsigned char buf[QUADS_HEADER_SIZE];
+	struct term_struct *term;
+	size_t c, vlen, elen;
+
+	memset(buf, 0, sizeof(buf));
+	memcpy(buf, QUADS_MAGIC, QUADS_MAGIC_SIZE);
+	pack_put32(buf + 8, QUADS_VERSION);
+	pack_put32(buf + 16, (uint32_t) dict->nterms);
+	pack_put32(buf + 20, (uint32_t) dict->nquads);
+	fwrite(buf, QUADS_HEADER_SIZE, 1, f);
+	for(c = 0; c < dict->nterms; c++)
+	{
+		term = dict->terms[c];
+		vlen = term->vlen;
+		buf[0] = term->key[0];
+		pack_put32(buf + 1, (uint32_t) vlen);
+		fwrite(buf, 5, 1, f);
+		fwrite(term->key + 1, vlen + 1, 1, f);
+		if(term->key[0] == QUADS_TYPED)
+		{
+			fwrite(term->key + term->keylen - 4, 4, 1, f);
+		}
+		else if(term->key[0] == QUADS_LANG)
+		{
+			elen = term->keylen - 1 - vlen - 1 - 4;
+			pack_put32(buf, (uint32_t) elen);
+			fwrite(buf, 4, 1, f);
+			fwrite(term->key + 1 + vlen + 1, elen, 1, f);
+			fputc(0, f);
+		}
+	}
+	fwrite(dict->quads, QUADS_QUAD_SIZE, dict->nquads, f);
+	return (ferror(f) ? -1 : 0);
+}
+
+/* Determine the number of bytes quads_write() will write */
+static size_t
+quads_size(struct dict_struct *dict)
+{
+	struct term_struct *term;
+	size_t c, size, vlen;
+
+	size = QUADS_HEADER_SIZE + dict->nquads * QUADS_QUAD_SIZE;
+	for(c = 0; c < dict->nterms; c++)
+	{
+		term = dict->terms[c];
+		vlen = term->vlen;
+		size += 5 + vlen + 1;
+		if(term->key[0] == QUADS_TYPED)
+		{
+			size += 4;
+		}
+		else if(term->key[0] == QUADS_LANG)
+		{
+			size += 4 + (term->keylen - 1 - vlen - 1 - 4) + 1;
+		}
+	}
+	return size;
+}
+
+static int
+quads_dict_init(struct dict_struct *dict)
+{
+	memset(dict, 0, sizeof(struct dict_struct));
+	dict->nbuckets = 4096;
+	dict->buckets = (struct term_struct **) calloc(dict->nbuckets, sizeof(struct term_struct *));
+	if(!dict->buckets)
+	{
+		perror(short_program_name);
+		return -1;
+	}
+	return 0;
+}
+
+/* Return the dictionary for the segment holding the graph context, adding
+ * a new segment if needed
+ */
+static struct dict_struct *
+segs_dict(struct segments_struct *segs, librdf_node *context)
+{
+	struct segment_struct *p;
+	const char *name;
+	size_t c;
+
+	name = "";
+	if(context && librdf_node_is_resource(context))
+	{
+		name = (const char *) librdf_uri_as_string(librdf_node_get_uri(context));
+	}
+	for(c = 0; c < segs->count; c++)
+	{
+		if(!strcmp(segs->segments[c].name, name))
+		{
+			return &(segs->segments[c].dict);
+		}
+	}
+	p = (struct segment_struct *) realloc(segs->segments, sizeof(struct segment_struct) * (segs->count + 1));
+	if(!p)
+	{
+		perror(short_program_name);
+		return NULL;
+	}
+	segs->segments = p;
+	p = &(segs->segments[segs->count]);
+	p->name = strdup(name);
+	if(!p->name || quads_dict_init(&(p->dict)))
+	{
+		perror(short_program_name);
+		return NULL;
+	}
+	segs->count++;
+	return &(p->dict);
+}
+
+/* Write the segments as a segmented object: the header and index, then
+ * each segment in the binary quad format
+ */
+static int
+segs_write(FILE *f, struct segments_struct *segs)
+{
+	unsigned char buf[SEGS_HEADER_SIZE];
+	size_t c, indexsize, offset, len;
+
+	indexsize = SEGS_HEADER_SIZE;
+	for(c = 0; c < segs->count; c++)
+	{
+		indexsize += 12 + strlen(segs->segments[c].name) + 1;
+	}
+	memset(buf, 0, sizeof(buf));
+	memcpy(buf, SEGS_MAGIC, SEGS_MAGIC_SIZE);
+	pack_put32(buf + 8, SEGS_VERSION);
+	pack_put32(buf + 12, (uint32_t) segs->count);
+	pack_put32(buf + 16, (uint32_t) indexsize);
+	fwrite(buf, SEGS_HEADER_SIZE, 1, f);
+	offset = indexsize;
+	for(c = 0; c < segs->count; c++)
+	{
+		len = quads_size(&(segs->segments[c].dict));
+		if(offset + len > 0xffffffff)
+		{
+			fprintf(stderr, "%s: segmented objects are limited to 4GiB\n", short_program_name);
+			return -1;
+		}
+		pack_put32(buf, (uint32_t) offset);
+		pack_put32(buf + 4, (uint32_t) len);
+		pack_put32(buf + 8, (uint32_t) strlen(segs->segments[c].name));
+		fwrite(buf, 12, 1, f);
+		fwrite(segs->segments[c].name, strlen(segs->segments[c].name) + 1, 1, f);
+		offset += len;
+	}
+	for(c = 0; c < segs->count; c++)
+	{
+		if(quads_write(f, &(segs->segments[c].dict)))
+		{
+			return -1;
+		}
+	}
+	return (ferror(f) ? -1 : 0);
+}